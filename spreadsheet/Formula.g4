@@ -1 +1,47 @@
- 
\ No newline at end of file
+grammar Formula;
+
+main
+    : expr EOF
+    ;
+
+expr
+    : '(' expr ')'  # Parens
+    | (ADD | SUB) expr  # UnaryOp
+    | expr (MUL | DIV) expr  # BinaryOp
+    | expr (ADD | SUB) expr  # BinaryOp
+    | FUNCTION '(' arg (',' arg)* ')'  # Function
+    | SHEET? CELL  # Cell
+    | NUMBER  # Literal
+    | REF_ERROR  # RefError
+    ;
+
+// A1:B10 - range of cells, only allowed as an argument of a function;
+// #REF! stands for a range that was moved off the sheet
+arg
+    : (CELL ':' CELL | REF_ERROR)  # Range
+    | expr  # Argument
+    ;
+
+fragment INT: [-+]? UINT ;
+fragment UINT: [0-9]+ ;
+fragment EXPONENT: [eE] INT;
+NUMBER
+    : UINT EXPONENT?
+    | UINT? '.' UINT EXPONENT?
+    ;
+
+ADD: '+' ;
+SUB: '-' ;
+MUL: '*' ;
+DIV: '/' ;
+LPAREN: '(' ;
+RPAREN: ')' ;
+COMMA: ',' ;
+COLON: ':' ;
+// Sheet2!A1 - reference to a cell of another sheet of the workbook
+SHEET: [A-Za-z_][A-Za-z0-9_]* '!' ;
+CELL: [A-Z]+[0-9]+ ;
+FUNCTION: [A-Z]+ ;
+// A reference that was moved off the sheet
+REF_ERROR: '#REF!' ;
+WS: [ \t\n\r]+ -> skip ;
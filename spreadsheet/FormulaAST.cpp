@@ -1,15 +1,18 @@
 #include "FormulaAST.h"
 
+#include "cell.h"
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
-#include "cell.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <functional>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <vector>
 
 namespace ASTImpl {
 
@@ -68,12 +71,63 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
+// The references of a copy of a tree with every reference moved, as when a
+// formula is copied to another cell or rows of its sheet are inserted
+struct ShiftContext {
+    // The new place of a reference to a cell of the formula's own sheet
+    // (sheet is nullptr) or of another sheet, std::nullopt when it is gone
+    std::function<std::optional<Position>(Position pos, const std::string* sheet)> move_cell;
+    // The same for a range, which always belongs to the formula's own sheet
+    std::function<std::optional<CellRange>(const CellRange& range)> move_range;
+    CellList cells;
+    SheetCellList sheet_cells;
+    RangeList ranges;
+};
+
 class Expr {
 public:
     virtual ~Expr() = default;
+
+    static void* operator new(size_t size) {
+        AllocationScope::Add(size);
+        return ::operator new(size);
+    }
     virtual void Print(std::ostream& out) const = 0;
     virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const SheetInterface& sheet) const = 0;
+    // slots - see FormulaInterface::Evaluate; nullptr when the formula is
+    // evaluated by positions
+    virtual double Evaluate(const SheetInterface& sheet, const CellSlot* slots) const = 0;
+
+    // Stores in every reference to a cell of the same sheet the index of that
+    // cell in cells, the sorted list of unique referenced cells
+    virtual void AssignSlots(const std::vector<Position>& cells) = 0;
+
+    // Returns the evaluation form of the subtree: constant subtrees folded,
+    // division by constants simplified and left-nested chains of binary
+    // operations flattened. Evaluation order, the #DIV/0! checks and the
+    // results are the same as for the original subtree; operands are never
+    // reordered. changed is set when the result differs from a plain copy.
+    virtual std::unique_ptr<Expr> Optimize(bool& changed) const = 0;
+
+    // Returns a copy of the subtree with the references moved by context and
+    // added to its lists; a reference that is gone becomes #REF!
+    virtual std::unique_ptr<Expr> Shift(ShiftContext& context) const = 0;
+
+    // The value of a folded constant, std::nullopt for other nodes
+    virtual std::optional<double> GetConstant() const {
+        return std::nullopt;
+    }
+
+    // The value of the subtree as a lookup key: a reference to a text cell
+    // gives its text (or the number it represents), other nodes a number
+    virtual LookupKey EvaluateKey(const SheetInterface& sheet, const CellSlot* slots) const {
+        return Evaluate(sheet, slots);
+    }
+
+    // The range of a range argument, nullptr for other nodes
+    virtual const CellRange* GetRange() const {
+        return nullptr;
+    }
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
@@ -143,24 +197,49 @@ public:
         }
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
+    double Evaluate(const SheetInterface& sheet, const CellSlot* slots) const override {
+        if (type_ == Divide) {
+            double right_result = rhs_->Evaluate(sheet, slots);
+            CheckDivisor(right_result);
+            return lhs_->Evaluate(sheet, slots) / right_result;
+        }
+        return Apply(type_, lhs_->Evaluate(sheet, slots), rhs_->Evaluate(sheet, slots));
+    }
+
+    void AssignSlots(const std::vector<Position>& cells) override {
+        lhs_->AssignSlots(cells);
+        rhs_->AssignSlots(cells);
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& changed) const override;
+
+    std::unique_ptr<Expr> Shift(ShiftContext& context) const override {
+        auto lhs = lhs_->Shift(context);
+        return std::make_unique<BinaryOpExpr>(type_, std::move(lhs), rhs_->Shift(context));
+    }
+
+    static void CheckDivisor(double divisor) {
+        if (divisor < std::numeric_limits<double>::epsilon()) {
+        //if (divisor == 0) {  //для тренажера
+            throw FormulaError(FormulaError::Category::Div0);
+        }
+    }
+
+    // The operation on evaluated operands, with the same checks as Evaluate
+    static double Apply(Type type, double lhs, double rhs) {
         double result = 0.0;
-        if (type_ == Add) {
-            result = lhs_->Evaluate(sheet) + rhs_->Evaluate(sheet);
+        if (type == Add) {
+            result = lhs + rhs;
         }
-        else if (type_ == Subtract) {
-            result = lhs_->Evaluate(sheet) - rhs_->Evaluate(sheet);
+        else if (type == Subtract) {
+            result = lhs - rhs;
         }
-        else if (type_ == Multiply) {
-            result = lhs_->Evaluate(sheet) * rhs_->Evaluate(sheet);
+        else if (type == Multiply) {
+            result = lhs * rhs;
         }
-        else if (type_ == Divide) {
-            double right_result = rhs_->Evaluate(sheet);
-            if (right_result < std::numeric_limits<double>::epsilon()) {
-            //if (right_result == 0) {  //для тренажера
-                throw FormulaError(FormulaError::Category::Div0);
-            }
-            return lhs_->Evaluate(sheet) / right_result;
+        else if (type == Divide) {
+            CheckDivisor(rhs);
+            return lhs / rhs;
         }
 
         if (!std::isfinite(result)) {
@@ -203,32 +282,107 @@ public:
         return EP_UNARY;
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
+    double Evaluate(const SheetInterface& sheet, const CellSlot* slots) const override {
         if (type_ == UnaryPlus) {
-            return +operand_->Evaluate(sheet);
+            return +operand_->Evaluate(sheet, slots);
         }
         else if (type_ == UnaryMinus) {
-            return -operand_->Evaluate(sheet);
+            return -operand_->Evaluate(sheet, slots);
         }
         throw std::runtime_error("UNKNOWN TYPE");
     }
 
+    void AssignSlots(const std::vector<Position>& cells) override {
+        operand_->AssignSlots(cells);
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& changed) const override;
+
+    std::unique_ptr<Expr> Shift(ShiftContext& context) const override {
+        return std::make_unique<UnaryOpExpr>(type_, operand_->Shift(context));
+    }
+
 private:
     Type type_;
     std::unique_ptr<Expr> operand_;
 };
 
+// Value of a referenced cell as a number; an empty cell reads as zero
+template <typename CellType>
+double CellToNumber(const CellType* cell) {
+    if (cell == nullptr) {
+        return 0;
+    }
+
+    CellInterface::Value value = cell->GetValue();
+    if (IsType<double>(value)) {
+        return std::get<double>(value);
+    }
+    else if (IsType<FormulaError>(value)) {
+        throw std::get<FormulaError>(value);
+    }
+
+    std::string text = cell->GetText();
+    if (text.empty()) {
+        return 0;
+    }
+    std::istringstream istr(text);
+    try {
+        return ParseNumber(istr);
+    }
+    catch (const ParsingError&) {
+        throw FormulaError(FormulaError::Category::Value);
+    }
+}
+
+// A reference that was moved off the sheet
+class RefErrorExpr final : public Expr {
+public:
+    void Print(std::ostream& out) const override {
+        out << FormulaError::Category::Ref;
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate([[maybe_unused]] const SheetInterface& sheet, const CellSlot* /* slots */) const override {
+        throw FormulaError(FormulaError::Category::Ref);
+    }
+
+    void AssignSlots(const std::vector<Position>& /* cells */) override {
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& /* changed */) const override {
+        return std::make_unique<RefErrorExpr>();
+    }
+
+    std::unique_ptr<Expr> Shift(ShiftContext& /* context */) const override {
+        return std::make_unique<RefErrorExpr>();
+    }
+};
+
 class CellExpr final : public Expr {
 public:
-    explicit CellExpr(const Position* cell)
-        : cell_(cell) {
+    explicit CellExpr(const Position* cell, const std::string* sheet = nullptr, size_t slot = 0)
+        : cell_(cell)
+        , sheet_(sheet)
+        , slot_(slot) {
     }
 
     void Print(std::ostream& out) const override {
+        if (sheet_ != nullptr) {
+            out << *sheet_ << '!';
+        }
         if (!cell_->IsValid()) {
             out << FormulaError::Category::Ref;
         } else {
-            out << cell_->ToString();
+            char name[Position::MAX_STRING_LENGTH];
+            out.write(name, static_cast<std::streamsize>(cell_->ToString(name)));
         }
     }
 
@@ -240,51 +394,71 @@ public:
         return EP_ATOM;
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
-        CellInterface* cell_inter = const_cast<CellInterface*>(sheet.GetCell(*cell_));
+    double Evaluate(const SheetInterface& sheet, const CellSlot* slots) const override {
+        if (!cell_->IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
 
-        if (cell_inter == nullptr) {
-            return 0;
+        if (slots != nullptr && sheet_ == nullptr) {
+            //Bound cells are always Cell, so the calls below are not virtual
+            return CellToNumber(slots[slot_]->get());
         }
-       
-        Cell* current_cell = dynamic_cast<Cell*>(cell_inter);
-        if (!current_cell->GetPosition().IsValid()) {
+        return CellToNumber(FindCell(sheet));
+    }
+
+    LookupKey EvaluateKey(const SheetInterface& sheet, const CellSlot* slots) const override {
+        if (!cell_->IsValid()) {
             throw FormulaError(FormulaError::Category::Ref);
         }
 
-        switch (current_cell->GetTypeCell()) {
-            case TypeCell::EmptyImpl: {
-                return 0;
-            }
-            case TypeCell::TextImpl: {
-                std::string text = current_cell->GetText();
-                std::istringstream istr(text);
-                try {
-                    return ParseNumber(istr);
-                }
-                catch (const ParsingError&) {
-                    throw FormulaError(FormulaError::Category::Value);
-                }
-            }
-            case TypeCell::FormulaImpl: {
-                CellInterface::Value value = current_cell->GetValue();            
+        const CellInterface* cell = slots != nullptr && sheet_ == nullptr ? slots[slot_]->get() : FindCell(sheet);
+        if (cell == nullptr) {
+            return 0.0;
+        }
+        CellInterface::Value value = cell->GetValue();
+        if (IsType<FormulaError>(value)) {
+            throw std::get<FormulaError>(value);
+        }
+        return MakeLookupKey(value).value_or(0.0);  //Empty text reads as zero, as in arithmetic
+    }
 
-                if (IsType<std::string>(value)) {
-                    throw FormulaError(FormulaError::Category::Value);
-                }
-                else if (IsType<double>(value)) {
-                    return std::get<double>(value);
-                }
-                else if (IsType<FormulaError>(value)) {
-                    throw std::get<FormulaError>(value);
-                }
-            }
+    void AssignSlots(const std::vector<Position>& cells) override {
+        if (sheet_ == nullptr) {
+            slot_ = std::lower_bound(cells.begin(), cells.end(), *cell_) - cells.begin();
+        }
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& /* changed */) const override {
+        return std::make_unique<CellExpr>(cell_, sheet_, slot_);
+    }
+
+    std::unique_ptr<Expr> Shift(ShiftContext& context) const override {
+        const std::optional<Position> moved = context.move_cell(*cell_, sheet_);
+        if (!moved) {
+            return std::make_unique<RefErrorExpr>();
+        }
+        if (sheet_ != nullptr) {
+            context.sheet_cells.push_front({ *sheet_, *moved });
+            return std::make_unique<CellExpr>(&context.sheet_cells.front().pos, &context.sheet_cells.front().sheet);
         }
-        throw FormulaException("UNKNOWN ERROR");
+        context.cells.push_front(*moved);
+        return std::make_unique<CellExpr>(&context.cells.front());
     }
 
 private:
+    // Only CellInterface is used here, so formulas can be evaluated
+    // against any sheet implementation, including read-only snapshots
+    const CellInterface* FindCell(const SheetInterface& sheet) const {
+        const SheetInterface* target = sheet_ != nullptr ? sheet.FindSheet(*sheet_) : &sheet;
+        if (target == nullptr) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return target->GetCell(*cell_);
+    }
+
     const Position* cell_;
+    const std::string* sheet_;
+    size_t slot_;
 };
 
 class NumberExpr final : public Expr {
@@ -305,7 +479,22 @@ public:
         return EP_ATOM;
     }
 
-    double Evaluate([[maybe_unused]] const SheetInterface& sheet) const override {
+    double Evaluate([[maybe_unused]] const SheetInterface& sheet, const CellSlot* /* slots */) const override {
+        return value_;
+    }
+
+    void AssignSlots(const std::vector<Position>& /* cells */) override {
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& /* changed */) const override {
+        return std::make_unique<NumberExpr>(value_);
+    }
+
+    std::unique_ptr<Expr> Shift(ShiftContext& /* context */) const override {
+        return std::make_unique<NumberExpr>(value_);
+    }
+
+    std::optional<double> GetConstant() const override {
         return value_;
     }
 
@@ -313,6 +502,390 @@ private:
     double value_;
 };
 
+// Evaluation form of a left-nested chain such as A1*2+B1-C1/4: the first
+// operand followed by steps applied to the running result in the original
+// order. Only created by Optimize, so it is never printed as a formula.
+class ChainExpr final : public Expr {
+public:
+    enum Op : char {
+        Add = '+',
+        Subtract = '-',
+        Multiply = '*',
+        DivideByConstant = '/',     // x / c for a constant c >= epsilon
+        ScaleByConstant = '^',      // x / c as x * (1 / c) for a power of two c
+    };
+
+    explicit ChainExpr(std::unique_ptr<Expr> first)
+        : first_(std::move(first)) {
+    }
+
+    void Append(Op op, std::unique_ptr<Expr> operand) {
+        steps_.push_back({ op, std::move(operand), 0.0 });
+    }
+
+    void AppendDivide(double divisor) {
+        //x / c == x * (1 / c) exactly when 1 / c is representable without rounding
+        int exponent = 0;
+        if (std::frexp(divisor, &exponent) == 0.5 && std::isnormal(1.0 / divisor)) {
+            steps_.push_back({ ScaleByConstant, nullptr, 1.0 / divisor });
+        }
+        else {
+            steps_.push_back({ DivideByConstant, nullptr, divisor });
+        }
+    }
+
+    size_t GetStepCount() const {
+        return steps_.size();
+    }
+
+    void Print(std::ostream& out) const override {
+        out << "(chain ";
+        first_->Print(out);
+        for (const Step& step : steps_) {
+            out << ' ' << static_cast<char>(step.op) << ' ';
+            if (step.operand != nullptr) {
+                step.operand->Print(out);
+            }
+            else {
+                out << step.constant;
+            }
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const SheetInterface& sheet, const CellSlot* slots) const override {
+        double result = first_->Evaluate(sheet, slots);
+        for (const Step& step : steps_) {
+            switch (step.op) {
+            case Add:
+                result = BinaryOpExpr::Apply(BinaryOpExpr::Add, result, step.operand->Evaluate(sheet, slots));
+                break;
+            case Subtract:
+                result = BinaryOpExpr::Apply(BinaryOpExpr::Subtract, result, step.operand->Evaluate(sheet, slots));
+                break;
+            case Multiply:
+                result = BinaryOpExpr::Apply(BinaryOpExpr::Multiply, result, step.operand->Evaluate(sheet, slots));
+                break;
+            case DivideByConstant:
+                result /= step.constant;
+                break;
+            case ScaleByConstant:
+                result *= step.constant;
+                break;
+            }
+        }
+        return result;
+    }
+
+    void AssignSlots(const std::vector<Position>& cells) override {
+        first_->AssignSlots(cells);
+        for (Step& step : steps_) {
+            if (step.operand != nullptr) {
+                step.operand->AssignSlots(cells);
+            }
+        }
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& /* changed */) const override {
+        assert(false);  // already in the evaluation form
+        return nullptr;
+    }
+
+    std::unique_ptr<Expr> Shift(ShiftContext& /* context */) const override {
+        assert(false);  // only the original tree is copied
+        return nullptr;
+    }
+
+private:
+    struct Step {
+        Op op;
+        std::unique_ptr<Expr> operand;  // nullptr for the steps with a constant
+        double constant;
+    };
+
+    std::unique_ptr<Expr> first_;
+    std::vector<Step, ScopedCountingAllocator<Step>> steps_;
+};
+
+std::unique_ptr<Expr> BinaryOpExpr::Optimize(bool& changed) const {
+    auto lhs = lhs_->Optimize(changed);
+    auto rhs = rhs_->Optimize(changed);
+    const std::optional<double> lhs_value = lhs->GetConstant();
+    const std::optional<double> rhs_value = rhs->GetConstant();
+    if (lhs_value.has_value() && rhs_value.has_value()) {
+        try {
+            const double value = Apply(type_, *lhs_value, *rhs_value);
+            changed = true;
+            return std::make_unique<NumberExpr>(value);
+        }
+        catch (const FormulaError&) {   // keep the subtree so that the error is raised on evaluation
+        }
+    }
+    if (type_ == Divide && (!rhs_value.has_value() || *rhs_value < std::numeric_limits<double>::epsilon())) {
+        // the divisor is evaluated before the dividend, so the division cannot join a chain
+        return std::make_unique<BinaryOpExpr>(type_, std::move(lhs), std::move(rhs));
+    }
+
+    std::unique_ptr<ChainExpr> chain;
+    if (auto* lhs_chain = dynamic_cast<ChainExpr*>(lhs.get())) {
+        lhs.release();
+        chain.reset(lhs_chain);
+    }
+    else {
+        chain = std::make_unique<ChainExpr>(std::move(lhs));
+    }
+    if (type_ == Divide) {
+        chain->AppendDivide(*rhs_value);
+        changed = true;
+    }
+    else {
+        chain->Append(static_cast<ChainExpr::Op>(type_), std::move(rhs));
+    }
+    if (chain->GetStepCount() > 1) {
+        changed = true;
+    }
+    return chain;
+}
+
+std::unique_ptr<Expr> UnaryOpExpr::Optimize(bool& changed) const {
+    auto operand = operand_->Optimize(changed);
+    if (type_ == UnaryPlus) {
+        changed = true;
+        return operand;
+    }
+    if (const std::optional<double> value = operand->GetConstant()) {
+        changed = true;
+        return std::make_unique<NumberExpr>(-*value);
+    }
+    return std::make_unique<UnaryOpExpr>(type_, std::move(operand));
+}
+
+// A range argument of a function. Functions read the cells of the range
+// themselves, so the range is never evaluated as a number.
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(const CellRange* range)
+        : range_(range) {
+    }
+
+    void Print(std::ostream& out) const override {
+        char name[Position::MAX_STRING_LENGTH];
+        out.write(name, static_cast<std::streamsize>(range_->from.ToString(name))) << ':';
+        out.write(name, static_cast<std::streamsize>(range_->to.ToString(name)));
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate([[maybe_unused]] const SheetInterface& sheet, const CellSlot* /* slots */) const override {
+        throw FormulaError(FormulaError::Category::Value);
+    }
+
+    void AssignSlots(const std::vector<Position>& /* cells */) override {
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& /* changed */) const override {
+        return std::make_unique<RangeExpr>(range_);
+    }
+
+    std::unique_ptr<Expr> Shift(ShiftContext& context) const override {
+        const std::optional<CellRange> moved = context.move_range(*range_);
+        if (!moved) {
+            return std::make_unique<RefErrorExpr>();
+        }
+        context.ranges.push_front(*moved);
+        return std::make_unique<RangeExpr>(&context.ranges.front());
+    }
+
+    const CellRange* GetRange() const override {
+        return range_;
+    }
+
+private:
+    const CellRange* range_;
+};
+
+// A call of a lookup function. The arguments are evaluated in order, then
+// the lookup range is searched through SheetInterface::FindInColumn, which
+// uses the column indexes of the sheet, or scanned when the sheet has none.
+class FunctionExpr final : public Expr {
+public:
+    using Args = std::vector<std::unique_ptr<Expr>, ScopedCountingAllocator<std::unique_ptr<Expr>>>;
+
+    FunctionExpr(const FormulaFunction& function, Args args)
+        : function_(function)
+        , args_(std::move(args)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << function_.name;
+        for (const auto& arg : args_) {
+            out << ' ';
+            arg->Print(out);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        out << function_.name << '(';
+        for (size_t i = 0; i < args_.size(); ++i) {
+            if (i > 0) {
+                out << ',';
+            }
+            args_[i]->PrintFormula(out, EP_ATOM);
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const SheetInterface& sheet, const CellSlot* slots) const override {
+        const LookupKey key = args_[0]->EvaluateKey(sheet, slots);
+        switch (function_.id) {
+        case FormulaFunction::Match: {
+            const double type = args_.size() > 2 ? args_[2]->Evaluate(sheet, slots) : 1.0;
+            const LookupMode mode = type > 0 ? LookupMode::LessOrEqual
+                                  : type < 0 ? LookupMode::GreaterOrEqual
+                                             : LookupMode::Exact;
+            return Find(sheet, GetRangeArg(1, sheet, slots), key, mode) + 1;
+        }
+        case FormulaFunction::VLookup: {
+            const CellRange& table = GetRangeArg(1, sheet, slots);
+            const double column = std::trunc(args_[2]->Evaluate(sheet, slots));
+            const bool exact = args_.size() > 3 && args_[3]->Evaluate(sheet, slots) == 0;
+            if (column < 1) {
+                throw FormulaError(FormulaError::Category::Value);
+            }
+            if (column > table.GetCols()) {
+                throw FormulaError(FormulaError::Category::Ref);
+            }
+            const CellRange keys{ table.from, { table.to.row, table.from.col } };
+            const int offset = Find(sheet, keys, key, exact ? LookupMode::Exact : LookupMode::LessOrEqual);
+            return CellToNumber(sheet.GetCell({ table.from.row + offset, table.from.col + static_cast<int>(column) - 1 }));
+        }
+        case FormulaFunction::XLookup: {
+            const CellRange& keys = GetRangeArg(1, sheet, slots);
+            const CellRange& results = GetRangeArg(2, sheet, slots);
+            const double match_mode = args_.size() > 3 ? args_[3]->Evaluate(sheet, slots) : 0.0;
+            LookupMode mode = LookupMode::Exact;
+            if (match_mode == -1) {
+                mode = LookupMode::LessOrEqual;
+            }
+            else if (match_mode == 1) {
+                mode = LookupMode::GreaterOrEqual;
+            }
+            else if (match_mode != 0) {
+                throw FormulaError(FormulaError::Category::Value);
+            }
+            if (!IsVector(results) || GetLength(results) != GetLength(keys)) {
+                throw FormulaError(FormulaError::Category::Value);
+            }
+            return CellToNumber(sheet.GetCell(At(results, Find(sheet, keys, key, mode))));
+        }
+        }
+        assert(false);
+        return 0;
+    }
+
+    void AssignSlots(const std::vector<Position>& cells) override {
+        for (auto& arg : args_) {
+            arg->AssignSlots(cells);
+        }
+    }
+
+    std::unique_ptr<Expr> Optimize(bool& changed) const override {
+        Args args;
+        args.reserve(args_.size());
+        for (const auto& arg : args_) {
+            args.push_back(arg->Optimize(changed));
+        }
+        return std::make_unique<FunctionExpr>(function_, std::move(args));
+    }
+
+    std::unique_ptr<Expr> Shift(ShiftContext& context) const override {
+        Args args;
+        args.reserve(args_.size());
+        for (const auto& arg : args_) {
+            args.push_back(arg->Shift(context));
+        }
+        return std::make_unique<FunctionExpr>(function_, std::move(args));
+    }
+
+private:
+    // A range argument may also be #REF!, which throws when evaluated
+    const CellRange& GetRangeArg(size_t index, const SheetInterface& sheet, const CellSlot* slots) const {
+        const CellRange* range = args_[index]->GetRange();
+        if (range == nullptr) {
+            args_[index]->Evaluate(sheet, slots);
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return *range;
+    }
+
+    static bool IsVector(const CellRange& range) {
+        return range.GetRows() == 1 || range.GetCols() == 1;
+    }
+
+    static int GetLength(const CellRange& range) {
+        return std::max(range.GetRows(), range.GetCols());
+    }
+
+    static Position At(const CellRange& range, int index) {
+        if (range.GetCols() == 1) {
+            return { range.from.row + index, range.from.col };
+        }
+        return { range.from.row, range.from.col + index };
+    }
+
+    // Returns the offset of the found value from the start of a one-column
+    // or one-row range, throws #N/A when there is none
+    static int Find(const SheetInterface& sheet, const CellRange& range, const LookupKey& key, LookupMode mode) {
+        if (!IsVector(range)) {
+            throw FormulaError(FormulaError::Category::NA);
+        }
+        int index = -1;
+        std::optional<int> row;
+        if (range.GetCols() == 1 && (row = sheet.FindInColumn(range, key, mode))) {
+            index = *row < 0 ? -1 : *row - range.from.row;
+        }
+        else {
+            LookupSearch search(key, mode);
+            for (int i = 0; i < GetLength(range); ++i) {
+                const CellInterface* cell = sheet.GetCell(At(range, i));
+                if (cell == nullptr) {
+                    continue;
+                }
+                if (std::optional<LookupKey> value = MakeLookupKey(cell->GetValue())) {
+                    search.Offer(*value, i);
+                }
+            }
+            index = search.GetIndex();
+        }
+        if (index < 0) {
+            throw FormulaError(FormulaError::Category::NA);
+        }
+        return index;
+    }
+
+    const FormulaFunction& function_;
+    Args args_;
+};
+
 class ParseASTListener final : public FormulaBaseListener {
 public:
     std::unique_ptr<Expr> MoveRoot() {
@@ -323,10 +896,18 @@ public:
         return root;
     }
 
-    std::forward_list<Position> MoveCells() {
+    CellList MoveCells() {
         return std::move(cells_);
     }
 
+    SheetCellList MoveSheetCells() {
+        return std::move(sheet_cells_);
+    }
+
+    RangeList MoveRanges() {
+        return std::move(ranges_);
+    }
+
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
@@ -358,6 +939,10 @@ public:
         args_.push_back(std::move(node));
     }
 
+    void exitRefError(FormulaParser::RefErrorContext* /* ctx */) override {
+        args_.push_back(std::make_unique<RefErrorExpr>());
+    }
+
     void exitCell(FormulaParser::CellContext* ctx) override {
         auto value_str = ctx->CELL()->getSymbol()->getText();
         auto value = Position::FromString(value_str);
@@ -365,8 +950,16 @@ public:
             throw FormulaException("Invalid position: " + value_str);
         }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
+        std::unique_ptr<CellExpr> node;
+        if (ctx->SHEET() != nullptr) {
+            auto sheet_str = ctx->SHEET()->getSymbol()->getText();
+            sheet_str.pop_back();  // '!'
+            sheet_cells_.push_front({std::move(sheet_str), value});
+            node = std::make_unique<CellExpr>(&sheet_cells_.front().pos, &sheet_cells_.front().sheet);
+        } else {
+            cells_.push_front(value);
+            node = std::make_unique<CellExpr>(&cells_.front());
+        }
         args_.push_back(std::move(node));
     }
 
@@ -394,13 +987,60 @@ public:
         args_.back() = std::move(node);
     }
 
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        if (ctx->REF_ERROR() != nullptr) {
+            args_.push_back(std::make_unique<RefErrorExpr>());
+            return;
+        }
+        Position bounds[2];
+        for (size_t i = 0; i < 2; ++i) {
+            auto value_str = ctx->CELL(i)->getSymbol()->getText();
+            bounds[i] = Position::FromString(value_str);
+            if (!bounds[i].IsValid()) {
+                throw FormulaException("Invalid position: " + value_str);
+            }
+        }
+        ranges_.push_front({ { std::min(bounds[0].row, bounds[1].row), std::min(bounds[0].col, bounds[1].col) },
+                             { std::max(bounds[0].row, bounds[1].row), std::max(bounds[0].col, bounds[1].col) } });
+        args_.push_back(std::make_unique<RangeExpr>(&ranges_.front()));
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        auto name = ctx->FUNCTION()->getSymbol()->getText();
+        const FormulaFunction* function = FindFormulaFunction(name);
+        if (function == nullptr) {
+            throw FormulaException("Unknown function: " + name);
+        }
+        const size_t count = ctx->arg().size();
+        if (count < function->min_args || count > function->max_args) {
+            throw FormulaException("Wrong number of arguments: " + name);
+        }
+        assert(args_.size() >= count);
+
+        FunctionExpr::Args args;
+        args.reserve(count);
+        for (auto it = args_.end() - count; it != args_.end(); ++it) {
+            //A lone #REF! may stand for a range as well as for a number
+            auto* range = dynamic_cast<FormulaParser::RangeContext*>(ctx->arg(args.size()));
+            const bool ref_error = range != nullptr && range->REF_ERROR() != nullptr;
+            if (!ref_error && (range != nullptr) != function->IsRangeArg(args.size())) {
+                throw FormulaException("Invalid argument of " + name);
+            }
+            args.push_back(std::move(*it));
+        }
+        args_.erase(args_.end() - count, args_.end());
+        args_.push_back(std::make_unique<FunctionExpr>(*function, std::move(args)));
+    }
+
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
         throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
     }
 
 private:
     std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    CellList cells_;
+    SheetCellList sheet_cells_;
+    RangeList ranges_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -416,6 +1056,23 @@ public:
 }  // namespace
 }  // namespace ASTImpl
 
+namespace {
+constexpr FormulaFunction FORMULA_FUNCTIONS[] = {
+    { FormulaFunction::Match, "MATCH", 2, 3, 0b010 },
+    { FormulaFunction::VLookup, "VLOOKUP", 3, 4, 0b010 },
+    { FormulaFunction::XLookup, "XLOOKUP", 3, 4, 0b110 },
+};
+}  // namespace
+
+const FormulaFunction* FindFormulaFunction(std::string_view name) {
+    for (const FormulaFunction& function : FORMULA_FUNCTIONS) {
+        if (function.name == name) {
+            return &function;
+        }
+    }
+    return nullptr;
+}
+
 FormulaAST ParseFormulaAST(std::istream& in) {
     using namespace antlr4;
 
@@ -437,7 +1094,7 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveSheetCells(), listener.MoveRanges());
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
@@ -445,9 +1102,42 @@ FormulaAST ParseFormulaAST(const std::string& in_str) {
     return ParseFormulaAST(in);
 }
 
+FormulaAST FormulaAST::Shift(int rows, int cols) const {
+    ASTImpl::ShiftContext context;
+    context.move_cell = [rows, cols](Position pos, const std::string* /* sheet */) -> std::optional<Position> {
+        const Position moved{ pos.row + rows, pos.col + cols };
+        return moved.IsValid() ? std::optional<Position>(moved) : std::nullopt;
+    };
+    context.move_range = [&context](const CellRange& range) -> std::optional<CellRange> {
+        const std::optional<Position> from = context.move_cell(range.from, nullptr);
+        const std::optional<Position> to = context.move_cell(range.to, nullptr);
+        return from && to ? std::optional<CellRange>({ *from, *to }) : std::nullopt;
+    };
+    return Shift(context);
+}
+
+FormulaAST FormulaAST::Relocate(const StructureEdit& edit, std::string_view sheet, bool local) const {
+    ASTImpl::ShiftContext context;
+    context.move_cell = [&](Position pos, const std::string* cell_sheet) -> std::optional<Position> {
+        const bool edited = cell_sheet == nullptr ? local : *cell_sheet == sheet;
+        return edited ? edit.Map(pos) : pos;
+    };
+    context.move_range = [&](const CellRange& range) -> std::optional<CellRange> {
+        return local ? edit.Map(range) : range;
+    };
+    return Shift(context);
+}
+
+FormulaAST FormulaAST::Shift(ASTImpl::ShiftContext& context) const {
+    auto root_expr = root_expr_->Shift(context);
+    return FormulaAST(std::move(root_expr), std::move(context.cells), std::move(context.sheet_cells),
+                      std::move(context.ranges));
+}
+
 void FormulaAST::PrintCells(std::ostream& out) const {
+    char name[Position::MAX_STRING_LENGTH];
     for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
+        out.write(name, static_cast<std::streamsize>(cell.ToString(name))) << ' ';
     }
 }
 
@@ -459,14 +1149,31 @@ void FormulaAST::PrintFormula(std::ostream& out) const {
     root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
-double FormulaAST::Execute(const SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
+double FormulaAST::Execute(const SheetInterface& sheet, const CellSlot* slots) const {
+    return (eval_expr_ != nullptr ? eval_expr_ : root_expr_)->Evaluate(sheet, slots);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, CellList cells,
+                       SheetCellList sheet_cells, RangeList ranges)
     : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
+    , cells_(std::move(cells))
+    , sheet_cells_(std::move(sheet_cells))
+    , ranges_(std::move(ranges)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+    sheet_cells_.sort();
+    ranges_.sort();
+
+    std::vector<Position> unique_cells(cells_.begin(), cells_.end());
+    unique_cells.erase(std::unique(unique_cells.begin(), unique_cells.end()), unique_cells.end());
+    root_expr_->AssignSlots(unique_cells);
+
+    bool changed = false;
+    auto eval_expr = root_expr_->Optimize(changed);
+    if (changed) {  // otherwise the original tree is evaluated as fast
+        eval_expr_ = std::move(eval_expr);
+    }
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
\ No newline at end of file
@@ -2,6 +2,8 @@
 
 #include "FormulaLexer.h"
 #include "common.h"
+#include "formula.h"
+#include "memory_usage.h"
 
 #include <forward_list>
 #include <functional>
@@ -10,8 +12,38 @@
 
 namespace ASTImpl {
 class Expr;
+struct ShiftContext;
 }
 
+// Reference lists of a formula; their nodes are counted by AllocationScope
+using CellList = std::forward_list<Position, ScopedCountingAllocator<Position>>;
+using SheetCellList = std::forward_list<SheetPosition, ScopedCountingAllocator<SheetPosition>>;
+using RangeList = std::forward_list<CellRange, ScopedCountingAllocator<CellRange>>;
+
+// A function that can be called in a formula. Bit i of range_args is set
+// when argument i must be a range such as A1:B10; other arguments are
+// expressions.
+struct FormulaFunction {
+    enum Id {
+        Match,
+        VLookup,
+        XLookup,
+    };
+
+    Id id;
+    std::string_view name;
+    size_t min_args;
+    size_t max_args;
+    unsigned range_args;
+
+    bool IsRangeArg(size_t index) const {
+        return (range_args >> index) & 1u;
+    }
+};
+
+// Returns the function with the given name or nullptr
+const FormulaFunction* FindFormulaFunction(std::string_view name);
+
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
@@ -19,27 +51,55 @@ class ParsingError : public std::runtime_error {
 class FormulaAST {
 public:
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+                        CellList cells,
+                        SheetCellList sheet_cells,
+                        RangeList ranges);
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
-    double Execute(const SheetInterface& sheet) const;
+    // slots - see FormulaInterface::Evaluate, nullptr to look cells up by position
+    double Execute(const SheetInterface& sheet, const CellSlot* slots = nullptr) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
+
+    // Returns a copy of the formula with every reference moved by rows and
+    // cols, as when it is copied to another cell; references that leave the
+    // sheet become #REF!
+    FormulaAST Shift(int rows, int cols) const;
+    // Returns a copy of the formula after rows or columns of the sheet named
+    // sheet are inserted or deleted: the references to that sheet by name
+    // and, when local is set, the references without a sheet name are moved
+    // by edit; references to deleted cells and ranges become #REF!
+    FormulaAST Relocate(const StructureEdit& edit, std::string_view sheet, bool local) const;
     
-    std::forward_list<Position>& GetCells() {
+    CellList& GetCells() {
         return cells_;
     }
 
-    const std::forward_list<Position>& GetCells() const {
+    const CellList& GetCells() const {
         return cells_;
     }
 
+    const SheetCellList& GetSheetCells() const {
+        return sheet_cells_;
+    }
+
+    const RangeList& GetRanges() const {
+        return ranges_;
+    }
+
 private:
+    FormulaAST Shift(ASTImpl::ShiftContext& context) const;
+
     std::unique_ptr<ASTImpl::Expr> root_expr_;
-    std::forward_list<Position> cells_;
+    // Evaluation form of root_expr_ (see Expr::Optimize); nullptr when it
+    // would not differ from the original. Printing always uses root_expr_.
+    std::unique_ptr<ASTImpl::Expr> eval_expr_;
+    CellList cells_;
+    SheetCellList sheet_cells_;
+    RangeList ranges_;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
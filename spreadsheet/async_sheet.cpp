@@ -0,0 +1,48 @@
+#include "async_sheet.h"
+
+AsyncSheet::AsyncSheet()
+	: sheet_(std::make_unique<Sheet>()) {
+}
+
+AsyncSheet::AsyncSheet(std::unique_ptr<Sheet> sheet)
+	: sheet_(std::move(sheet)) {
+}
+
+AsyncSheet::~AsyncSheet() {}
+
+std::future<void> AsyncSheet::SetCell(Position pos, std::string text) {
+	return executor_.Submit([this, pos, text = std::move(text)]() mutable {
+		sheet_->SetCell(pos, std::move(text));
+	});
+}
+
+std::future<void> AsyncSheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+	return executor_.Submit([this, cells = std::move(cells)]() mutable {
+		for (auto& [pos, text] : cells) {
+			sheet_->SetCell(pos, std::move(text));
+		}
+	});
+}
+
+std::future<void> AsyncSheet::ClearCell(Position pos) {
+	return executor_.Submit([this, pos] {
+		sheet_->ClearCell(pos);
+	});
+}
+
+std::future<void> AsyncSheet::Recalculate() {
+	return executor_.Submit([this] {
+		sheet_->Recalculate();
+	});
+}
+
+std::future<CellInterface::Value> AsyncSheet::GetValue(Position pos) {
+	return executor_.Submit([this, pos] {
+		const CellInterface* cell = sheet_->GetCell(pos);
+		return cell != nullptr ? cell->GetValue() : CellInterface::Value();
+	});
+}
+
+std::unique_ptr<SheetSnapshot> AsyncSheet::Snapshot() const {
+	return sheet_->Snapshot();
+}
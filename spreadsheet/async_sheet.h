@@ -0,0 +1,42 @@
+#pragma once
+
+#include "executor.h"
+#include "sheet.h"
+
+#include <future>
+#include <utility>
+#include <vector>
+
+// Асинхронная обёртка над таблицей. Все операции выполняются по очереди во
+// внутреннем рабочем потоке, вызывающий поток не блокируется. Исключения
+// (FormulaException, CircularDependencyException, InvalidPositionException)
+// передаются через возвращаемый future.
+class AsyncSheet {
+public:
+    AsyncSheet();
+    explicit AsyncSheet(std::unique_ptr<Sheet> sheet);
+    ~AsyncSheet();
+
+    std::future<void> SetCell(Position pos, std::string text);
+
+    // Записывает ячейки в переданном порядке. Запись останавливается на
+    // первой ошибке, уже записанные ячейки сохраняются.
+    std::future<void> SetCells(std::vector<std::pair<Position, std::string>> cells);
+
+    std::future<void> ClearCell(Position pos);
+
+    // Вычисляет все формулы, значения которых были сброшены.
+    std::future<void> Recalculate();
+
+    // Возвращает значение ячейки, при необходимости вычисляя её формулу.
+    // Для пустой ячейки возвращается пустая строка.
+    std::future<CellInterface::Value> GetValue(Position pos);
+
+    // Снимок публикуется без постановки в очередь и отражает все записи,
+    // завершённые к моменту вызова.
+    std::unique_ptr<SheetSnapshot> Snapshot() const;
+
+private:
+    std::unique_ptr<Sheet> sheet_;
+    SerialExecutor executor_;
+};
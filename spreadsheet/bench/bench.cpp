@@ -0,0 +1,461 @@
+// Набор нагрузочных тестов таблицы. Запуск:
+//   spreadsheet_bench [--scale N] [--filter подстрока | --workload имя]
+// Результат выводится в stdout в формате JSON: для каждой нагрузки число
+// операций, операций в секунду, перцентили задержки одной операции и пиковый
+// объём резидентной памяти. Каждая нагрузка выполняется в отдельном процессе
+// (spreadsheet_bench --workload имя), поэтому пик памяти относится только к
+// ней. Все нагрузки детерминированы, поэтому результаты разных версий можно
+// сравнивать.
+
+#include "common.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace std::literals;
+
+namespace {
+
+uint64_t GetPeakRssKb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize / 1024;
+    }
+    return 0;
+#else
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// Выполняет нагрузку name в дочернем процессе и возвращает её строку отчёта.
+std::optional<std::string> RunInChild(const char* program, int scale, std::string_view name) {
+    std::string command = "\""s + program + "\" --scale " + std::to_string(scale) + " --workload " + std::string(name);
+#ifdef _WIN32
+    FILE* pipe = _popen(("\"" + command + "\"").c_str(), "r");  //cmd.exe strips the outer quotes
+#else
+    FILE* pipe = popen(command.c_str(), "r");
+#endif
+    if (pipe == nullptr) {
+        return std::nullopt;
+    }
+    std::string report;
+    char buffer[4096];
+    while (const size_t size = std::fread(buffer, 1, sizeof(buffer), pipe)) {
+        report.append(buffer, size);
+    }
+#ifdef _WIN32
+    const int status = _pclose(pipe);
+#else
+    const int status = pclose(pipe);
+#endif
+    if (status != 0 || report.empty()) {
+        return std::nullopt;
+    }
+    return report;
+}
+
+std::string CellName(int row, int col) {
+    return Position{ row, col }.ToString();
+}
+
+// Замеряет задержку каждой операции нагрузки.
+class Recorder {
+public:
+    template <typename F>
+    void Measure(F&& op) {
+        const auto start = std::chrono::steady_clock::now();
+        op();
+        latencies_.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+
+    void Report(std::ostream& output, std::string_view name) {
+        std::sort(latencies_.begin(), latencies_.end());
+        uint64_t total_ns = 0;
+        for (uint64_t ns : latencies_) {
+            total_ns += ns;
+        }
+        const double seconds = total_ns / 1e9;
+        output << "    {\"name\": \"" << name << "\", \"ops\": " << latencies_.size()
+               << ", \"seconds\": " << seconds
+               << ", \"ops_per_sec\": " << (seconds > 0 ? latencies_.size() / seconds : 0.0)
+               << ", \"p50_ns\": " << Percentile(0.50)
+               << ", \"p90_ns\": " << Percentile(0.90)
+               << ", \"p99_ns\": " << Percentile(0.99)
+               << ", \"max_ns\": " << (latencies_.empty() ? 0 : latencies_.back())
+               << ", \"peak_rss_kb\": " << GetPeakRssKb() << "}";
+    }
+
+private:
+    uint64_t Percentile(double p) const {
+        if (latencies_.empty()) {
+            return 0;
+        }
+        const size_t index = std::min(latencies_.size() - 1, static_cast<size_t>(p * latencies_.size()));
+        return latencies_[index];
+    }
+
+    std::vector<uint64_t> latencies_;
+};
+
+using Workload = std::function<void(Recorder&, int)>;
+
+// A1 = 1, A2 = A1+1, ... Запись в начало цепочки сбрасывает кеш всей цепочки.
+void ChainBuild(Recorder& recorder, int scale) {
+    const int length = 1000 * scale;
+    auto sheet = CreateSheet();
+    sheet->SetCell({ 0, 0 }, "1");
+    for (int row = 1; row < length; ++row) {
+        const std::string text = "="s + CellName(row - 1, 0) + "+1";
+        recorder.Measure([&] { sheet->SetCell({ row, 0 }, text); });
+    }
+}
+
+void ChainUpdate(Recorder& recorder, int scale) {
+    const int length = 1000 * scale;
+    auto sheet = CreateSheet();
+    sheet->SetCell({ 0, 0 }, "1");
+    for (int row = 1; row < length; ++row) {
+        sheet->SetCell({ row, 0 }, "="s + CellName(row - 1, 0) + "+1");
+    }
+    const Position last{ length - 1, 0 };
+    for (int i = 0; i < 200; ++i) {
+        recorder.Measure([&] {
+            sheet->SetCell({ 0, 0 }, std::to_string(i));
+            sheet->GetCell(last)->GetValue();
+        });
+    }
+}
+
+// Одна формула суммирует много ячеек; меняется случайное слагаемое.
+void FanIn(Recorder& recorder, int scale) {
+    const int inputs = 200 * scale;
+    auto sheet = CreateSheet();
+    std::string formula = "=";
+    for (int row = 0; row < inputs; ++row) {
+        sheet->SetCell({ row, 0 }, std::to_string(row));
+        formula += (row == 0 ? "" : "+") + CellName(row, 0);
+    }
+    const Position sum{ 0, 1 };
+    sheet->SetCell(sum, formula);
+
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int> row_dist(0, inputs - 1);
+    for (int i = 0; i < 2000; ++i) {
+        const int row = row_dist(random);
+        recorder.Measure([&] {
+            sheet->SetCell({ row, 0 }, std::to_string(i));
+            sheet->GetCell(sum)->GetValue();
+        });
+    }
+}
+
+// От одной ячейки зависит много формул; после записи читаются все.
+void FanOut(Recorder& recorder, int scale) {
+    const int outputs = 1000 * scale;
+    auto sheet = CreateSheet();
+    sheet->SetCell({ 0, 0 }, "1");
+    for (int row = 0; row < outputs; ++row) {
+        sheet->SetCell({ row, 1 }, "=A1*" + std::to_string(row));
+    }
+    for (int i = 0; i < 100; ++i) {
+        recorder.Measure([&] {
+            sheet->SetCell({ 0, 0 }, std::to_string(i));
+            for (int row = 0; row < outputs; ++row) {
+                sheet->GetCell({ row, 1 })->GetValue();
+            }
+        });
+    }
+}
+
+// Плотная сетка: каждая ячейка - сумма соседей сверху и слева.
+void DenseGrid(Recorder& recorder, int scale) {
+    const int size = 50 * scale;
+    auto sheet = CreateSheet();
+    for (int row = 0; row < size; ++row) {
+        for (int col = 0; col < size; ++col) {
+            std::string text = row == 0 || col == 0
+                ? "1"s
+                : "="s + CellName(row - 1, col) + "+" + CellName(row, col - 1);
+            recorder.Measure([&] { sheet->SetCell({ row, col }, std::move(text)); });
+        }
+    }
+    for (int i = 0; i < 20; ++i) {
+        recorder.Measure([&] {
+            sheet->SetCell({ 0, 0 }, std::to_string(i));
+            sheet->GetCell({ size - 1, size - 1 })->GetValue();
+        });
+    }
+}
+
+// Временной ряд в последних строках листа: значение и формула от него. При
+// сборке с большим SPREADSHEET_MAX_ROWS память и время на ячейку не должны
+// меняться.
+void TallSheet(Recorder& recorder, int scale) {
+    const int rows = std::min(10000 * scale, Position::MAX_ROWS);
+    const int first = Position::MAX_ROWS - rows;
+    auto sheet = CreateSheet();
+    for (int row = first; row < Position::MAX_ROWS; ++row) {
+        recorder.Measure([&] {
+            sheet->SetCell({ row, 0 }, std::to_string(row));
+            sheet->SetCell({ row, 1 }, "="s + CellName(row, 0) + "*2");
+        });
+    }
+    for (int row = first; row < Position::MAX_ROWS; ++row) {
+        recorder.Measure([&] { sheet->GetCell({ row, 1 })->GetValue(); });
+    }
+}
+
+// Формулы ссылаются на текстовые ячейки с числами: каждое вычисление
+// разбирает текст как число.
+void NumericText(Recorder& recorder, int scale) {
+    const int rows = 1000 * scale;
+    auto sheet = CreateSheet();
+    for (int row = 0; row < rows; ++row) {
+        sheet->SetCell({ row, 0 }, std::to_string(row) + ".5");
+        sheet->SetCell({ row, 1 }, "="s + CellName(row, 0) + "*2");
+    }
+    for (int i = 0; i < 20; ++i) {
+        recorder.Measure([&] {
+            for (int row = 0; row < rows; ++row) {
+                sheet->SetCell({ row, 0 }, std::to_string(row + i) + ".5");
+                sheet->GetCell({ row, 1 })->GetValue();
+            }
+        });
+    }
+}
+
+// Столбцы с небольшим набором часто повторяющихся длинных текстов, как
+// категории или статусы: запись и печать текстов.
+void RepeatedText(Recorder& recorder, int scale) {
+    const int rows = 1000 * scale;
+    const int cols = 20;
+    std::vector<std::string> categories;
+    for (int i = 0; i < 50; ++i) {
+        categories.push_back("category/subcategory #" + std::to_string(i));
+    }
+    auto sheet = CreateSheet();
+    for (int row = 0; row < rows; ++row) {
+        recorder.Measure([&] {
+            for (int col = 0; col < cols; ++col) {
+                sheet->SetCell({ row, col }, categories[(row * 7 + col) % categories.size()]);
+            }
+        });
+    }
+    for (int i = 0; i < 5; ++i) {
+        recorder.Measure([&] {
+            std::ostringstream texts;
+            sheet->PrintTexts(texts);
+        });
+    }
+}
+
+// Столбцы, в которых большинство формул вычисляется в ошибку.
+void ErrorHeavy(Recorder& recorder, int scale) {
+    const int rows = 1000 * scale;
+    auto sheet = CreateSheet();
+    for (int row = 0; row < rows; ++row) {
+        sheet->SetCell({ row, 0 }, row % 3 == 0 ? "=1/0"s : row % 3 == 1 ? "text"s : "="s + CellName(row - 1, 0) + "+1");
+        sheet->SetCell({ row, 1 }, "="s + CellName(row, 0) + "+1");
+    }
+    for (int i = 0; i < 20; ++i) {
+        recorder.Measure([&] {
+            sheet->SetCell({ 0, 0 }, "=1/" + std::to_string(i % 2));
+            for (int row = 0; row < rows; ++row) {
+                sheet->GetCell({ row, 0 })->GetValue();
+                sheet->GetCell({ row, 1 })->GetValue();
+            }
+        });
+    }
+}
+
+// Печать значений и текстов таблицы.
+void Print(Recorder& recorder, int scale) {
+    const int rows = 200 * scale;
+    const int cols = 20;
+    auto sheet = CreateSheet();
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+            sheet->SetCell({ row, col }, col % 2 == 0 ? std::to_string(row * col) : "="s + CellName(row, col - 1) + "/2");
+        }
+    }
+    for (int i = 0; i < 20; ++i) {
+        recorder.Measure([&] {
+            std::ostringstream values;
+            std::ostringstream texts;
+            sheet->PrintValues(values);
+            sheet->PrintTexts(texts);
+        });
+    }
+}
+
+// Таблица ключей и формулы точного и приближённого поиска по ней; после
+// записи ключа читаются все формулы.
+void Lookup(Recorder& recorder, int scale) {
+    const int rows = 10000 * scale;
+    const int lookups = 100;
+    auto sheet = CreateSheet();
+    for (int row = 0; row < rows; ++row) {
+        sheet->SetCell({ row, 0 }, "key" + std::to_string(row * 2));
+        sheet->SetCell({ row, 1 }, std::to_string(row * 2));
+    }
+    const std::string keys = "A1:" + CellName(rows - 1, 0);
+    const std::string values = "B1:" + CellName(rows - 1, 1);
+    for (int row = 0; row < lookups; ++row) {
+        const int key = row * (rows / lookups) * 2;
+        sheet->SetCell({ row, 4 }, "key" + std::to_string(key));
+        sheet->SetCell({ row, 2 }, "=MATCH(" + CellName(row, 4) + "," + keys + ",0)");
+        sheet->SetCell({ row, 3 }, "=MATCH(" + std::to_string(key + 1) + "," + values + ")");
+    }
+
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int> row_dist(0, rows - 1);
+    for (int i = 0; i < 200; ++i) {
+        const int row = row_dist(random);
+        recorder.Measure([&] {
+            sheet->SetCell({ row, 0 }, "key" + std::to_string(row * 2));
+            for (int lookup = 0; lookup < lookups; ++lookup) {
+                sheet->GetCell({ lookup, 2 })->GetValue();
+                sheet->GetCell({ lookup, 3 })->GetValue();
+            }
+        });
+    }
+}
+
+// Заполнение столбца формулой: по строке через SetCell и блоком через
+// FillRange.
+void FillSetCell(Recorder& recorder, int scale) {
+    const int rows = 10000 * scale;
+    for (int i = 0; i < 5; ++i) {
+        auto sheet = CreateSheet();
+        recorder.Measure([&] {
+            for (int row = 0; row < rows; ++row) {
+                sheet->SetCell({ row, 1 }, "="s + CellName(row, 0) + "*2+" + CellName(row + 1, 1));
+            }
+        });
+    }
+}
+
+void FillRange(Recorder& recorder, int scale) {
+    const int rows = 10000 * scale;
+    for (int i = 0; i < 5; ++i) {
+        Sheet sheet;
+        recorder.Measure([&] {
+            sheet.SetCell({ 0, 1 }, "=A1*2+B2");
+            sheet.FillRange({ 0, 1 }, { { 0, 1 }, { rows - 1, 1 } });
+        });
+    }
+}
+
+void InsertRows(Recorder& recorder, int scale) {
+    const int rows = 10000 * scale;
+    Sheet sheet;
+    sheet.SetCell({ 0, 1 }, "=A1*2+B2");
+    sheet.FillRange({ 0, 1 }, { { 0, 1 }, { rows - 1, 1 } });
+    //Every insertion and deletion moves the lower half of the chain and rewrites its formulas
+    for (int i = 0; i < 10; ++i) {
+        recorder.Measure([&] {
+            sheet.InsertRows(rows / 2);
+        });
+        recorder.Measure([&] {
+            sheet.DeleteRows(rows / 2);
+        });
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    int scale = 1;
+    std::string filter;
+    std::string workload_name;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--workload") == 0 && i + 1 < argc) {
+            workload_name = argv[++i];
+        }
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--scale N] [--filter substring | --workload name]" << std::endl;
+            return 1;
+        }
+    }
+
+    const std::vector<std::pair<std::string_view, Workload>> workloads = {
+        { "chain_build", ChainBuild },
+        { "chain_update", ChainUpdate },
+        { "fan_in", FanIn },
+        { "fan_out", FanOut },
+        { "dense_grid", DenseGrid },
+        { "tall_sheet", TallSheet },
+        { "numeric_text", NumericText },
+        { "repeated_text", RepeatedText },
+        { "error_heavy", ErrorHeavy },
+        { "print", Print },
+        { "lookup", Lookup },
+        { "fill_set_cell", FillSetCell },
+        { "fill_range", FillRange },
+        { "insert_rows", InsertRows },
+    };
+
+    //A child process runs a single workload and prints its line of the report
+    if (!workload_name.empty()) {
+        for (const auto& [name, workload] : workloads) {
+            if (name == workload_name) {
+                Recorder recorder;
+                workload(recorder, scale);
+                recorder.Report(std::cout, name);
+                return 0;
+            }
+        }
+        std::cerr << "Unknown workload: " << workload_name << std::endl;
+        return 1;
+    }
+
+    std::cout << "{\n  \"scale\": " << scale << ",\n  \"benchmarks\": [\n";
+    bool first = true;
+    for (const auto& [name, workload] : workloads) {
+        if (name.find(filter) == std::string_view::npos) {
+            continue;
+        }
+        const std::optional<std::string> report = RunInChild(argv[0], scale, name);
+        if (!report.has_value()) {
+            std::cerr << "Workload " << name << " failed" << std::endl;
+            return 1;
+        }
+        std::cout << (first ? "" : ",\n") << *report;
+        first = false;
+    }
+    std::cout << "\n  ]\n}\n";
+}
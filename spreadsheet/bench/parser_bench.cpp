@@ -0,0 +1,241 @@
+// Нагрузочный тест разбора формул отдельно от логики таблицы. Запуск:
+//   spreadsheet_parser_bench [--scale N] [--filter подстрока] [--dump-corpus]
+// Корпус формул генерируется детерминированно и различается длиной, глубиной
+// вложенности, долей ссылок на ячейки и записью чисел. Для каждого набора
+// в формате JSON выводятся скорость разбора (только ParseFormulaAST, полный
+// ParseFormula и отложенный ParseFormulaDeferred), память дерева на формулу
+// и стоимость печати дерева в текст формулы, которую ParseFormula выполняет
+// один раз при разборе. Случайные числа берутся прямо из mt19937 без
+// std::*_distribution, поэтому корпус одинаков во всех стандартных
+// библиотеках.
+// С --dump-corpus вместо замеров печатается сам корпус, по формуле в строке.
+
+#include "FormulaAST.h"
+#include "formula.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+enum class NumberFormat {
+    Integer,
+    Decimal,
+    Exponent,
+    Mixed,
+};
+
+struct CorpusSpec {
+    std::string_view name;
+    int terms;
+    int depth;
+    double ref_ratio;
+    NumberFormat numbers;
+};
+
+const CorpusSpec CORPUS[] = {
+    { "short", 2, 0, 0.5, NumberFormat::Integer },
+    { "medium", 10, 0, 0.5, NumberFormat::Mixed },
+    { "long", 100, 0, 0.5, NumberFormat::Mixed },
+    { "nested_10", 4, 10, 0.5, NumberFormat::Integer },
+    { "nested_50", 4, 50, 0.5, NumberFormat::Integer },
+    { "refs_sparse", 20, 0, 0.1, NumberFormat::Integer },
+    { "refs_dense", 20, 0, 0.9, NumberFormat::Integer },
+    { "numbers_decimal", 20, 0, 0.0, NumberFormat::Decimal },
+    { "numbers_exponent", 20, 0, 0.0, NumberFormat::Exponent },
+};
+
+class Generator {
+public:
+    Generator(const CorpusSpec& spec, unsigned seed)
+        : spec_(spec)
+        , random_(seed) {
+    }
+
+    std::string Next() {
+        std::string expression = Terms(spec_.terms);
+        for (int level = 0; level < spec_.depth; ++level) {
+            expression = "(" + expression + ")" + Operator() + Term();
+        }
+        return expression;
+    }
+
+private:
+    std::string Terms(int count) {
+        std::string result = Term();
+        for (int i = 1; i < count; ++i) {
+            result += Operator();
+            result += Term();
+        }
+        return result;
+    }
+
+    std::string Term() {
+        if (random_() < spec_.ref_ratio * 4294967296.0) {
+            return Position{ Uniform(0, 9999), Uniform(0, 701) }.ToString();
+        }
+        return Number();
+    }
+
+    std::string Number() {
+        NumberFormat format = spec_.numbers;
+        if (format == NumberFormat::Mixed) {
+            format = static_cast<NumberFormat>(Uniform(0, 2));
+        }
+        switch (format) {
+        case NumberFormat::Integer:
+            return std::to_string(Uniform(0, 100000));
+        case NumberFormat::Decimal:
+            return std::to_string(Uniform(0, 1000)) + "." + std::to_string(Uniform(0, 999));
+        default:
+            return std::to_string(Uniform(1, 9)) + "." + std::to_string(Uniform(0, 99)) + "e"
+                   + std::to_string(Uniform(-20, 20));
+        }
+    }
+
+    const char* Operator() {
+        static const char* const operators[] = { "+", "-", "*", "/" };
+        return operators[Uniform(0, 3)];
+    }
+
+    //The modulo bias is below 2^-12 for these ranges and does not matter for a corpus
+    int Uniform(int from, int to) {
+        return from + static_cast<int>(random_() % static_cast<uint32_t>(to - from + 1));
+    }
+
+    const CorpusSpec& spec_;
+    std::mt19937 random_;
+};
+
+template <typename F>
+double MeasureSeconds(F&& f) {
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Run(std::ostream& output, const CorpusSpec& spec, const std::vector<std::string>& corpus) {
+    size_t bytes = 0;
+    for (const auto& expression : corpus) {
+        bytes += expression.size();
+    }
+
+    const double ast_seconds = MeasureSeconds([&] {
+        for (const auto& expression : corpus) {
+            ParseFormulaAST(expression);
+        }
+    });
+
+    std::vector<std::unique_ptr<FormulaInterface>> formulas;
+    formulas.reserve(corpus.size());
+    const double formula_seconds = MeasureSeconds([&] {
+        for (const auto& expression : corpus) {
+            formulas.push_back(ParseFormula(expression));
+        }
+    });
+
+    const double deferred_seconds = MeasureSeconds([&] {
+        for (const auto& expression : corpus) {
+            ParseFormulaDeferred(expression);
+        }
+    });
+
+    size_t ast_bytes = 0;
+    for (const auto& formula : formulas) {
+        ast_bytes += formula->GetMemoryUsage();
+    }
+
+    //GetExpression copies the text built at parse time, so the printing itself is measured on the trees
+    std::vector<FormulaAST> asts;
+    asts.reserve(corpus.size());
+    for (const auto& expression : corpus) {
+        asts.push_back(ParseFormulaAST(expression));
+    }
+    std::vector<std::string> printed(asts.size());
+    const double print_seconds = MeasureSeconds([&] {
+        for (size_t i = 0; i < asts.size(); ++i) {
+            std::ostringstream out;
+            asts[i].PrintFormula(out);
+            printed[i] = out.str();
+        }
+    });
+
+    //The printed form must parse back to itself
+    size_t round_trip_mismatches = 0;
+    for (const auto& expression : printed) {
+        if (ParseFormula(expression)->GetExpression() != expression) {
+            ++round_trip_mismatches;
+        }
+    }
+
+    const double count = static_cast<double>(corpus.size());
+    output << "    {\"name\": \"" << spec.name << "\", \"formulas\": " << corpus.size()
+           << ", \"avg_length\": " << bytes / count
+           << ", \"parse_ast_per_sec\": " << count / ast_seconds
+           << ", \"parse_ast_mb_per_sec\": " << bytes / ast_seconds / 1e6
+           << ", \"parse_formula_per_sec\": " << count / formula_seconds
+           << ", \"parse_deferred_per_sec\": " << count / deferred_seconds
+           << ", \"ast_bytes_per_formula\": " << ast_bytes / count
+           << ", \"print_formula_ns\": " << print_seconds * 1e9 / count
+           << ", \"round_trip_mismatches\": " << round_trip_mismatches << "}";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    int scale = 1;
+    std::string filter;
+    bool dump_corpus = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--dump-corpus") == 0) {
+            dump_corpus = true;
+        }
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--scale N] [--filter substring] [--dump-corpus]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (!dump_corpus) {
+        std::cout << "{\n  \"scale\": " << scale << ",\n  \"corpora\": [\n";
+    }
+    bool first = true;
+    for (size_t index = 0; index < std::size(CORPUS); ++index) {
+        const CorpusSpec& spec = CORPUS[index];
+        if (spec.name.find(filter) == std::string_view::npos) {
+            continue;
+        }
+        Generator generator(spec, static_cast<unsigned>(index + 1));
+        std::vector<std::string> corpus(1000 * scale);
+        for (auto& expression : corpus) {
+            expression = generator.Next();
+        }
+
+        if (dump_corpus) {
+            for (const auto& expression : corpus) {
+                std::cout << expression << '\n';
+            }
+            continue;
+        }
+        std::cout << (first ? "" : ",\n");
+        first = false;
+        Run(std::cout, spec, corpus);
+    }
+    if (!dump_corpus) {
+        std::cout << "\n  ]\n}\n";
+    }
+}
@@ -1,6 +1,9 @@
 #include "cell.h"
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <optional>
@@ -9,51 +12,221 @@ using namespace std::literals;
 
 CellBuilder::CellBuilder(Sheet* sheet, Position pos)
     : sheet_(sheet)
-    , current_pos_(pos) {
+    , current_pos_(pos)
+    , stats_(sheet->GetThreadStats()) {
 }
 
 UniqCellPtr CellBuilder::CreateCell(std::string text) {
-	std::unique_ptr<Impl> impl = nullptr;
+	CellImpl impl;
 	if (text.empty()) {
-		impl = std::make_unique<EmptyImpl>();
+		impl.emplace<EmptyImpl>();
 	}
 	else if (text.size() > 1 && text.front() == FORMULA_SIGN) {
 		if (text[1] == ESCAPE_SIGN) {
-			impl = std::make_unique<TextImpl>(text.substr(1, text.size()));
+			impl.emplace<TextImpl>(std::string_view(text).substr(1), sheet_->strings_);
 		}
 		else {
-			impl = std::make_unique<FormulaImpl>(text.substr(1, text.size()));
-			const std::vector<Position>& vec_pos = dynamic_cast<FormulaImpl*>(impl.get())->GetCells();
-			CheckCyclicDependencies(vec_pos, current_pos_);	//throw exceptions CircularDependencyException
+			std::shared_ptr<const FormulaInterface> formula;
+			{
+				TraceScope trace("ParseFormula", current_pos_);
+				const auto parse_start = std::chrono::steady_clock::now();
+				formula = sheet_->formula_cache_.Get(text.substr(1, text.size()), sheet_->deferred_parsing_);
+				stats_.formulas_parsed.Add();
+				stats_.parse_time_ns.Add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - parse_start).count());
+			}
+			{
+				TraceScope trace("CheckCyclicDependencies", current_pos_);
+				CheckCyclicDependencies(sheet_, current_pos_, formula->GetReferencedCells(),
+				                        formula->GetReferencedSheetCells(),
+				                        formula->GetReferencedRanges());	//throw exceptions CircularDependencyException
+			}
+			//Only a formula that passed the check gets its edges and cells, the formulas it reaches have theirs already
+			impl.emplace<FormulaImpl>(BindFormula(current_pos_, std::move(formula)));
 		}
 	}
 	else {
-		impl = std::make_unique<TextImpl>(text);
+		impl.emplace<TextImpl>(text, sheet_->strings_);
 	}
-	Cell* cell = new Cell(*sheet_, std::move(impl), std::move(current_pos_));
-	return std::unique_ptr<CellInterface>(cell);
+	return UniqCellPtr(new Cell(*sheet_, std::move(impl)));
 }
 
-void CellBuilder::CheckCyclicDependencies(const std::vector<Position>& vec_pos, Position vertex) {
-	if (bypass_list_[vertex] != 0) {
-		return;
+std::vector<UniqCellPtr> CellBuilder::CreateCells(const CellRange& block, const BlockFormulas& formulas) {
+	{
+		TraceScope trace("CheckCyclicDependencies", block.from);
+		CheckBlockCycles(block, formulas);
 	}
-	bypass_list_[vertex] = 1;
 
-	for (const auto pos : vec_pos) {
-		if (!(pos == current_pos_)) {
-			CellInterface* cell_inter = sheet_->GetCell(pos);
-				if (cell_inter == nullptr) {
-					sheet_->SetCell(pos, ""s);
+	std::vector<UniqCellPtr> cells;
+	cells.reserve(formulas.size());
+	for (int row = block.from.row; row <= block.to.row; ++row) {
+		for (int col = block.from.col; col <= block.to.col; ++col) {
+			const Position pos{ row, col };
+			CellImpl impl(BindFormula(pos, formulas[cells.size()]));
+			cells.push_back(UniqCellPtr(new Cell(*sheet_, std::move(impl))));
+		}
+	}
+	return cells;
+}
+
+UniqCellPtr CellBuilder::CreateRelocatedCell(std::shared_ptr<const FormulaInterface> formula) {
+	CellImpl impl(BindFormula(current_pos_, std::move(formula)));
+	return UniqCellPtr(new Cell(*sheet_, std::move(impl)));
+}
+
+void CellBuilder::CheckBlockCycles(const CellRange& block, const BlockFormulas& formulas) {
+	//Iterative depth-first search: a filled block may hold a chain as long as the sheet
+	struct Frame {
+		std::vector<Vertex> next;
+		size_t index = 0;
+		VertexState* state;
+	};
+	std::unordered_map<const Sheet*, std::unordered_map<Position, VertexState, PositionHasher>> states;
+	std::vector<Frame> path;
+	auto enter = [&](Vertex vertex) {
+		VertexState& state = states[vertex.first][vertex.second];	//Nodes of unordered_map keep their address on rehash
+		if (state == VertexState::OnPath) {
+			throw CircularDependencyException("ERROR Circular Dependency"s);
+		}
+		if (state == VertexState::New) {
+			state = VertexState::OnPath;
+			stats_.cycle_check_nodes.Add();
+			path.push_back({ GetBlockEdges(vertex, block, formulas), 0, &state });
+		}
+	};
+
+	for (int row = block.from.row; row <= block.to.row; ++row) {
+		for (int col = block.from.col; col <= block.to.col; ++col) {
+			enter({ sheet_, { row, col } });
+			while (!path.empty()) {
+				Frame& frame = path.back();
+				if (frame.index == frame.next.size()) {
+					*frame.state = VertexState::Done;
+					path.pop_back();
 					continue;
 				}
-			dynamic_cast<Cell*>(cell_inter)->SetDepended(vertex);
-			const std::vector<Position> next_vec_pos = cell_inter->GetReferencedCells();
-			CheckCyclicDependencies(next_vec_pos, pos);
+				enter(frame.next[frame.index++]);
+			}
 		}
-		else {
-			throw CircularDependencyException("ERROR Circular Dependency"s);
+	}
+}
+
+std::vector<CellBuilder::Vertex> CellBuilder::GetBlockEdges(Vertex vertex, const CellRange& block,
+                                                            const BlockFormulas& formulas) const {
+	auto [sheet, pos] = vertex;
+	//Cells of the block have their new formulas, other cells the current ones
+	std::shared_ptr<const FormulaInterface> formula;
+	if (sheet == sheet_ && block.Contains(pos)) {
+		formula = formulas[(pos.row - block.from.row) * block.GetCols() + pos.col - block.from.col];
+	}
+	else if (const Cell* cell = sheet->FindCell(pos)) {
+		formula = cell->GetFormula();
+	}
+	std::vector<Vertex> edges;
+	if (formula == nullptr) {
+		return edges;
+	}
+	for (Position cell_pos : formula->GetReferencedCells()) {
+		edges.push_back({ sheet, cell_pos });
+	}
+	for (const auto& sheet_pos : formula->GetReferencedSheetCells()) {
+		Sheet* target = sheet->GetWorkbookSheet(sheet_pos.sheet);
+		if (target == nullptr) {
+			throw FormulaException("Unknown sheet: "s + sheet_pos.sheet);
+		}
+		edges.push_back({ target, sheet_pos.pos });
+	}
+	for (const auto& range : formula->GetReferencedRanges()) {
+		for (Position cell_pos : sheet->column_indexes_.GetFormulaCells(range)) {
+			edges.push_back({ sheet, cell_pos });
+		}
+		if (sheet != sheet_) {
+			continue;
+		}
+		const CellRange overlap{ { std::max(range.from.row, block.from.row), std::max(range.from.col, block.from.col) },
+		                         { std::min(range.to.row, block.to.row), std::min(range.to.col, block.to.col) } };
+		for (int row = overlap.from.row; row <= overlap.to.row; ++row) {
+			for (int col = overlap.from.col; col <= overlap.to.col; ++col) {
+				edges.push_back({ sheet, { row, col } });
+			}
+		}
+	}
+	return edges;
+}
+
+FormulaImpl CellBuilder::BindFormula(Position pos, std::shared_ptr<const FormulaInterface> formula) {
+	const std::vector<Position> cells = formula->GetReferencedCells();
+	std::vector<CellSlot> slots;
+	slots.reserve(cells.size());
+	for (Position cell_pos : cells) {
+		Cell* cell = sheet_->FindCell(cell_pos);
+		if (cell == nullptr) {
+			sheet_->DoSetCell(cell_pos, ""s);
+			cell = sheet_->FindCell(cell_pos);
+		}
+		sheet_->AddDependent(cell_pos, { sheet_, pos });
+		slots.push_back(sheet_->GetCellSlot(cell_pos));
+	}
+	for (const auto& sheet_pos : formula->GetReferencedSheetCells()) {
+		Sheet* target = sheet_->GetWorkbookSheet(sheet_pos.sheet);
+		if (target->FindCell(sheet_pos.pos) == nullptr) {
+			target->DoSetCell(sheet_pos.pos, ""s);
+		}
+		target->AddDependent(sheet_pos.pos, { sheet_, pos });
+	}
+	for (const auto& range : formula->GetReferencedRanges()) {
+		sheet_->column_indexes_.AddRangeDependent(range, pos);
+	}
+	FormulaImpl impl(std::move(formula), pos);
+	impl.BindCells(*sheet_, std::move(slots));
+	return impl;
+}
+
+void CellBuilder::CheckCyclicDependencies(Sheet* sheet, Position vertex, const std::vector<Position>& vec_pos,
+                                          const std::vector<SheetPosition>& vec_sheet_pos,
+                                          const std::vector<CellRange>& ranges) {
+	if (bypass_list_[sheet][vertex] != 0) {
+		return;
+	}
+	bypass_list_[sheet][vertex] = 1;
+	stats_.cycle_check_nodes.Add();
+
+	for (const auto pos : vec_pos) {
+		CheckCyclicDependency(sheet, pos);
+	}
+	for (const auto& sheet_pos : vec_sheet_pos) {
+		Sheet* target = sheet->GetWorkbookSheet(sheet_pos.sheet);
+		if (target == nullptr) {
+			throw FormulaException("Unknown sheet: "s + sheet_pos.sheet);
 		}
+		CheckCyclicDependency(target, sheet_pos.pos);
+	}
+	for (const auto& range : ranges) {
+		CheckCyclicRange(sheet, range);
+	}
+}
+
+void CellBuilder::CheckCyclicDependency(Sheet* target, Position pos) {
+	if (target == sheet_ && pos == current_pos_) {
+		throw CircularDependencyException("ERROR Circular Dependency"s);
+	}
+	const Cell* cell = static_cast<const Cell*>(target->GetCell(pos));
+	if (cell == nullptr) {	//A missing cell references nothing
+		return;
+	}
+	CheckCyclicDependencies(target, pos, cell->GetReferencedCells(), cell->GetReferencedSheetCells(),
+	                        cell->GetReferencedRanges());
+}
+
+void CellBuilder::CheckCyclicRange(Sheet* sheet, const CellRange& range) {
+	if (sheet == sheet_ && range.Contains(current_pos_)) {
+		throw CircularDependencyException("ERROR Circular Dependency"s);
+	}
+	//Empty and text cells of the range reference nothing, so only its formulas are walked
+	for (Position pos : sheet->column_indexes_.GetFormulaCells(range)) {
+		const Cell* cell = sheet->FindCell(pos);
+		CheckCyclicDependencies(sheet, pos, cell->GetReferencedCells(), cell->GetReferencedSheetCells(),
+		                        cell->GetReferencedRanges());
 	}
 }
 
@@ -62,117 +235,295 @@ CellInterface::Value EmptyImpl::GetValue([[maybe_unused]] const SheetInterface&
 	return CellInterface::Value();
 }
 
-std::string EmptyImpl::GetText() const {
-	return std::string();
-}
-
-TypeCell EmptyImpl::GetTypeCell() const {
-	return TypeCell::EmptyImpl;
+std::string_view EmptyImpl::GetText([[maybe_unused]] const Sheet& sheet) const {
+	return {};
 }
 
 std::vector<Position> EmptyImpl::GetCells() const {
 	return std::vector<Position>();
 }
 
-//TextImpl
-TextImpl::TextImpl(std::string text): text_(std::move(text)) {}
+void EmptyImpl::CountMemory([[maybe_unused]] SheetMemoryUsage& usage) const {
+}
 
-CellInterface::Value TextImpl::GetValue([[maybe_unused]] const SheetInterface& sheet) const {
-	if (text_.empty()) {
-		return {};
+//TextImpl
+TextImpl::TextImpl(std::string_view text, StringPool& strings) {
+	if (text.size() <= MAX_INLINE_SIZE) {
+		std::copy(text.begin(), text.end(), bytes_.begin());
+		bytes_.back() = static_cast<char>(text.size());
+	}
+	else {
+		const StringPool::Id id = strings.Intern(text);
+		std::memcpy(bytes_.data(), &id, sizeof(id));
+		bytes_.back() = POOLED_TAG;
 	}
-	return text_.front() == ESCAPE_SIGN ? text_.substr(1, text_.size()) : text_;
 }
 
-std::string TextImpl::GetText() const {
-	return text_;
+CellInterface::Value TextImpl::GetValue(const Sheet& sheet) const {
+	std::string_view text = GetText(sheet);
+	if (text.empty()) {
+		return {};
+	}
+	if (text.front() == ESCAPE_SIGN) {
+		text.remove_prefix(1);
+	}
+	return std::string(text);
 }
 
-TypeCell TextImpl::GetTypeCell() const {
-	return TypeCell::TextImpl;
+std::string_view TextImpl::GetText(const Sheet& sheet) const {
+	if (auto id = GetPooledId()) {
+		return sheet.GetStringPool().View(*id);
+	}
+	return { bytes_.data(), static_cast<size_t>(bytes_.back()) };
 }
 
 std::vector<Position> TextImpl::GetCells() const {
 	return std::vector<Position>();
 }
 
+void TextImpl::CountMemory([[maybe_unused]] SheetMemoryUsage& usage) const {
+	//Long texts are shared through the sheet's string pool, which accounts for them itself
+}
+
+std::optional<StringPool::Id> TextImpl::GetPooledId() const {
+	if (bytes_.back() != POOLED_TAG) {
+		return std::nullopt;
+	}
+	StringPool::Id id;
+	std::memcpy(&id, bytes_.data(), sizeof(id));
+	return id;
+}
+
+const TextImpl::Key& TextImpl::GetKey() const {
+	return bytes_;
+}
+
 //FormulaImpl
-FormulaImpl::FormulaImpl(std::string expression): formula_(std::move(ParseFormula(expression))) {}
+FormulaImpl::FormulaImpl(std::shared_ptr<const FormulaInterface> formula, Position pos)
+    : state_(std::make_unique<State>()) {
+	state_->formula = std::move(formula);
+	state_->pos = pos;
+}
+
+void FormulaImpl::BindCells(const SheetInterface& sheet, std::vector<CellSlot> slots) {
+	state_->bound_sheet = &sheet;
+	state_->slots = std::move(slots);
+}
+
+void FormulaImpl::RebindCell(Position pos, CellSlot slot) {
+	const std::vector<Position> cells = GetCells();
+	const auto it = std::lower_bound(cells.begin(), cells.end(), pos);	//The cells are sorted and distinct
+	if (it != cells.end() && *it == pos && static_cast<size_t>(it - cells.begin()) < state_->slots.size()) {
+		state_->slots[it - cells.begin()] = slot;
+	}
+}
+
+FormulaInterface::Value FormulaImpl::Evaluate(const SheetInterface& sheet) const {
+	return &sheet == state_->bound_sheet ? state_->formula->Evaluate(sheet, state_->slots.data())
+	                                     : state_->formula->Evaluate(sheet);
+}
 
 CellInterface::Value FormulaImpl::GetValue(const SheetInterface& sheet) const {
-	FormulaInterface::Value value = formula_->Evaluate(sheet);
-	if (IsValue<FormulaError>(value)) {
-		return std::get<FormulaError>(value);
+	return ToCellValue(Evaluate(sheet));
+}
+
+CellInterface::Value FormulaImpl::ToCellValue(const FormulaInterface::Value& value) {
+	if (const FormulaError* error = std::get_if<FormulaError>(&value)) {
+		return *error;
 	}
 	return std::get<double>(value);
 }
 
-std::string FormulaImpl::GetText() const {
-	return '=' + formula_->GetExpression();
+std::string_view FormulaImpl::GetText([[maybe_unused]] const Sheet& sheet) const {
+	return state_->formula->GetText();
 }
 
-TypeCell FormulaImpl::GetTypeCell() const {
-	return TypeCell::FormulaImpl;
+std::vector<Position> FormulaImpl::GetCells() const {
+	return state_->formula->GetReferencedCells();
 }
 
-std::vector<Position> FormulaImpl::GetCells() const {
-	return formula_->GetReferencedCells();
+std::shared_ptr<const FormulaInterface> FormulaImpl::GetFormula() const {
+	return state_->formula;
+}
+
+void FormulaImpl::CountMemory(SheetMemoryUsage& usage) const {
+	//The tree may be shared with other cells, so Cell charges it through the sheet's formula memory counter
+	usage.cell_storage += sizeof(State) + state_->slots.capacity() * sizeof(CellSlot);
+}
+
+Position FormulaImpl::GetPosition() const {
+	return state_->pos;
+}
+
+void FormulaImpl::SetPosition(Position pos) {
+	state_->pos = pos;
+}
+
+const std::optional<FormulaInterface::Value>& FormulaImpl::GetCache() const {
+	return state_->cache;
+}
+
+void FormulaImpl::StoreCache(FormulaInterface::Value value) const {
+	state_->cache = value;
+}
+
+bool FormulaImpl::ResetCache() const {
+	if (!state_->cache.has_value()) {
+		return false;
+	}
+	state_->cache.reset();
+	return true;
 }
 
 //Cell
-Cell::Cell(const Sheet& sheet, std::unique_ptr<Impl> impl, Position pos)
+TypeCell Cell::GetTypeCell() const {
+	static_assert(std::is_same_v<std::variant_alternative_t<static_cast<size_t>(TypeCell::FormulaImpl), CellImpl>,
+	                             FormulaImpl>);
+	return static_cast<TypeCell>(impl_.index());
+}
+
+template <typename F>
+decltype(auto) Cell::Visit(F&& f) const {
+	switch (GetTypeCell()) {
+	case TypeCell::TextImpl:
+		return f(*std::get_if<TextImpl>(&impl_));
+	case TypeCell::FormulaImpl:
+		return f(*std::get_if<FormulaImpl>(&impl_));
+	default:
+		return f(*std::get_if<EmptyImpl>(&impl_));
+	}
+}
+
+Cell::Cell(const Sheet& sheet, CellImpl impl)
     : sheet_(sheet)
-    , impl_(std::move(impl))
-    , own_position_(pos) {
+    , impl_(std::move(impl)) {
+	sheet_.GetMemoryTracker().Allocate(CountOwnMemory());
+	if (const auto* formula = std::get_if<FormulaImpl>(&impl_)) {
+		const FormulaInterface* object = formula->GetFormula().get();
+		sheet_.GetFormulaMemory().Acquire(object, object->GetMemoryUsage());
+	}
+}
+
+Cell::~Cell() {
+	sheet_.GetMemoryTracker().Deallocate(CountOwnMemory());
+	if (const auto* formula = std::get_if<FormulaImpl>(&impl_)) {
+		const FormulaInterface* object = formula->GetFormula().get();
+		sheet_.GetFormulaMemory().Release(object, object->GetMemoryUsage());
+	}
+	if (const auto* text = std::get_if<TextImpl>(&impl_)) {
+		if (auto id = text->GetPooledId()) {
+			sheet_.GetStringPool().Release(*id);
+		}
+	}
 }
 
-Cell::~Cell() {}
+SheetMemoryUsage Cell::CountOwnMemory() const {
+	SheetMemoryUsage usage;
+	usage.cell_storage += sizeof(Cell);
+	Visit([&usage](const auto& impl) { impl.CountMemory(usage); });
+	return usage;
+}
 
 void Cell::Clear() {}
 
 Cell::Value Cell::GetValue() const {
-	if (cache_.has_value()) {
-		return cache_.value();
+	ThreadStats& stats = sheet_.GetThreadStats();
+	if (stats.get_value_depth > 0) {	//Only the outermost call is timed
+		return ComputeValue(stats);
+	}
+	struct DepthGuard {
+		int& depth;
+		~DepthGuard() { --depth; }
+	} depth_guard{ ++stats.get_value_depth };
+	ScopedLatency latency(stats.get_value);
+	return ComputeValue(stats);
+}
+
+Cell::Value Cell::ComputeValue(ThreadStats& stats) const {
+	const auto* formula = std::get_if<FormulaImpl>(&impl_);
+	if (formula == nullptr) {	//Text is its own value, so only formulas keep a cache
+		stats.cache_misses.Add();
+		return Visit([this](const auto& impl) { return impl.GetValue(sheet_); });
+	}
+	if (const auto& cache = formula->GetCache()) {
+		stats.cache_hits.Add();
+		return FormulaImpl::ToCellValue(*cache);
 	}
-	CellInterface::Value value = impl_->GetValue(sheet_);
-	const_cast<Cell*>(this)->cache_ = value;
-	return value;
+	stats.cache_misses.Add();
+	stats.evaluations.Add();
+	TraceScope trace("Evaluate", formula->GetPosition());
+	std::optional<CellProfiler::Evaluation> evaluation;
+	CellProfiler& profiler = sheet_.GetProfiler();
+	if (profiler.IsEnabled()) {
+		evaluation.emplace(profiler, formula->GetPosition());
+	}
+	FormulaInterface::Value value = formula->Evaluate(sheet_);
+	formula->StoreCache(value);
+	return FormulaImpl::ToCellValue(value);
 }
+
 std::string Cell::GetText() const {
-	return impl_->GetText();
+	return std::string(GetTextView());
 }
 
-std::vector<Position> Cell::GetReferencedCells() const {
-	return impl_->GetCells();
+std::string_view Cell::GetTextView() const {
+	return Visit([this](const auto& impl) { return impl.GetText(sheet_); });
 }
 
-void Cell::SetDepended(Position pos) {
-	if (!list_depended_.count(pos)) {
-		list_depended_.insert(pos);
+std::optional<TextImpl::Key> Cell::GetTextKey() const {
+	if (const auto* text = std::get_if<TextImpl>(&impl_)) {
+		return text->GetKey();
 	}
+	return std::nullopt;
 }
 
-Position Cell::GetPosition() const {
-	return own_position_;
+std::vector<Position> Cell::GetReferencedCells() const {
+	return Visit([](const auto& impl) { return impl.GetCells(); });
 }
 
-void Cell::InvalidateCache() {
-	if (!cache_.has_value()) {
-		return;
+std::vector<SheetPosition> Cell::GetReferencedSheetCells() const {
+	auto formula = GetFormula();
+	return formula != nullptr ? formula->GetReferencedSheetCells() : std::vector<SheetPosition>();
+}
+
+std::vector<CellRange> Cell::GetReferencedRanges() const {
+	auto formula = GetFormula();
+	return formula != nullptr ? formula->GetReferencedRanges() : std::vector<CellRange>();
+}
+
+void Cell::SetPosition(Position pos) {
+	if (auto* formula = std::get_if<FormulaImpl>(&impl_)) {
+		formula->SetPosition(pos);
 	}
-	cache_.reset();
+}
 
-	for (auto pos : list_depended_) {
-		CellInterface* cell_inter = const_cast<CellInterface*>(sheet_.GetCell(pos));
-		Cell* current_cell = dynamic_cast<Cell*>(cell_inter);
-		current_cell->InvalidateCache();
+void Cell::RebindCell(Position pos, CellSlot slot) {
+	if (auto* formula = std::get_if<FormulaImpl>(&impl_)) {
+		formula->RebindCell(pos, slot);
 	}
 }
 
-TypeCell Cell::GetTypeCell() const {
-	return impl_->GetTypeCell();
+std::optional<FormulaInterface::Value> Cell::GetCache() const {
+	const auto* formula = std::get_if<FormulaImpl>(&impl_);
+	return formula != nullptr ? formula->GetCache() : std::nullopt;
+}
+
+void Cell::InvalidateCache() {
+	const auto* formula = std::get_if<FormulaImpl>(&impl_);
+	if (formula == nullptr || !formula->GetCache().has_value()) {
+		return;
+	}
+	const FormulaInterface::Value value = *formula->GetCache();
+	formula->ResetCache();
+	sheet_.column_indexes_.ResetFormulaValue(formula->GetPosition(), value);
+	sheet_.GetThreadStats().cells_invalidated.Add();
+	if (CellProfiler& profiler = sheet_.GetProfiler(); profiler.IsEnabled()) {
+		profiler.RecordInvalidation(formula->GetPosition());
+	}
+	sheet_.InvalidateDependents(formula->GetPosition());
 }
 
-void Cell::SetCache(CellInterface::Value value) {
-	cache_ = value;
+std::shared_ptr<const FormulaInterface> Cell::GetFormula() const {
+	const auto* formula = std::get_if<FormulaImpl>(&impl_);
+	return formula != nullptr ? formula->GetFormula() : nullptr;
 }
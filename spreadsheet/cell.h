@@ -2,33 +2,66 @@
 
 #include "common.h"
 #include "formula.h"
+#include "memory_usage.h"
+#include "profiler.h"
 #include "sheet.h"
+#include "stats.h"
+#include "string_pool.h"
+#include "trace.h"
 
+#include <array>
 #include <optional>
 #include <unordered_map>
-#include <unordered_set>
+#include <variant>
 
 class Sheet;
 class Cell;
-using UniqCellPtr = std::unique_ptr<CellInterface>;
+class FormulaImpl;
+using UniqCellPtr = std::unique_ptr<Cell>;
 
-struct Hasher {
-    uint64_t operator()(Position pos) const {
-        return pos.row + pos.col;
-    }
-};
 
 class CellBuilder {
 public:
+    using BlockFormulas = std::vector<std::shared_ptr<const FormulaInterface>>;
+
     CellBuilder(Sheet* sheet, Position pos);
     UniqCellPtr CreateCell(std::string text);
+    // Создаёт ячейки с формулами для блока block: formulas[i] - формула i-й
+    // ячейки блока по строкам. Циклы проверяются одним обходом графа для
+    // всего блока; при цикле бросает CircularDependencyException, и лист
+    // не меняется.
+    std::vector<UniqCellPtr> CreateCells(const CellRange& block, const BlockFormulas& formulas);
+    // Создаёт ячейку с формулой, ссылки которой перенесены вставкой или
+    // удалением строк либо столбцов (см. FormulaInterface::Relocate). Такая
+    // правка не добавляет рёбер в граф, поэтому циклы не проверяются.
+    UniqCellPtr CreateRelocatedCell(std::shared_ptr<const FormulaInterface> formula);
 
 private:
-    void CheckCyclicDependencies(const std::vector<Position>& vec_pos, Position vertex);
+    using Vertex = std::pair<Sheet*, Position>;
+
+    enum class VertexState : char {
+        New,
+        OnPath,
+        Done,
+    };
+
+    void CheckCyclicDependencies(Sheet* sheet, Position vertex, const std::vector<Position>& vec_pos,
+                                 const std::vector<SheetPosition>& vec_sheet_pos,
+                                 const std::vector<CellRange>& ranges);
+    void CheckCyclicDependency(Sheet* target, Position pos);
+    // Проверяет формулы диапазона range листа sheet.
+    void CheckCyclicRange(Sheet* sheet, const CellRange& range);
+    void CheckBlockCycles(const CellRange& block, const BlockFormulas& formulas);
+    // Ячейки, на которые ссылается vertex; для ячеек блока - по новым формулам.
+    std::vector<Vertex> GetBlockEdges(Vertex vertex, const CellRange& block, const BlockFormulas& formulas) const;
+    // Связывает формулу ячейки pos с ячейками, на которые она ссылается,
+    // создавая недостающие, и возвращает привязанную реализацию.
+    FormulaImpl BindFormula(Position pos, std::shared_ptr<const FormulaInterface> formula);
     
     Sheet* sheet_ = nullptr;
     Position current_pos_;
-    std::unordered_map<Position, bool, Hasher> bypass_list_;
+    ThreadStats& stats_;
+    std::unordered_map<const Sheet*, std::unordered_map<Position, bool, PositionHasher>> bypass_list_;
 };
 
 enum class TypeCell {
@@ -37,77 +70,136 @@ enum class TypeCell {
     FormulaImpl
 };
 
-class Impl {
+// Реализации содержимого ячейки. Ячейка хранит одну из них по значению в
+// std::variant и выбирает нужную по типу, без виртуальных вызовов.
+class EmptyImpl {
 public:
-    virtual CellInterface::Value GetValue(const SheetInterface& sheet) const = 0;
-    virtual std::string GetText() const = 0;
-    virtual TypeCell GetTypeCell() const = 0;
-    virtual std::vector<Position> GetCells() const = 0;
+    CellInterface::Value GetValue(const SheetInterface& sheet) const;
+    std::string_view GetText(const Sheet& sheet) const;
+    std::vector<Position> GetCells() const;
+    // Добавляет в usage память вне ячейки, которую занимает реализация.
+    void CountMemory(SheetMemoryUsage& usage) const;
 };
 
-class EmptyImpl: public Impl {
+// Короткий текст хранится прямо в ячейке, длинный - в словаре листа, а
+// ячейка держит его номер и ссылку на него (снимает её деструктор Cell).
+// Короткие тексты занимают место, которое std::variant всё равно отводит
+// под FormulaImpl, а длинные одинаковые тексты хранятся один раз.
+class TextImpl {
 public:
-    CellInterface::Value GetValue(const SheetInterface& sheet) const override;
-    std::string GetText() const override;
-    TypeCell GetTypeCell() const;
-    std::vector<Position> GetCells() const override;
-};
+    static constexpr size_t SIZE = 16;
+    static constexpr size_t MAX_INLINE_SIZE = SIZE - 1;
+    // Ключ текста: у текстов одного листа ключи равны, только когда равны
+    // сами тексты, поэтому сравнение не читает байты длинных текстов.
+    using Key = std::array<char, SIZE>;
 
-class TextImpl : public Impl {
-public:
-    TextImpl(std::string text);
+    TextImpl(std::string_view text, StringPool& strings);
     
-    CellInterface::Value GetValue(const SheetInterface& sheet) const override;
-    std::string GetText() const override;
-    TypeCell GetTypeCell() const;
-    std::vector<Position> GetCells() const override;
+    CellInterface::Value GetValue(const Sheet& sheet) const;
+    std::string_view GetText(const Sheet& sheet) const;
+    std::vector<Position> GetCells() const;
+    void CountMemory(SheetMemoryUsage& usage) const;
+    // Номер текста в словаре, если текст хранится там.
+    std::optional<StringPool::Id> GetPooledId() const;
+    const Key& GetKey() const;
 
 private:
-    std::string text_;
+    static constexpr char POOLED_TAG = static_cast<char>(0xFF);
+
+    //The last byte holds the size of an inline text or POOLED_TAG, then the first bytes hold the id
+    Key bytes_{};
 };
 
-class FormulaImpl : public Impl {
+// Состояние формулы живёт в отдельной записи в куче, поэтому ячейки с текстом
+// за него не платят. В записи же кешируется значение формулы.
+class FormulaImpl {
 public:
-    FormulaImpl(std::string expression);
+    // pos - позиция ячейки формулы.
+    FormulaImpl(std::shared_ptr<const FormulaInterface> formula, Position pos);
+
+    // Привязывает ссылки формулы к ячейкам листа: slots[i] - место ячейки
+    // GetCells()[i]. Когда ячейку удаляют или создают снова, лист
+    // перепривязывает её через RebindCell. Вычисление против другого листа,
+    // например снимка, по-прежнему ищет ячейки по позициям.
+    void BindCells(const SheetInterface& sheet, std::vector<CellSlot> slots);
+    // Привязывает ссылки на ячейку pos к slot.
+    void RebindCell(Position pos, CellSlot slot);
     
-    CellInterface::Value GetValue(const SheetInterface& sheet) const override;
-    std::string GetText() const override;
-    TypeCell GetTypeCell() const;
-    std::vector<Position> GetCells() const override;
+    // Вычисляет формулу против sheet без обращения к кешу.
+    FormulaInterface::Value Evaluate(const SheetInterface& sheet) const;
+    CellInterface::Value GetValue(const SheetInterface& sheet) const;
+    std::string_view GetText(const Sheet& sheet) const;
+    std::vector<Position> GetCells() const;
+    void CountMemory(SheetMemoryUsage& usage) const;
+    std::shared_ptr<const FormulaInterface> GetFormula() const;
+
+    static CellInterface::Value ToCellValue(const FormulaInterface::Value& value);
+
+    Position GetPosition() const;
+    void SetPosition(Position pos);
+
+    const std::optional<FormulaInterface::Value>& GetCache() const;
+    void StoreCache(FormulaInterface::Value value) const;
+    // Возвращает false, если кеш был пуст.
+    bool ResetCache() const;
 
 private:
-    template <typename T>
-    [[nodiscard]] bool IsValue(const FormulaInterface::Value& value) const {
-        return std::holds_alternative<T>(value);
-    }
-    
-    std::unique_ptr<FormulaInterface> formula_;
+    struct State {
+        std::shared_ptr<const FormulaInterface> formula;
+        std::vector<CellSlot> slots;
+        const SheetInterface* bound_sheet = nullptr;
+        Position pos;
+        mutable std::optional<FormulaInterface::Value> cache;
+    };
+
+    std::unique_ptr<State> state_;
 };
 
-class Cell : public CellInterface {
+// Порядок альтернатив совпадает с TypeCell.
+using CellImpl = std::variant<EmptyImpl, TextImpl, FormulaImpl>;
+
+// Все ячейки листа создаёт CellBuilder, поэтому лист хранит их как Cell, а
+// CellInterface остаётся только внешним интерфейсом. Ячейка хранит только
+// своё содержимое: зависимые формулы лист держит отдельно по позициям (см.
+// Sheet::AddDependent), а кеш значения есть только у формул.
+class Cell final : public CellInterface {
 public:
     friend class CellBuilder;
     
     ~Cell();
 
-    void SetDepended(Position pos);
     void Clear();
 
     Value GetValue() const override;
     std::string GetText() const override;
+    // Возвращает текст ячейки без копирования. Действителен, пока ячейку
+    // не изменили.
+    std::string_view GetTextView() const;
+    // Ключ текста ячейки, если в ней текст (см. TextImpl::Key).
+    std::optional<TextImpl::Key> GetTextKey() const;
     std::vector<Position> GetReferencedCells() const override;
+    std::vector<SheetPosition> GetReferencedSheetCells() const;
+    std::vector<CellRange> GetReferencedRanges() const;
     TypeCell GetTypeCell() const;
-
-    Position GetPosition() const;
+    std::shared_ptr<const FormulaInterface> GetFormula() const;
+    // Кешированное значение формулы, если оно есть.
+    std::optional<FormulaInterface::Value> GetCache() const;
+
+    // Позицию помнят только формулы: она нужна им для сброса кеша зависимых.
+    void SetPosition(Position pos);
+    // Привязывает ссылки формулы на ячейку pos к slot (см. FormulaImpl::BindCells).
+    void RebindCell(Position pos, CellSlot slot);
+    // Сбрасывает кеш формулы и, если он был, кеш зависимых от неё формул.
     void InvalidateCache();
-    void SetCache(CellInterface::Value value);
 
 private:
-    Cell(const Sheet& sheet, std::unique_ptr<Impl> impl, Position pos);
+    Cell(const Sheet& sheet, CellImpl impl);
+    // Вызывает f для текущей реализации ячейки.
+    template <typename F>
+    decltype(auto) Visit(F&& f) const;
+    Value ComputeValue(ThreadStats& stats) const;
+    SheetMemoryUsage CountOwnMemory() const;
 
     const Sheet& sheet_;    
-    std::unique_ptr<Impl> impl_ = nullptr;
-    Position own_position_;
-    std::unordered_set<Position, Hasher> list_depended_;
-    std::optional<CellInterface::Value> cache_;
+    CellImpl impl_;
 };
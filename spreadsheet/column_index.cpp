@@ -0,0 +1,428 @@
+#include "column_index.h"
+
+#include "cell.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <algorithm>
+
+namespace {
+
+//Keys hold their text outside the index nodes
+size_t GetKeyBytes(const LookupKey& key) {
+	const std::string* text = std::get_if<std::string>(&key);
+	return text != nullptr ? GetHeapBytes(*text) : 0;
+}
+
+//A formula is indexed by its cached value
+std::optional<LookupKey> GetIndexKey(const Cell* cell) {
+	if (cell == nullptr || cell->GetTypeCell() == TypeCell::EmptyImpl) {
+		return std::nullopt;
+	}
+	if (cell->GetTypeCell() == TypeCell::FormulaImpl) {
+		const auto value = cell->GetCache();
+		return value ? MakeLookupKey(FormulaImpl::ToCellValue(*value)) : std::nullopt;
+	}
+	std::string_view text = cell->GetTextView();
+	if (!text.empty() && text.front() == ESCAPE_SIGN) {
+		text.remove_prefix(1);
+	}
+	return MakeLookupKey(text);
+}
+
+bool IsFormula(const Cell* cell) {
+	return cell != nullptr && cell->GetTypeCell() == TypeCell::FormulaImpl;
+}
+
+//Levels of the sorted index up to the one whose single node covers every row of the sheet
+constexpr int CountSortedLevels(int leaf_bits) {
+	int levels = 1;
+	while (((Position::MAX_ROWS - 1) >> (leaf_bits + levels - 1)) > 0) {
+		++levels;
+	}
+	return levels;
+}
+
+}  // namespace
+
+const int ColumnIndexes::SORTED_LEVELS = CountSortedLevels(SORTED_LEAF_BITS);
+
+ColumnIndexes::Column::Column(MemoryTracker& tracker)
+	: formula_rows(RowSet::allocator_type(tracker, MemoryCategory::DependencyGraph))
+	, pending_formulas(RowSet::allocator_type(tracker, MemoryCategory::LookupIndex))
+	, dependents(DependentMap::allocator_type(tracker, MemoryCategory::DependencyGraph))
+	, exact(0, std::hash<LookupKey>{}, std::equal_to<LookupKey>{},
+	        ExactIndex::allocator_type(tracker, MemoryCategory::LookupIndex))
+	, sorted(SortedTree::allocator_type(tracker, MemoryCategory::LookupIndex)) {
+}
+
+ColumnIndexes::ColumnIndexes(const Sheet& sheet, MemoryTracker& tracker)
+	: sheet_(sheet)
+	, tracker_(tracker) {
+}
+
+void ColumnIndexes::Update(Position pos, const Cell* old_cell, const Cell* new_cell) {
+	if (indexed_columns_ == 0 && !IsFormula(old_cell) && !IsFormula(new_cell)) {
+		return;
+	}
+	std::lock_guard lock(mutex_);
+	if (IsFormula(old_cell)) {
+		EraseRangeDependents(pos, *old_cell, new_cell);
+	}
+	if (IsFormula(old_cell) != IsFormula(new_cell)) {
+		Column& column = GetColumn(pos.col);
+		if (IsFormula(new_cell)) {
+			column.formula_rows.insert(pos.row);
+		}
+		else {
+			column.formula_rows.erase(pos.row);
+		}
+	}
+	auto it = columns_.find(pos.col);
+	if (it == columns_.end()
+	    || (it->second.exact_state == IndexState::None && it->second.sorted_state == IndexState::None)) {
+		return;
+	}
+	if (auto key = GetIndexKey(old_cell)) {
+		Erase(it->second, pos.row, *key);
+	}
+	if (auto key = GetIndexKey(new_cell)) {
+		Insert(it->second, pos.row, *key);
+	}
+	if (IsFormula(new_cell)) {	//A new formula has no value yet
+		it->second.pending_formulas.insert(pos.row);
+	}
+	else {
+		it->second.pending_formulas.erase(pos.row);
+	}
+}
+
+void ColumnIndexes::ResetFormulaValue(Position pos, const FormulaInterface::Value& value) {
+	if (indexed_columns_ == 0) {
+		return;
+	}
+	std::lock_guard lock(mutex_);
+	auto it = columns_.find(pos.col);
+	if (it == columns_.end()
+	    || (it->second.exact_state == IndexState::None && it->second.sorted_state == IndexState::None)) {
+		return;
+	}
+	if (auto key = MakeLookupKey(FormulaImpl::ToCellValue(value))) {
+		Erase(it->second, pos.row, *key);
+	}
+	it->second.pending_formulas.insert(pos.row);
+}
+
+std::vector<Position> ColumnIndexes::GetFormulaCells(const CellRange& range) const {
+	std::vector<Position> result;
+	std::lock_guard lock(mutex_);
+	for (int col = range.from.col; col <= range.to.col; ++col) {
+		const Column* column = FindColumn(col);
+		if (column == nullptr) {
+			continue;
+		}
+		for (auto it = column->formula_rows.lower_bound(range.from.row);
+		     it != column->formula_rows.end() && *it <= range.to.row; ++it) {
+			result.push_back({ *it, col });
+		}
+	}
+	std::sort(result.begin(), result.end());
+	return result;
+}
+
+void ColumnIndexes::AddRangeDependent(const CellRange& range, Position pos) {
+	std::lock_guard lock(mutex_);
+	for (int col = range.from.col; col <= range.to.col; ++col) {
+		Column& column = GetColumn(col);
+		auto it = column.dependents.try_emplace({ range.from.row, range.to.row },
+		                                        PositionSet(column.formula_rows.get_allocator())).first;
+		if (it->second.insert(pos).second) {
+			++range_dependents_;
+		}
+	}
+}
+
+bool ColumnIndexes::HasRangeDependents() const {
+	return range_dependents_ != 0;
+}
+
+bool ColumnIndexes::HasRangeDependents(Position pos) const {
+	if (!HasRangeDependents()) {
+		return false;
+	}
+	std::lock_guard lock(mutex_);
+	const Column* column = FindColumn(pos.col);
+	if (column == nullptr) {
+		return false;
+	}
+	bool found = false;
+	ForEachDependents(*column, pos.row, [&found](const PositionSet&) {
+		found = true;
+	});
+	return found;
+}
+
+std::vector<Position> ColumnIndexes::GetRangeDependents(Position pos) const {
+	std::vector<Position> result;
+	if (!HasRangeDependents()) {
+		return result;
+	}
+	std::lock_guard lock(mutex_);
+	if (const Column* column = FindColumn(pos.col)) {
+		ForEachDependents(*column, pos.row, [&result](const PositionSet& positions) {
+			result.insert(result.end(), positions.begin(), positions.end());
+		});
+	}
+	return result;
+}
+
+void ColumnIndexes::Find(const CellRange& range, const LookupKey& key, LookupMode mode, LookupSearch& search) {
+	const int col = range.from.col;
+	const bool exact = mode == LookupMode::Exact;
+	std::unique_lock lock(mutex_);
+	Column& column = GetColumn(col);
+	Build(lock, column, col, exact);
+
+	//Formulas whose values are not indexed are evaluated without the lock: they may look up themselves
+	const std::vector<int> rows(column.pending_formulas.lower_bound(range.from.row),
+	                            column.pending_formulas.upper_bound(range.to.row));
+	if (!rows.empty()) {
+		++busy_;
+		lock.unlock();
+		std::vector<std::optional<LookupKey>> keys;
+		keys.reserve(rows.size());
+		for (int row : rows) {
+			const Cell* cell = sheet_.FindCell({ row, col });
+			keys.push_back(cell != nullptr ? MakeLookupKey(cell->GetValue()) : std::nullopt);
+		}
+		lock.lock();
+		--busy_;
+		built_.notify_all();
+		for (size_t i = 0; i < rows.size(); ++i) {
+			//A write may have taken the row off the list meanwhile
+			if (column.pending_formulas.erase(rows[i]) != 0 && keys[i]) {
+				Insert(column, rows[i], *keys[i]);
+			}
+		}
+	}
+
+	if (exact) {
+		auto it = column.exact.find(key);
+		if (it == column.exact.end()) {
+			return;
+		}
+		if (auto row = it->second.lower_bound(range.from.row); row != it->second.end() && *row <= range.to.row) {
+			search.Offer(key, *row);
+		}
+		return;
+	}
+	FindSorted(column, range, key, mode, search);
+}
+
+void ColumnIndexes::Clear() {
+	std::unique_lock lock(mutex_);
+	built_.wait(lock, [this] {
+		return busy_ == 0;
+	});
+	for (const auto& [col, column] : columns_) {
+		for (const auto& [key, rows] : column.exact) {
+			tracker_.Deallocate(MemoryCategory::LookupIndex, GetKeyBytes(key));
+		}
+		for (const auto& [node, entries] : column.sorted) {
+			for (const auto& [key, row] : entries) {
+				tracker_.Deallocate(MemoryCategory::LookupIndex, GetKeyBytes(key));
+			}
+		}
+	}
+	columns_.clear();
+	range_dependents_ = 0;
+	indexed_columns_ = 0;
+}
+
+ColumnIndexes::Column& ColumnIndexes::GetColumn(int col) {
+	return columns_.try_emplace(col, tracker_).first->second;
+}
+
+const ColumnIndexes::Column* ColumnIndexes::FindColumn(int col) const {
+	auto it = columns_.find(col);
+	return it != columns_.end() ? &it->second : nullptr;
+}
+
+template <typename F>
+void ColumnIndexes::ForEachDependents(const Column& column, int row, F&& f) const {
+	//Spans are ordered by their first row, so the scan stops at the first span starting below the row
+	for (const auto& [span, positions] : column.dependents) {
+		if (span.first > row) {
+			break;
+		}
+		if (span.second >= row) {
+			f(positions);
+		}
+	}
+}
+
+void ColumnIndexes::Build(std::unique_lock<std::mutex>& lock, Column& column, int col, bool exact) {
+	IndexState& state = exact ? column.exact_state : column.sorted_state;
+	if (state == IndexState::Building) {
+		built_.wait(lock, [&state] {
+			return state == IndexState::Built;
+		});
+	}
+	if (state == IndexState::Built) {
+		return;
+	}
+	if (column.exact_state == IndexState::None && column.sorted_state == IndexState::None) {
+		++indexed_columns_;
+	}
+	//From here on writes update the index themselves. A write races the scan only under the cell's region lock,
+	//and inserting a row twice changes nothing, so every row ends up with its latest text
+	state = IndexState::Building;
+	++busy_;
+	lock.unlock();
+	sheet_.ForEachCellInColumn(col, [&](Position pos, const Cell& cell) {
+		//The values of formulas are read by lookups, another thread may be evaluating them now
+		if (IsFormula(&cell)) {
+			std::lock_guard guard(mutex_);
+			column.pending_formulas.insert(pos.row);
+		}
+		else if (auto key = GetIndexKey(&cell)) {
+			std::lock_guard guard(mutex_);
+			if (exact) {
+				InsertExact(column, pos.row, *key);
+			}
+			else {
+				InsertSorted(column, pos.row, *key);
+			}
+		}
+	});
+	lock.lock();
+	state = IndexState::Built;
+	--busy_;
+	built_.notify_all();
+}
+
+void ColumnIndexes::FindSorted(const Column& column, const CellRange& range, const LookupKey& key, LookupMode mode,
+                              LookupSearch& search) const {
+	//Walk from the key towards the lesser or greater values until the first row inside the range. All rows of
+	//a node between the edge leaves are inside, so only the edge leaves are walked further than one entry
+	const auto find = [&](int level, int index) {
+		auto node = column.sorted.find({ level, index });
+		if (node == column.sorted.end()) {
+			return;
+		}
+		const SortedIndex& entries = node->second;
+		if (mode == LookupMode::LessOrEqual) {
+			for (auto it = entries.upper_bound({ key, INT_MAX }); it != entries.begin();) {
+				--it;
+				if (it->first.index() != key.index()) {
+					return;
+				}
+				if (it->second >= range.from.row && it->second <= range.to.row) {
+					search.Offer(it->first, it->second);
+					return;
+				}
+			}
+			return;
+		}
+		for (auto it = entries.lower_bound({ key, INT_MIN }); it != entries.end(); ++it) {
+			if (it->first.index() != key.index()) {
+				return;
+			}
+			if (it->second >= range.from.row && it->second <= range.to.row) {
+				search.Offer(it->first, it->second);
+				return;
+			}
+		}
+	};
+
+	const int first = range.from.row >> SORTED_LEAF_BITS;
+	const int last = range.to.row >> SORTED_LEAF_BITS;
+	find(0, first);
+	if (last != first) {
+		find(0, last);
+	}
+	//The leaves between the edges are covered bottom-up by at most two nodes per level
+	for (int left = first + 1, right = last - 1, level = 0; left <= right; left >>= 1, right >>= 1, ++level) {
+		if (left % 2 == 1) {
+			find(level, left++);
+		}
+		if (right % 2 == 0) {
+			find(level, right--);
+		}
+	}
+}
+
+void ColumnIndexes::EraseRangeDependents(Position pos, const Cell& old_cell, const Cell* new_cell) {
+	//The new formula has added its ranges before it replaces the old one
+	const std::vector<CellRange> kept = IsFormula(new_cell) ? new_cell->GetReferencedRanges() : std::vector<CellRange>();
+	for (const CellRange& range : old_cell.GetReferencedRanges()) {
+		if (std::find(kept.begin(), kept.end(), range) != kept.end()) {
+			continue;
+		}
+		for (int col = range.from.col; col <= range.to.col; ++col) {
+			auto column = columns_.find(col);
+			if (column == columns_.end()) {
+				continue;
+			}
+			auto span = column->second.dependents.find({ range.from.row, range.to.row });
+			if (span != column->second.dependents.end() && span->second.erase(pos) != 0) {
+				--range_dependents_;
+				if (span->second.empty()) {
+					column->second.dependents.erase(span);
+				}
+			}
+		}
+	}
+}
+
+void ColumnIndexes::InsertExact(Column& column, int row, const LookupKey& key) {
+	auto it = column.exact.find(key);
+	if (it == column.exact.end()) {
+		it = column.exact.emplace(key, RowSet(column.exact.get_allocator())).first;
+		tracker_.Allocate(MemoryCategory::LookupIndex, GetKeyBytes(key));
+	}
+	it->second.insert(row);
+}
+
+void ColumnIndexes::InsertSorted(Column& column, int row, const LookupKey& key) {
+	for (int level = 0; level < SORTED_LEVELS; ++level) {
+		auto node = column.sorted.try_emplace({ level, row >> (SORTED_LEAF_BITS + level) },
+		                                      SortedIndex(column.sorted.get_allocator())).first;
+		if (node->second.insert({ key, row }).second) {
+			tracker_.Allocate(MemoryCategory::LookupIndex, GetKeyBytes(key));
+		}
+	}
+}
+
+void ColumnIndexes::Insert(Column& column, int row, const LookupKey& key) {
+	if (column.exact_state != IndexState::None) {
+		InsertExact(column, row, key);
+	}
+	if (column.sorted_state != IndexState::None) {
+		InsertSorted(column, row, key);
+	}
+}
+
+void ColumnIndexes::Erase(Column& column, int row, const LookupKey& key) {
+	const size_t key_bytes = GetKeyBytes(key);
+	if (column.exact_state != IndexState::None) {
+		if (auto it = column.exact.find(key); it != column.exact.end()) {
+			it->second.erase(row);
+			if (it->second.empty()) {
+				column.exact.erase(it);
+				tracker_.Deallocate(MemoryCategory::LookupIndex, key_bytes);
+			}
+		}
+	}
+	if (column.sorted_state != IndexState::None) {
+		for (int level = 0; level < SORTED_LEVELS; ++level) {
+			auto node = column.sorted.find({ level, row >> (SORTED_LEAF_BITS + level) });
+			if (node != column.sorted.end() && node->second.erase({ key, row }) != 0) {
+				tracker_.Deallocate(MemoryCategory::LookupIndex, key_bytes);
+				if (node->second.empty()) {
+					column.sorted.erase(node);
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+#include "memory_usage.h"
+
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class Cell;
+class Sheet;
+
+// Данные листа по столбцам, которые нужны формулам с диапазонами:
+// * строки с формулами - проверка циклов через диапазон обходит только их;
+// * формулы, которые ссылаются на диапазоны, - запись в диапазон сбрасывает
+//   их кеш;
+// * индексы для функций поиска: хеш-индекс для точного совпадения и
+//   дерево отрезков строк с упорядоченными значениями - для приближённого.
+//   Индекс столбца строится при первом поиске по нему и дальше обновляется
+//   при каждой записи в столбец.
+// Замена формулы убирает её диапазоны, которых нет у новой формулы.
+// Формулы попадают в индексы со своим кешированным значением. Значение
+// меняется без записи в столбец, поэтому сброс кеша убирает его из индексов,
+// а поиск вычисляет формулы своего диапазона, значений которых там нет.
+// Все методы потокобезопасны.
+class ColumnIndexes {
+public:
+    ColumnIndexes(const Sheet& sheet, MemoryTracker& tracker);
+
+    // Учитывает замену ячейки pos: old_cell - прежняя ячейка, new_cell -
+    // новая, nullptr - ячейки нет.
+    void Update(Position pos, const Cell* old_cell, const Cell* new_cell);
+
+    // Убирает из индексов прежнее значение value формулы pos, кеш которой
+    // сброшен.
+    void ResetFormulaValue(Position pos, const FormulaInterface::Value& value);
+
+    // Возвращает ячейки с формулами в range по возрастанию.
+    std::vector<Position> GetFormulaCells(const CellRange& range) const;
+
+    // Запоминает, что формула pos ссылается на range. Update забывает это,
+    // когда формулу в pos заменяют.
+    void AddRangeDependent(const CellRange& range, Position pos);
+    bool HasRangeDependents() const;
+    bool HasRangeDependents(Position pos) const;
+    // Возвращает формулы, которые ссылаются на диапазоны с ячейкой pos.
+    std::vector<Position> GetRangeDependents(Position pos) const;
+
+    // Предлагает search лучшую для mode текстовую ячейку столбца
+    // range.from.col в строках range, строя индекс столбца при необходимости.
+    // Построение обходит только строки столбца и не останавливает запись:
+    // пока индекс строится, Update уже обновляет его.
+    void Find(const CellRange& range, const LookupKey& key, LookupMode mode, LookupSearch& search);
+
+    // Забывает все данные. Индексы поиска перестроятся при следующем поиске.
+    // Дожидается построений индексов, которые идут в других потоках.
+    void Clear();
+
+private:
+    // Лист упорядоченного индекса - 2^SORTED_LEAF_BITS строк. Узел уровня
+    // level покрывает 2^level соседних листьев и хранит значения их строк,
+    // так что поиск по любому диапазону строк проверяет не больше двух узлов
+    // на уровень и просматривает строки только в двух крайних листьях.
+    static constexpr int SORTED_LEAF_BITS = 4;
+    // Уровней столько, чтобы единственный узел верхнего покрывал все строки.
+    static const int SORTED_LEVELS;
+
+    using RowSet = std::set<int, std::less<int>, TrackingAllocator<int>>;
+    using PositionSet = std::set<Position, std::less<Position>, TrackingAllocator<Position>>;
+    using RowSpan = std::pair<int, int>;
+    using DependentMap = std::map<RowSpan, PositionSet, std::less<RowSpan>,
+                                  TrackingAllocator<std::pair<const RowSpan, PositionSet>>>;
+    using ExactIndex = std::unordered_map<LookupKey, RowSet, std::hash<LookupKey>, std::equal_to<LookupKey>,
+                                          TrackingAllocator<std::pair<const LookupKey, RowSet>>>;
+    using SortedEntry = std::pair<LookupKey, int>;
+    using SortedIndex = std::set<SortedEntry, std::less<SortedEntry>, TrackingAllocator<SortedEntry>>;
+    // Уровень и номер узла.
+    using SortedNode = std::pair<int, int>;
+    using SortedTree = std::map<SortedNode, SortedIndex, std::less<SortedNode>,
+                                TrackingAllocator<std::pair<const SortedNode, SortedIndex>>>;
+
+    enum class IndexState {
+        None,
+        Building,
+        Built,
+    };
+
+    struct Column {
+        explicit Column(MemoryTracker& tracker);
+
+        RowSet formula_rows;
+        // Строки формул, значений которых нет в индексах поиска.
+        RowSet pending_formulas;
+        // Строки диапазона [first, second] -> формулы, которые на него ссылаются.
+        DependentMap dependents;
+        IndexState exact_state = IndexState::None;
+        ExactIndex exact;
+        IndexState sorted_state = IndexState::None;
+        // Узел -> значения его строк по возрастанию. Пустых узлов нет.
+        SortedTree sorted;
+    };
+
+    Column& GetColumn(int col);
+    const Column* FindColumn(int col) const;
+    template <typename F>
+    void ForEachDependents(const Column& column, int row, F&& f) const;
+    // Строит индекс столбца col или дожидается, пока его достроит другой поток.
+    // Вызывается под mutex_ и отпускает его на время обхода столбца.
+    void Build(std::unique_lock<std::mutex>& lock, Column& column, int col, bool exact);
+    void FindSorted(const Column& column, const CellRange& range, const LookupKey& key, LookupMode mode,
+                    LookupSearch& search) const;
+    // Убирает диапазоны прежней формулы pos, на которые не ссылается новая.
+    void EraseRangeDependents(Position pos, const Cell& old_cell, const Cell* new_cell);
+    void InsertExact(Column& column, int row, const LookupKey& key);
+    void InsertSorted(Column& column, int row, const LookupKey& key);
+    void Insert(Column& column, int row, const LookupKey& key);
+    void Erase(Column& column, int row, const LookupKey& key);
+
+    const Sheet& sheet_;
+    MemoryTracker& tracker_;
+    mutable std::mutex mutex_;
+    std::condition_variable built_;
+    // Поиски, которые работают со столбцом без mutex_ (строят индекс или
+    // вычисляют формулы): Clear их дожидается.
+    size_t busy_ = 0;
+    std::unordered_map<int, Column> columns_;
+    std::atomic<size_t> range_dependents_ = 0;
+    std::atomic<size_t> indexed_columns_ = 0;
+};
@@ -1,13 +1,34 @@
 #pragma once
 
+#include <cstdint>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
 #include <variant>
 #include <vector>
 
+// Размер листа задаётся при сборке: -DSPREADSHEET_MAX_ROWS=1048576 и
+// -DSPREADSHEET_MAX_COLS. Строк может быть до 2^20, столбцов - до 18278
+// (ZZZ, имя столбца не длиннее трёх букв).
+#ifndef SPREADSHEET_MAX_ROWS
+#define SPREADSHEET_MAX_ROWS 16384
+#endif
+#ifndef SPREADSHEET_MAX_COLS
+#define SPREADSHEET_MAX_COLS 16384
+#endif
+
+// Число цифр в десятичной записи value > 0.
+constexpr size_t CountDecimalDigits(int value) {
+    size_t digits = 1;
+    for (; value >= 10; value /= 10) {
+        ++digits;
+    }
+    return digits;
+}
+
 // Позиция ячейки. Индексация с нуля.
 struct Position {
     int row = 0;
@@ -18,14 +39,98 @@ struct Position {
 
     bool IsValid() const;
     std::string ToString() const;
+    // Записывает имя ячейки в buffer без завершающего нуля и возвращает его
+    // длину (0 для некорректной позиции). Размер buffer - не меньше
+    // MAX_STRING_LENGTH.
+    size_t ToString(char* buffer) const;
 
     static Position FromString(std::string_view str);
 
-    static const int MAX_ROWS = 16384;
-    static const int MAX_COLS = 16384;
+    // Упакованный ключ позиции: строка в старших 32 битах, столбец в
+    // младших. У разных позиций, включая NONE, ключи разные.
+    uint64_t GetKey() const {
+        return static_cast<uint64_t>(static_cast<uint32_t>(row)) << 32 | static_cast<uint32_t>(col);
+    }
+
+    static constexpr int MAX_ROWS = SPREADSHEET_MAX_ROWS;
+    static constexpr int MAX_COLS = SPREADSHEET_MAX_COLS;
+    static constexpr size_t MAX_COL_LETTERS = 3;
+    static constexpr size_t MAX_STRING_LENGTH = MAX_COL_LETTERS + CountDecimalDigits(MAX_ROWS);
     static const Position NONE;
 };
 
+static_assert(0 < Position::MAX_ROWS && Position::MAX_ROWS <= (1 << 20), "SPREADSHEET_MAX_ROWS is out of range");
+static_assert(0 < Position::MAX_COLS && Position::MAX_COLS <= 26 + 26 * 26 + 26 * 26 * 26,
+              "SPREADSHEET_MAX_COLS is out of range");
+
+// Хеш позиции - перемешанный упакованный ключ, поэтому соседние ячейки и
+// ячейки на одной диагонали не попадают в одну корзину. Его используют все
+// хеш-таблицы с ключом Position.
+struct PositionHasher {
+    //noexcept lets hash tables recompute the hash instead of storing it in every node
+    size_t operator()(Position pos) const noexcept {
+        uint64_t key = pos.GetKey();
+        key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9u;
+        key = (key ^ (key >> 27)) * 0x94d049bb133111ebu;
+        return static_cast<size_t>(key ^ (key >> 31));
+    }
+};
+
+// Пакетные варианты Position::ToString и Position::FromString.
+// AppendPositions дописывает в output имена позиций [begin, end) через
+// separator; ParsePositions записывает в output позиции для имён [begin, end),
+// для некорректных имён - Position::NONE.
+void AppendPositions(const Position* begin, const Position* end, char separator, std::string& output);
+void ParsePositions(const std::string_view* begin, const std::string_view* end, Position* output);
+
+// Прямоугольный диапазон ячеек, в формуле записывается как A1:B10. Обе
+// границы входят в диапазон, from - левый верхний угол, to - правый нижний.
+struct CellRange {
+    Position from;
+    Position to;
+
+    bool operator==(const CellRange& rhs) const;
+    bool operator<(const CellRange& rhs) const;
+
+    bool Contains(Position pos) const;
+    int GetRows() const;
+    int GetCols() const;
+    std::string ToString() const;
+};
+
+// Вставка (insert) или удаление count строк либо столбцов листа, начиная со
+// строки или столбца first. Переводит позиции и диапазоны в их место после
+// правки.
+struct StructureEdit {
+    enum class Axis {
+        Rows,
+        Cols,
+    };
+
+    Axis axis = Axis::Rows;
+    bool insert = true;
+    int first = 0;
+    int count = 0;
+
+    // Позиция после правки; std::nullopt, если ячейка удалена или вставка
+    // вытеснила её за границу листа.
+    std::optional<Position> Map(Position pos) const;
+    // Диапазон после правки: вставка внутри диапазона растягивает его, но не
+    // дальше границы листа, удаление части сжимает; std::nullopt, если
+    // удалён весь диапазон или вставка вытеснила его за границу.
+    std::optional<CellRange> Map(const CellRange& range) const;
+};
+
+// Значение, по которому ищут функции MATCH, VLOOKUP и XLOOKUP. Текст,
+// представляющий число, ищется как число.
+using LookupKey = std::variant<double, std::string>;
+
+enum class LookupMode {
+    Exact,           // равное значение, первое по порядку
+    LessOrEqual,     // наибольшее значение не больше искомого, последнее из равных
+    GreaterOrEqual,  // наименьшее значение не меньше искомого, первое из равных
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -40,6 +145,7 @@ public:
         Ref,    // ссылка на ячейку с некорректной позицией
         Value,  // ячейка не может быть трактована как число
         Div0,  // в результате вычисления возникло деление на ноль
+        NA,    // функция поиска не нашла значение
     };
 
     FormulaError(Category category) : category_(category) {};
@@ -60,6 +166,8 @@ public:
             return "#DIV/0!";
         case Category::Value:
             return "#VALUE!";
+        case Category::NA:
+            return "#N/A";
         }
         return "UNKNOWN TYPE ERROR";
     }
@@ -154,6 +262,20 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Возвращает лист той же книги с указанным именем. Используется при
+    // вычислении ссылок вида Sheet2!A1. Таблица вне книги других листов не
+    // видит и возвращает nullptr.
+    virtual const SheetInterface* FindSheet(std::string_view name) const {
+        return nullptr;
+    }
+
+    // Ищет key в столбце range.from.col в строках range по правилам mode и
+    // возвращает номер найденной строки либо -1. Таблица без индексов
+    // возвращает std::nullopt, и формула просматривает диапазон сама.
+    virtual std::optional<int> FindInColumn(const CellRange& range, const LookupKey& key, LookupMode mode) const {
+        return std::nullopt;
+    }
 };
 
 // Создаёт готовую к работе пустую таблицу.
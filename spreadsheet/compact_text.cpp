@@ -0,0 +1,88 @@
+#include "compact_text.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+using namespace std::literals;
+
+CompactText::CompactText() {
+	bytes_[INLINE_CAPACITY] = 0;
+}
+
+CompactText::CompactText(std::string_view text) {
+	if (text.size() <= INLINE_CAPACITY) {
+		if (!text.empty()) {
+			std::memcpy(bytes_, text.data(), text.size());
+		}
+		bytes_[INLINE_CAPACITY] = static_cast<unsigned char>(text.size());
+		return;
+	}
+	if (text.size() > UINT32_MAX) {
+		throw std::length_error("Cell text is too long"s);
+	}
+	char* data = new char[text.size()];
+	std::memcpy(data, text.data(), text.size());
+	const uint32_t size = static_cast<uint32_t>(text.size());
+	std::memcpy(bytes_, &data, sizeof(data));
+	std::memcpy(bytes_ + sizeof(data), &size, sizeof(size));
+	bytes_[INLINE_CAPACITY] = HEAP_TAG;
+}
+
+CompactText::CompactText(const CompactText& other)
+	: CompactText(other.View()) {
+}
+
+CompactText::CompactText(CompactText&& other) noexcept {
+	std::memcpy(bytes_, other.bytes_, sizeof(bytes_));
+	other.bytes_[INLINE_CAPACITY] = 0;
+}
+
+CompactText& CompactText::operator=(const CompactText& other) {
+	if (this != &other) {
+		*this = CompactText(other);
+	}
+	return *this;
+}
+
+CompactText& CompactText::operator=(CompactText&& other) noexcept {
+	if (this != &other) {
+		this->~CompactText();
+		std::memcpy(bytes_, other.bytes_, sizeof(bytes_));
+		other.bytes_[INLINE_CAPACITY] = 0;
+	}
+	return *this;
+}
+
+CompactText::~CompactText() {
+	if (!IsInline()) {
+		delete[] GetHeapData();
+	}
+}
+
+std::string_view CompactText::View() const {
+	if (IsInline()) {
+		return { reinterpret_cast<const char*>(bytes_), bytes_[INLINE_CAPACITY] };
+	}
+	return { GetHeapData(), GetHeapSize() };
+}
+
+size_t CompactText::GetHeapBytes() const {
+	return IsInline() ? 0 : GetHeapSize();
+}
+
+bool CompactText::IsInline() const {
+	return bytes_[INLINE_CAPACITY] != HEAP_TAG;
+}
+
+const char* CompactText::GetHeapData() const {
+	const char* data;
+	std::memcpy(&data, bytes_, sizeof(data));
+	return data;
+}
+
+uint32_t CompactText::GetHeapSize() const {
+	uint32_t size;
+	std::memcpy(&size, bytes_ + sizeof(const char*), sizeof(size));
+	return size;
+}
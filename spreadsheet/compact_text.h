@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Текст в 16 байтах: до 15 символов хранятся в самом объекте, более
+// длинный текст - в куче.
+class CompactText {
+public:
+    CompactText();
+    explicit CompactText(std::string_view text);
+    CompactText(const CompactText& other);
+    CompactText(CompactText&& other) noexcept;
+    CompactText& operator=(const CompactText& other);
+    CompactText& operator=(CompactText&& other) noexcept;
+    ~CompactText();
+
+    std::string_view View() const;
+    // Память, которую текст занял в куче; 0 для короткого текста.
+    size_t GetHeapBytes() const;
+
+private:
+    static constexpr size_t INLINE_CAPACITY = 15;
+    static constexpr unsigned char HEAP_TAG = 0xFF;
+
+    //bytes_[15] holds the inline size or HEAP_TAG; a heap text keeps its pointer and size in front
+    bool IsInline() const;
+    const char* GetHeapData() const;
+    uint32_t GetHeapSize() const;
+
+    alignas(8) unsigned char bytes_[16];
+};
@@ -0,0 +1,226 @@
+#include "dependency_graph.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <optional>
+
+namespace {
+
+//Bottom-k sketch of a cone: the smallest hashes of its cells
+constexpr size_t SKETCH_SIZE = 16;
+
+uint64_t HashIndex(size_t index) {
+	//splitmix64, so that the estimates do not depend on the order of the cells
+	uint64_t x = index + 0x9e3779b97f4a7c15ull;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+}  // namespace
+
+DependencyGraph::DependencyGraph(const Sheet& sheet) {
+	std::vector<std::pair<Position, std::vector<Position>>> cells;
+	sheet.ForEachCell([&cells](Position pos, const CellInterface& cell) {
+		cells.emplace_back(pos, cell.GetReferencedCells());
+	});
+	std::sort(cells.begin(), cells.end(), [](const auto& lhs, const auto& rhs) {	//keeps the export stable
+		return lhs.first < rhs.first;
+	});
+
+	for (const auto& [pos, references] : cells) {
+		GetIndex(pos);
+	}
+	for (const auto& [pos, references] : cells) {
+		const size_t index = indexes_.at(pos);
+		for (Position referenced : references) {
+			const size_t input = GetIndex(referenced);
+			inputs_[index].push_back(input);
+			outputs_[input].push_back(index);
+		}
+	}
+}
+
+size_t DependencyGraph::GetIndex(Position pos) {
+	auto [it, inserted] = indexes_.emplace(pos, positions_.size());
+	if (inserted) {
+		positions_.push_back(pos);
+		inputs_.emplace_back();
+		outputs_.emplace_back();
+	}
+	return it->second;
+}
+
+std::vector<size_t> DependencyGraph::GetLevels() const {
+	//Kahn's algorithm: a cell is leveled once all of its inputs are
+	std::vector<size_t> levels(positions_.size(), 0);
+	std::vector<size_t> pending(positions_.size());
+	std::vector<size_t> ready;
+	for (size_t i = 0; i < positions_.size(); ++i) {
+		pending[i] = inputs_[i].size();
+		if (pending[i] == 0) {
+			ready.push_back(i);
+		}
+	}
+	while (!ready.empty()) {
+		const size_t current = ready.back();
+		ready.pop_back();
+		for (size_t output : outputs_[current]) {
+			levels[output] = std::max(levels[output], levels[current] + 1);
+			if (--pending[output] == 0) {
+				ready.push_back(output);
+			}
+		}
+	}
+	return levels;
+}
+
+std::vector<double> DependencyGraph::EstimateConeSizes(const std::vector<size_t>& levels) const {
+	//Outputs are on higher levels than their inputs, so going down the levels each sketch merges finished ones
+	std::vector<size_t> order(positions_.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&levels](size_t lhs, size_t rhs) {
+		return levels[lhs] > levels[rhs];
+	});
+
+	std::vector<std::vector<uint64_t>> sketches(positions_.size());
+	std::vector<double> sizes(positions_.size(), 0.0);
+	for (size_t current : order) {
+		std::vector<uint64_t>& sketch = sketches[current];
+		for (size_t output : outputs_[current]) {
+			sketch.push_back(HashIndex(output));
+			sketch.insert(sketch.end(), sketches[output].begin(), sketches[output].end());
+		}
+		std::sort(sketch.begin(), sketch.end());
+		sketch.erase(std::unique(sketch.begin(), sketch.end()), sketch.end());
+		if (sketch.size() < SKETCH_SIZE) {
+			sizes[current] = static_cast<double>(sketch.size());	//The whole cone is in the sketch
+			continue;
+		}
+		sketch.resize(SKETCH_SIZE);
+		sizes[current] = (SKETCH_SIZE - 1) / std::ldexp(static_cast<double>(sketch.back()), -64);
+	}
+	return sizes;
+}
+
+size_t DependencyGraph::CountCone(size_t root, std::vector<uint32_t>& visited, uint32_t mark) const {
+	size_t count = 0;
+	std::vector<size_t> stack = { root };
+	visited[root] = mark;
+	while (!stack.empty()) {
+		const size_t current = stack.back();
+		stack.pop_back();
+		for (size_t output : outputs_[current]) {
+			if (visited[output] != mark) {
+				visited[output] = mark;
+				++count;
+				stack.push_back(output);
+			}
+		}
+	}
+	return count;
+}
+
+size_t DependencyGraph::GetConeSize(Position pos) const {
+	auto it = indexes_.find(pos);
+	if (it == indexes_.end()) {
+		return 0;
+	}
+	std::vector<uint32_t> visited(positions_.size(), 0);
+	return CountCone(it->second, visited, 1);
+}
+
+DependencyGraphStats DependencyGraph::Analyze() const {
+	return Analyze(GetLevels());
+}
+
+DependencyGraphStats DependencyGraph::Analyze(const std::vector<size_t>& levels) const {
+	DependencyGraphStats stats;
+	stats.nodes = positions_.size();
+	for (size_t i = 0; i < positions_.size(); ++i) {
+		stats.edges += inputs_[i].size();
+		++stats.fan_in_histogram[inputs_[i].size()];
+		++stats.fan_out_histogram[outputs_[i].size()];
+	}
+
+	for (size_t level : levels) {
+		if (level >= stats.level_widths.size()) {
+			stats.level_widths.resize(level + 1, 0);
+		}
+		++stats.level_widths[level];
+	}
+	stats.max_depth = stats.level_widths.empty() ? 0 : stats.level_widths.size() - 1;
+
+	//The cone of a cell is contained in the cone of each of its inputs, so only cells without inputs are checked.
+	//A search per cell would take time proportional to cells times edges, so the root is chosen by estimates
+	const std::vector<double> cone_sizes = EstimateConeSizes(levels);
+	std::optional<size_t> root;
+	for (size_t i = 0; i < positions_.size(); ++i) {
+		if (inputs_[i].empty() && cone_sizes[i] > 0 && (!root.has_value() || cone_sizes[i] > cone_sizes[*root])) {
+			root = i;
+		}
+	}
+	if (root.has_value()) {
+		std::vector<uint32_t> visited(positions_.size(), 0);
+		stats.largest_cone_size = CountCone(*root, visited, 1);
+		stats.largest_cone_root = positions_[*root];
+	}
+	return stats;
+}
+
+void DependencyGraph::WriteDot(std::ostream& output) const {
+	output << "digraph dependencies {\n";
+	for (const Position& pos : positions_) {
+		output << "  \"" << pos.ToString() << "\";\n";
+	}
+	for (size_t i = 0; i < positions_.size(); ++i) {
+		for (size_t input : inputs_[i]) {
+			output << "  \"" << positions_[input].ToString() << "\" -> \"" << positions_[i].ToString() << "\";\n";
+		}
+	}
+	output << "}\n";
+}
+
+void DependencyGraph::WriteJson(std::ostream& output) const {
+	const std::vector<size_t> levels = GetLevels();
+	const DependencyGraphStats stats = Analyze(levels);
+
+	auto write_histogram = [&output](const std::map<size_t, size_t>& histogram) {
+		output << '{';
+		bool first = true;
+		for (const auto& [degree, count] : histogram) {
+			output << (first ? "" : ", ") << '"' << degree << "\": " << count;
+			first = false;
+		}
+		output << '}';
+	};
+
+	output << "{\n  \"nodes\": [";
+	for (size_t i = 0; i < positions_.size(); ++i) {
+		output << (i == 0 ? "" : ", ") << "{\"cell\": \"" << positions_[i].ToString() << "\", \"level\": " << levels[i] << '}';
+	}
+	output << "],\n  \"edges\": [";
+	bool first = true;
+	for (size_t i = 0; i < positions_.size(); ++i) {
+		for (size_t input : inputs_[i]) {
+			output << (first ? "" : ", ") << "[\"" << positions_[input].ToString() << "\", \"" << positions_[i].ToString() << "\"]";
+			first = false;
+		}
+	}
+	output << "],\n  \"stats\": {\"nodes\": " << stats.nodes << ", \"edges\": " << stats.edges << ", \"fan_in\": ";
+	write_histogram(stats.fan_in_histogram);
+	output << ", \"fan_out\": ";
+	write_histogram(stats.fan_out_histogram);
+	output << ", \"max_depth\": " << stats.max_depth << ", \"level_widths\": [";
+	for (size_t i = 0; i < stats.level_widths.size(); ++i) {
+		output << (i == 0 ? "" : ", ") << stats.level_widths[i];
+	}
+	output << "], \"largest_cone\": {\"cell\": \""
+	       << (stats.largest_cone_size != 0 ? stats.largest_cone_root.ToString() : std::string())
+	       << "\", \"size\": " << stats.largest_cone_size << "}}\n}\n";
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+class Sheet;
+
+// Характеристики графа зависимостей листа. Входы ячейки - ячейки, на которые
+// ссылается её формула, выходы - формулы, которые ссылаются на неё.
+struct DependencyGraphStats {
+    size_t nodes = 0;
+    size_t edges = 0;
+    // Число входов (выходов) -> число ячеек с таким числом входов (выходов).
+    std::map<size_t, size_t> fan_in_histogram;
+    std::map<size_t, size_t> fan_out_histogram;
+    // Уровень ячейки без входов - 0, иначе на 1 больше максимального уровня
+    // её входов. level_widths[i] - число ячеек уровня i, то есть сколько
+    // ячеек можно вычислить параллельно на i-м шаге.
+    size_t max_depth = 0;
+    std::vector<size_t> level_widths;
+    // Ячейка, изменение которой сбрасывает кеш наибольшего числа формул.
+    // Конусы больше 16 ячеек сравниваются по оценке размера, а размер
+    // выбранного конуса считается точно.
+    Position largest_cone_root = Position::NONE;
+    size_t largest_cone_size = 0;
+};
+
+// Граф зависимостей ячеек листа, построенный по GetReferencedCells().
+// Ссылки на другие листы книги и диапазоны функций поиска не учитываются.
+class DependencyGraph {
+public:
+    explicit DependencyGraph(const Sheet& sheet);
+
+    DependencyGraphStats Analyze() const;
+
+    // Размер нисходящего конуса: сколько формул прямо или косвенно зависят
+    // от ячейки.
+    size_t GetConeSize(Position pos) const;
+
+    // Экспорт в формате Graphviz DOT; рёбра направлены от ячейки к формулам,
+    // которые от неё зависят.
+    void WriteDot(std::ostream& output) const;
+    // Экспорт в JSON: вершины с уровнями, рёбра и характеристики графа.
+    void WriteJson(std::ostream& output) const;
+
+private:
+    size_t GetIndex(Position pos);
+    DependencyGraphStats Analyze(const std::vector<size_t>& levels) const;
+    std::vector<size_t> GetLevels() const;
+    // Оценки размеров конусов всех ячеек за один проход по уровням.
+    std::vector<double> EstimateConeSizes(const std::vector<size_t>& levels) const;
+    size_t CountCone(size_t root, std::vector<uint32_t>& visited, uint32_t mark) const;
+
+    std::vector<Position> positions_;
+    std::unordered_map<Position, size_t, PositionHasher> indexes_;
+    std::vector<std::vector<size_t>> inputs_;
+    std::vector<std::vector<size_t>> outputs_;
+};
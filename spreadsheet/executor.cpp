@@ -0,0 +1,42 @@
+#include "executor.h"
+
+SerialExecutor::SerialExecutor()
+	: worker_([this] {
+		Run();
+	}) {
+}
+
+SerialExecutor::~SerialExecutor() {
+	{
+		std::lock_guard guard(mutex_);
+		stopped_ = true;
+	}
+	cv_.notify_one();
+	worker_.join();
+}
+
+void SerialExecutor::Post(std::function<void()> task) {
+	{
+		std::lock_guard guard(mutex_);
+		tasks_.push_back(std::move(task));
+	}
+	cv_.notify_one();
+}
+
+void SerialExecutor::Run() {
+	while (true) {
+		std::function<void()> task;
+		{
+			std::unique_lock lock(mutex_);
+			cv_.wait(lock, [this] {
+				return stopped_ || !tasks_.empty();
+			});
+			if (tasks_.empty()) {	//stopped and drained
+				return;
+			}
+			task = std::move(tasks_.front());
+			tasks_.pop_front();
+		}
+		task();
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+// Исполнитель с одним рабочим потоком: задачи выполняются строго в порядке
+// постановки. Деструктор дожидается выполнения всех поставленных задач.
+class SerialExecutor {
+public:
+    SerialExecutor();
+    ~SerialExecutor();
+
+    SerialExecutor(const SerialExecutor&) = delete;
+    SerialExecutor& operator=(const SerialExecutor&) = delete;
+
+    void Post(std::function<void()> task);
+
+    // Ставит задачу в очередь и возвращает future с её результатом. Исключение,
+    // брошенное задачей, передаётся через future.
+    template <typename F>
+    std::future<std::invoke_result_t<F>> Submit(F func) {
+        using Result = std::invoke_result_t<F>;
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::move(func));
+        std::future<Result> result = task->get_future();
+        Post([task] {
+            (*task)();
+        });
+        return result;
+    }
+
+private:
+    void Run();
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> tasks_;
+    bool stopped_ = false;
+    std::thread worker_;
+};
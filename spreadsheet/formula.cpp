@@ -5,6 +5,10 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
 #include <sstream>
 
 using namespace std::literals;
@@ -14,10 +18,29 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
 }
 
 namespace {
+    // Меняет ли правка edit листа sheet хотя бы одну из ссылок формулы, см.
+    // FormulaInterface::Relocate.
+    bool IsRelocated(const StructureEdit& edit, std::string_view sheet, bool local,
+                     const std::vector<Position>& cells, const std::vector<SheetPosition>& sheet_cells,
+                     const std::vector<CellRange>& ranges) {
+        auto moves = [&edit](const auto& ref) {
+            auto moved = edit.Map(ref);
+            return !moved || !(*moved == ref);
+        };
+        if (local && (std::any_of(cells.begin(), cells.end(), moves)
+                      || std::any_of(ranges.begin(), ranges.end(), moves))) {
+            return true;
+        }
+        return std::any_of(sheet_cells.begin(), sheet_cells.end(), [&](const SheetPosition& sheet_pos) {
+            return sheet_pos.sheet == sheet && moves(sheet_pos.pos);
+        });
+    }
+
     class Formula : public FormulaInterface {
     public:
         explicit Formula(std::string expression) try : ast_(ParseFormulaAST(expression)) {
             FillUniqCells();
+            FillText();
         }
         catch (const FormulaException& fe) {
             throw fe;
@@ -28,10 +51,20 @@ namespace {
         catch (...) {
             throw FormulaException("UNKNOWN ERROR");
         }
+
+        explicit Formula(FormulaAST ast)
+            : ast_(std::move(ast)) {
+            FillUniqCells();
+            FillText();
+        }
         
         Value Evaluate(const SheetInterface& sheet) const override {
+            return Evaluate(sheet, nullptr);
+        }
+
+        Value Evaluate(const SheetInterface& sheet, const CellSlot* slots) const override {
             try {
-                return ast_.Execute(sheet);
+                return ast_.Execute(sheet, slots);
             }   
             catch (const FormulaError& fe) {
                 return fe;
@@ -39,17 +72,70 @@ namespace {
         }
         
         std::string GetExpression() const override {
-            std::ostringstream out;
-            ast_.PrintFormula(out);
-            return out.str();
+            return text_.substr(1);
+        }
+
+        std::string_view GetText() const override {
+            return text_;
         }
 
         std::vector<Position> GetReferencedCells() const override {
             return cells_;
         }
+
+        std::vector<SheetPosition> GetReferencedSheetCells() const override {
+            return sheet_cells_;
+        }
+
+        std::vector<CellRange> GetReferencedRanges() const override {
+            return ranges_;
+        }
+
+        size_t GetMemoryUsage() const override {
+            return memory_usage_;
+        }
+
+        void EnsureParsed() const override {
+        }
+
+        std::unique_ptr<FormulaInterface> Shift(int rows, int cols) const override {
+            AllocationScope scope;
+            auto formula = std::make_unique<Formula>(ast_.Shift(rows, cols));
+            formula->SetAstBytes(scope.GetBytes());
+            return formula;
+        }
+
+        std::unique_ptr<FormulaInterface> Relocate(const StructureEdit& edit, std::string_view sheet,
+                                                   bool local) const override {
+            if (!IsRelocated(edit, sheet, local, cells_, sheet_cells_, ranges_)) {
+                return nullptr;
+            }
+            AllocationScope scope;
+            auto formula = std::make_unique<Formula>(ast_.Relocate(edit, sheet, local));
+            formula->SetAstBytes(scope.GetBytes());
+            return formula;
+        }
+
+        // ast_bytes - память узлов дерева и списков ссылок, посчитанная
+        // AllocationScope при разборе.
+        void SetAstBytes(size_t ast_bytes) {
+            memory_usage_ = sizeof(Formula) + ast_bytes + cells_.capacity() * sizeof(Position)
+                            + sheet_cells_.capacity() * sizeof(SheetPosition)
+                            + ranges_.capacity() * sizeof(CellRange) + GetHeapBytes(text_);
+            for (const auto& sheet_pos : sheet_cells_) {
+                memory_usage_ += GetHeapBytes(sheet_pos.sheet);
+            }
+            for (const auto& sheet_pos : ast_.GetSheetCells()) {
+                memory_usage_ += GetHeapBytes(sheet_pos.sheet);
+            }
+        }
     private:
         FormulaAST ast_;
         std::vector<Position> cells_;
+        std::vector<SheetPosition> sheet_cells_;
+        std::vector<CellRange> ranges_;
+        std::string text_;
+        size_t memory_usage_ = 0;
 
         void FillUniqCells() {
             for (auto pos : ast_.GetCells()) {
@@ -57,10 +143,450 @@ namespace {
                     cells_.emplace_back(pos);
                 }
             }
+            for (const auto& sheet_pos : ast_.GetSheetCells()) {
+                if (sheet_cells_.empty() || !(sheet_cells_.back() == sheet_pos)) {
+                    sheet_cells_.emplace_back(sheet_pos);
+                }
+            }
+            for (const auto& range : ast_.GetRanges()) {
+                if (ranges_.empty() || !(ranges_.back() == range)) {
+                    ranges_.emplace_back(range);
+                }
+            }
+        }
+
+        void FillText() {
+            std::ostringstream out;
+            out << FORMULA_SIGN;
+            ast_.PrintFormula(out);
+            text_ = out.str();
+            text_.shrink_to_fit();
+        }
+    };
+
+    class DeferredFormula : public FormulaInterface {
+    public:
+        explicit DeferredFormula(std::string expression)
+            : expression_(std::move(expression))
+            , references_(ScanFormula(expression_)) {
+            memory_usage_ = sizeof(DeferredFormula) + GetHeapBytes(expression_)
+                            + references_.cells.capacity() * sizeof(Position)
+                            + references_.sheet_cells.capacity() * sizeof(SheetPosition)
+                            + references_.ranges.capacity() * sizeof(CellRange);
+            for (const auto& sheet_pos : references_.sheet_cells) {
+                memory_usage_ += GetHeapBytes(sheet_pos.sheet);
+            }
+        }
+
+        Value Evaluate(const SheetInterface& sheet) const override {
+            return GetFormula().Evaluate(sheet);
+        }
+
+        Value Evaluate(const SheetInterface& sheet, const CellSlot* slots) const override {
+            return GetFormula().Evaluate(sheet, slots);
+        }
+
+        std::string GetExpression() const override {
+            return GetFormula().GetExpression();
+        }
+
+        std::string_view GetText() const override {
+            return GetFormula().GetText();
+        }
+
+        std::vector<Position> GetReferencedCells() const override {
+            return references_.cells;
+        }
+
+        std::vector<SheetPosition> GetReferencedSheetCells() const override {
+            return references_.sheet_cells;
         }
+
+        std::vector<CellRange> GetReferencedRanges() const override {
+            return references_.ranges;
+        }
+
+        size_t GetMemoryUsage() const override {
+            return memory_usage_;
+        }
+
+        void EnsureParsed() const override {
+            GetFormula();
+        }
+
+        std::unique_ptr<FormulaInterface> Shift(int rows, int cols) const override {
+            return GetFormula().Shift(rows, cols);
+        }
+
+        std::unique_ptr<FormulaInterface> Relocate(const StructureEdit& edit, std::string_view sheet,
+                                                   bool local) const override {
+            if (!IsRelocated(edit, sheet, local, references_.cells, references_.sheet_cells, references_.ranges)) {
+                return nullptr;
+            }
+            return GetFormula().Relocate(edit, sheet, local);
+        }
+
+    private:
+        const FormulaInterface& GetFormula() const {
+            std::call_once(parsed_, [this] {
+                formula_ = ParseFormula(expression_);
+            });
+            return *formula_;
+        }
+
+        std::string expression_;
+        FormulaReferences references_;
+        size_t memory_usage_ = 0;
+        mutable std::once_flag parsed_;
+        mutable std::unique_ptr<FormulaInterface> formula_;
     };
+
+    // Правила токенов повторяют Formula.g4, включая выбор самого длинного
+    // токена лексером.
+    bool IsDigit(char c) {
+        return '0' <= c && c <= '9';
+    }
+
+    bool IsUpper(char c) {
+        return 'A' <= c && c <= 'Z';
+    }
+
+    bool IsSheetStart(char c) {
+        return IsUpper(c) || ('a' <= c && c <= 'z') || c == '_';
+    }
+
+    size_t MatchDigits(std::string_view str, size_t i) {
+        while (i < str.size() && IsDigit(str[i])) {
+            ++i;
+        }
+        return i;
+    }
+
+    // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+    size_t MatchNumber(std::string_view str, size_t begin) {
+        size_t end = MatchDigits(str, begin);
+        if (end < str.size() && str[end] == '.') {
+            const size_t fraction_end = MatchDigits(str, end + 1);
+            if (fraction_end > end + 1) {
+                end = fraction_end;
+            }
+        }
+        if (end == begin) {
+            return begin;
+        }
+        if (end < str.size() && (str[end] == 'e' || str[end] == 'E')) {
+            size_t exponent = end + 1;
+            if (exponent < str.size() && (str[exponent] == '+' || str[exponent] == '-')) {
+                ++exponent;
+            }
+            const size_t exponent_end = MatchDigits(str, exponent);
+            if (exponent_end > exponent) {
+                end = exponent_end;
+            }
+        }
+        return end;
+    }
+
+    // CELL: [A-Z]+[0-9]+
+    size_t MatchCell(std::string_view str, size_t begin) {
+        size_t end = begin;
+        while (end < str.size() && IsUpper(str[end])) {
+            ++end;
+        }
+        const size_t digits_end = MatchDigits(str, end);
+        return end > begin && digits_end > end ? digits_end : begin;
+    }
+
+    // FUNCTION: [A-Z]+
+    size_t MatchFunction(std::string_view str, size_t begin) {
+        size_t end = begin;
+        while (end < str.size() && IsUpper(str[end])) {
+            ++end;
+        }
+        return end;
+    }
+
+    // REF_ERROR: '#REF!'
+    constexpr std::string_view REF_ERROR = "#REF!";
+
+    size_t SkipSpaces(std::string_view str, size_t i) {
+        while (i < str.size() && std::strchr(" \t\n\r", str[i]) != nullptr) {
+            ++i;
+        }
+        return i;
+    }
+
+    // SHEET: [A-Za-z_][A-Za-z0-9_]* '!'
+    size_t MatchSheet(std::string_view str, size_t begin) {
+        size_t end = begin;
+        while (end < str.size() && (IsSheetStart(str[end]) || IsDigit(str[end]))) {
+            ++end;
+        }
+        return end < str.size() && str[end] == '!' ? end + 1 : begin;
+    }
+
+    template <typename T>
+    void SortUnique(std::vector<T>& values) {
+        std::sort(values.begin(), values.end());
+        values.erase(std::unique(values.begin(), values.end()), values.end());
+    }
 }  // namespace
 
+FormulaReferences ScanFormula(std::string_view expression) {
+    auto fail = [&] {
+        throw FormulaException("Invalid formula: "s + std::string(expression));
+    };
+    auto parse_position = [](std::string_view name) {
+        const Position pos = Position::FromString(name);
+        if (!pos.IsValid()) {
+            throw FormulaException("Invalid position: "s + std::string(name));
+        }
+        return pos;
+    };
+
+    //An open parenthesis; for a function call also its arguments so far
+    struct Frame {
+        const FormulaFunction* function = nullptr;
+        size_t args = 0;
+        bool range_arg = false;     //The current argument is a range
+        bool ref_error_arg = false; //The current argument is a lone #REF!, which may stand for a range
+    };
+    auto check_arg = [&](const Frame& frame) {
+        if (!frame.ref_error_arg && frame.function->IsRangeArg(frame.args) != frame.range_arg) {
+            fail();
+        }
+    };
+
+    FormulaReferences references;
+    bool expect_operand = true;
+    std::vector<Frame> frames;
+    std::string_view sheet;    //Name of a SHEET token waiting for its CELL
+    bool after_sheet = false;
+    const FormulaFunction* function = nullptr;    //FUNCTION token waiting for '('
+    bool arg_start = false;    //The next token starts an argument of a function
+    bool after_range = false;  //A range must be followed by ',' or ')'
+    size_t i = 0;
+    while (true) {
+        i = SkipSpaces(expression, i);
+        if (i == expression.size()) {
+            break;
+        }
+
+        const char c = expression[i];
+        const bool at_arg_start = arg_start;
+        arg_start = false;
+        if ((function != nullptr && c != '(') || (after_range && c != ',' && c != ')')) {
+            fail();
+        }
+        after_range = false;
+        if (IsSheetStart(c)) {
+            const size_t cell_end = IsUpper(c) ? MatchCell(expression, i) : i;
+            const size_t function_end = IsUpper(c) ? MatchFunction(expression, i) : i;
+            const size_t sheet_end = MatchSheet(expression, i);
+            if (!expect_operand || (cell_end == i && function_end == i && sheet_end == i)) {
+                fail();
+            }
+            if (sheet_end > cell_end && sheet_end > function_end) {
+                if (after_sheet) {
+                    fail();
+                }
+                sheet = expression.substr(i, sheet_end - i - 1);
+                after_sheet = true;
+                i = sheet_end;
+                continue;
+            }
+            if (function_end > cell_end) {
+                function = after_sheet ? nullptr : FindFormulaFunction(expression.substr(i, function_end - i));
+                if (function == nullptr) {
+                    fail();
+                }
+                i = function_end;
+                continue;
+            }
+            const Position pos = parse_position(expression.substr(i, cell_end - i));
+            i = cell_end;
+            expect_operand = false;
+            if (after_sheet) {
+                references.sheet_cells.push_back({ std::string(sheet), pos });
+                after_sheet = false;
+                continue;
+            }
+            const size_t colon = SkipSpaces(expression, i);
+            if (colon == expression.size() || expression[colon] != ':') {
+                references.cells.push_back(pos);
+                continue;
+            }
+            //CELL ':' CELL, only as a whole argument of a function
+            const size_t to_begin = SkipSpaces(expression, colon + 1);
+            const size_t to_end = MatchCell(expression, to_begin);
+            if (!at_arg_start || to_end == to_begin) {
+                fail();
+            }
+            const Position to = parse_position(expression.substr(to_begin, to_end - to_begin));
+            references.ranges.push_back({ { std::min(pos.row, to.row), std::min(pos.col, to.col) },
+                                          { std::max(pos.row, to.row), std::max(pos.col, to.col) } });
+            frames.back().range_arg = true;
+            after_range = true;
+            i = to_end;
+            continue;
+        }
+
+        if (after_sheet) {   //SHEET must be followed by CELL
+            fail();
+        }
+        if (expression.substr(i, REF_ERROR.size()) == REF_ERROR) {
+            if (!expect_operand) {
+                fail();
+            }
+            i += REF_ERROR.size();
+            expect_operand = false;
+            const size_t next = SkipSpaces(expression, i);
+            if (at_arg_start && next < expression.size() && (expression[next] == ',' || expression[next] == ')')) {
+                frames.back().ref_error_arg = true;
+            }
+            continue;
+        }
+        if (IsDigit(c) || c == '.') {
+            const size_t end = MatchNumber(expression, i);
+            if (!expect_operand || end == i) {
+                fail();
+            }
+            //Same rejection as the parser: a literal that overflows double is an invalid number
+            if (end - i > 15 || expression.substr(i, end - i).find_first_of("eE") != std::string_view::npos) {
+                if (std::strtod(std::string(expression.substr(i, end - i)).c_str(), nullptr) == HUGE_VAL) {
+                    fail();
+                }
+            }
+            expect_operand = false;
+            i = end;
+            continue;
+        }
+
+        switch (c) {
+        case '(':
+            if (!expect_operand) {
+                fail();
+            }
+            frames.push_back({ function });
+            arg_start = function != nullptr;
+            function = nullptr;
+            break;
+        case ')':
+            if (expect_operand || frames.empty()) {
+                fail();
+            }
+            if (const Frame& frame = frames.back(); frame.function != nullptr) {
+                check_arg(frame);
+                if (frame.args + 1 < frame.function->min_args || frame.args + 1 > frame.function->max_args) {
+                    fail();
+                }
+            }
+            frames.pop_back();
+            break;
+        case ',':
+            if (expect_operand || frames.empty() || frames.back().function == nullptr) {
+                fail();
+            }
+            check_arg(frames.back());
+            ++frames.back().args;
+            frames.back().range_arg = false;
+            frames.back().ref_error_arg = false;
+            expect_operand = true;
+            arg_start = true;
+            break;
+        case '+':
+        case '-':
+            expect_operand = true;  //Unary after an operator, binary after an operand
+            break;
+        case '*':
+        case '/':
+            if (expect_operand) {
+                fail();
+            }
+            expect_operand = true;
+            break;
+        default:
+            fail();
+        }
+        ++i;
+    }
+    if (expect_operand || !frames.empty() || after_sheet || function != nullptr) {
+        fail();
+    }
+
+    SortUnique(references.cells);
+    SortUnique(references.sheet_cells);
+    SortUnique(references.ranges);
+    return references;
+}
+
+std::optional<LookupKey> MakeLookupKey(std::string_view text) {
+    if (text.empty()) {
+        return std::nullopt;
+    }
+    std::istringstream input{ std::string(text) };
+    try {
+        const double number = ParseNumber(input);
+        if (input.peek() == std::char_traits<char>::eof()) {
+            return number;
+        }
+    }
+    catch (const ParsingError&) {
+    }
+    return std::string(text);
+}
+
+std::optional<LookupKey> MakeLookupKey(const CellInterface::Value& value) {
+    if (const double* number = std::get_if<double>(&value)) {
+        if (std::isnan(*number)) {
+            return std::nullopt;
+        }
+        return *number;
+    }
+    if (const std::string* text = std::get_if<std::string>(&value)) {
+        return MakeLookupKey(std::string_view(*text));
+    }
+    return std::nullopt;
+}
+
+LookupSearch::LookupSearch(const LookupKey& key, LookupMode mode)
+    : key_(key)
+    , mode_(mode) {
+}
+
+void LookupSearch::Offer(const LookupKey& value, int index) {
+    if (value.index() != key_.index()) {
+        return;
+    }
+    bool better = false;
+    switch (mode_) {
+    case LookupMode::Exact:
+        better = value == key_ && (index_ < 0 || index < index_);
+        break;
+    case LookupMode::LessOrEqual:
+        better = !(key_ < value) && (!best_ || *best_ < value || (value == *best_ && index > index_));
+        break;
+    case LookupMode::GreaterOrEqual:
+        better = !(value < key_) && (!best_ || value < *best_ || (value == *best_ && index < index_));
+        break;
+    }
+    if (better) {
+        best_ = value;
+        index_ = index;
+    }
+}
+
+int LookupSearch::GetIndex() const {
+    return index_;
+}
+
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-    return std::make_unique<Formula>(std::move(expression));
+    AllocationScope scope;
+    auto formula = std::make_unique<Formula>(std::move(expression));
+    formula->SetAstBytes(scope.GetBytes());
+    return formula;
+}
+
+std::unique_ptr<FormulaInterface> ParseFormulaDeferred(std::string expression) {
+    return std::make_unique<DeferredFormula>(std::move(expression));
 }
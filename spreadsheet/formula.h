@@ -3,12 +3,35 @@
 #include "common.h"
 
 #include <memory>
+#include <tuple>
 #include <vector>
 
+// Ссылка на ячейку другого листа книги, в формуле записывается как Sheet2!A1.
+struct SheetPosition {
+    std::string sheet;
+    Position pos;
+
+    bool operator==(const SheetPosition& rhs) const {
+        return sheet == rhs.sheet && pos == rhs.pos;
+    }
+
+    bool operator<(const SheetPosition& rhs) const {
+        return std::tie(sheet, pos) < std::tie(rhs.sheet, rhs.pos);
+    }
+};
+
+class Cell;
+
+// Место, где лист хранит объект ячейки. Не меняется, пока позиция есть в
+// листе, даже если объект ячейки заменяют новым.
+using CellSlot = const std::unique_ptr<Cell>*;
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Функции поиска MATCH, VLOOKUP и XLOOKUP с диапазонами: VLOOKUP(A1,B1:D100,3,0)
+// * #REF! на месте ссылки, сдвинутой за границы листа: #REF!+1
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -25,17 +48,99 @@ public:
     // возвращается именно эта ошибка. Если таких ошибок несколько, возвращается
     // любая.
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
+    // То же, но ячейки этого листа читаются через slots, а не поиском по
+    // позиции: slots[i] - место ячейки GetReferencedCells()[i] в sheet.
+    virtual Value Evaluate(const SheetInterface& sheet, const CellSlot* slots) const = 0;
 
     // Возвращает выражение, которое описывает формулу.
     // Не содержит пробелов и лишних скобок.
     virtual std::string GetExpression() const = 0;
 
+    // Возвращает текст ячейки с формулой: знак '=' и выражение в том же виде,
+    // что и GetExpression(). Текст строится один раз при разборе.
+    virtual std::string_view GetText() const = 0;
+
     // Возвращает список ячеек, которые непосредственно задействованы в вычислении
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает список ячеек других листов, задействованных в формуле.
+    // Список отсортирован по возрастанию и не содержит повторяющихся ячеек.
+    virtual std::vector<SheetPosition> GetReferencedSheetCells() const = 0;
+
+    // Возвращает список диапазонов, задействованных в формуле. Ячейки
+    // диапазонов в GetReferencedCells() не входят. Список отсортирован по
+    // возрастанию и не содержит повторов.
+    virtual std::vector<CellRange> GetReferencedRanges() const = 0;
+
+    // Возвращает объём памяти в байтах, который занимает разобранная формула:
+    // объект формулы, узлы дерева и списки ссылок.
+    virtual size_t GetMemoryUsage() const = 0;
+
+    // Строит дерево формулы, если её разбор был отложен.
+    virtual void EnsureParsed() const = 0;
+
+    // Возвращает копию формулы, в которой все ссылки сдвинуты на rows строк
+    // и cols столбцов, как при копировании ячейки. Ссылки, вышедшие за
+    // границы листа, становятся #REF!. Текст копии совпадает с результатом
+    // разбора сдвинутого выражения.
+    virtual std::unique_ptr<FormulaInterface> Shift(int rows, int cols) const = 0;
+
+    // Возвращает копию формулы после вставки или удаления строк либо
+    // столбцов edit на листе sheet. Меняются ссылки на sheet по имени, а при
+    // local - и ссылки без имени листа. Ссылки на удалённые ячейки и
+    // диапазоны становятся #REF!. Дерево копируется без повторного разбора.
+    // Возвращает nullptr, если правка не меняет ни одной ссылки формулы.
+    virtual std::unique_ptr<FormulaInterface> Relocate(const StructureEdit& edit, std::string_view sheet,
+                                                       bool local) const = 0;
+};
+
+// Ссылки формулы, найденные ScanFormula. Списки отсортированы по возрастанию
+// и не содержат повторов.
+struct FormulaReferences {
+    std::vector<Position> cells;
+    std::vector<SheetPosition> sheet_cells;
+    std::vector<CellRange> ranges;
+};
+
+// Возвращает ключ поиска для значения ячейки: число для чисел и текста,
+// который читается как число, иначе текст. Для пустого текста и ошибок
+// возвращает std::nullopt - такие ячейки поиск пропускает.
+std::optional<LookupKey> MakeLookupKey(std::string_view text);
+std::optional<LookupKey> MakeLookupKey(const CellInterface::Value& value);
+
+// Выбирает результат поиска key по правилам mode среди предложенных
+// значений. Значения сравниваются только с ключом того же типа: число с
+// числом, текст с текстом.
+class LookupSearch {
+public:
+    LookupSearch(const LookupKey& key, LookupMode mode);
+
+    void Offer(const LookupKey& value, int index);
+
+    // Индекс лучшего из предложенных значений либо -1.
+    int GetIndex() const;
+
+private:
+    const LookupKey& key_;
+    LookupMode mode_;
+    std::optional<LookupKey> best_;
+    int index_ = -1;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Проверяет синтаксис выражения и находит ссылки на ячейки, не строя дерево.
+// Принимает те же выражения, что и ParseFormula, и бросает FormulaException
+// для остальных.
+FormulaReferences ScanFormula(std::string_view expression);
+
+// Как ParseFormula, но дерево строится при первом обращении, которому оно
+// нужно: Evaluate(), GetExpression(), GetText() или EnsureParsed(). Ссылки
+// известны сразу. Обращаться к формуле можно из нескольких потоков.
+// GetMemoryUsage() учитывает только текст и ссылки, чтобы объём памяти
+// формулы не менялся после разбора.
+std::unique_ptr<FormulaInterface> ParseFormulaDeferred(std::string expression);
\ No newline at end of file
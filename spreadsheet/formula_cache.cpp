@@ -0,0 +1,82 @@
+#include "formula_cache.h"
+
+#include <utility>
+
+FormulaCache::FormulaCache(size_t capacity)
+    : capacity_(capacity) {
+}
+
+std::shared_ptr<const FormulaInterface> FormulaCache::Get(const std::string& expression, bool deferred) {
+	{
+		std::lock_guard lock(mutex_);
+		if (auto formula = Find(expression)) {
+			++stats_.hits;
+			return formula;
+		}
+		++stats_.misses;
+	}
+
+	//Parse outside the lock: other sheets' threads may use the cache meanwhile
+	std::shared_ptr<const FormulaInterface> formula = deferred ? ParseFormulaDeferred(expression)
+	                                                           : ParseFormula(expression);
+
+	std::lock_guard lock(mutex_);
+	if (capacity_ == 0) {
+		return formula;
+	}
+	if (!deferred) {
+		const std::string_view canonical = formula->GetText().substr(1);
+		if (auto existing = Find(canonical)) {
+			formula = std::move(existing);
+		}
+		else if (canonical != expression) {
+			Insert(std::string(canonical), formula);
+		}
+	}
+	if (index_.count(expression) == 0) {
+		Insert(expression, formula);
+	}
+	return formula;
+}
+
+void FormulaCache::SetCapacity(size_t capacity) {
+	std::lock_guard lock(mutex_);
+	capacity_ = capacity;
+	Evict();
+}
+
+void FormulaCache::Clear() {
+	std::lock_guard lock(mutex_);
+	index_.clear();
+	entries_.clear();
+}
+
+FormulaCacheStats FormulaCache::GetStats() const {
+	std::lock_guard lock(mutex_);
+	FormulaCacheStats stats = stats_;
+	stats.size = entries_.size();
+	return stats;
+}
+
+std::shared_ptr<const FormulaInterface> FormulaCache::Find(std::string_view key) {
+	auto it = index_.find(key);
+	if (it == index_.end()) {
+		return nullptr;
+	}
+	entries_.splice(entries_.begin(), entries_, it->second);
+	return it->second->formula;
+}
+
+void FormulaCache::Insert(std::string key, std::shared_ptr<const FormulaInterface> formula) {
+	entries_.push_front({ std::move(key), std::move(formula) });
+	index_.emplace(entries_.front().key, entries_.begin());
+	Evict();
+}
+
+void FormulaCache::Evict() {
+	while (entries_.size() > capacity_) {
+		index_.erase(entries_.back().key);
+		entries_.pop_back();
+		++stats_.evictions;
+	}
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "formula.h"
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+struct FormulaCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t size = 0;
+};
+
+// Кеш разобранных формул. Формулы неизменяемы, поэтому ячейки с одинаковым
+// выражением разделяют один объект формулы и его дерево. Ключи - исходный
+// текст выражения и его каноническая запись, так что "A1 + 1" после разбора
+// найдёт уже разобранное "A1+1". Вытесняется давно не использованная
+// запись; ячейки, которые держат вытесненную формулу, продолжают её
+// использовать. Потокобезопасен.
+class FormulaCache {
+public:
+    static const size_t DEFAULT_CAPACITY = 4096;
+
+    explicit FormulaCache(size_t capacity = DEFAULT_CAPACITY);
+
+    // Возвращает формулу для выражения: из кеша или разобранную заново
+    // (ParseFormulaDeferred при deferred, иначе ParseFormula).
+    // Бросает FormulaException для некорректного выражения.
+    std::shared_ptr<const FormulaInterface> Get(const std::string& expression, bool deferred);
+
+    // Ёмкость 0 выключает кеш.
+    void SetCapacity(size_t capacity);
+    void Clear();
+
+    FormulaCacheStats GetStats() const;
+
+private:
+    struct Entry {
+        std::string key;
+        std::shared_ptr<const FormulaInterface> formula;
+    };
+
+    using EntryList = std::list<Entry>;
+
+    std::shared_ptr<const FormulaInterface> Find(std::string_view key);
+    void Insert(std::string key, std::shared_ptr<const FormulaInterface> formula);
+    void Evict();
+
+    mutable std::mutex mutex_;
+    size_t capacity_;
+    EntryList entries_;     //Most recently used first
+    std::unordered_map<std::string_view, EntryList::iterator> index_;  //Keys point into entries_
+    FormulaCacheStats stats_;
+};
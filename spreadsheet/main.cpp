@@ -1,6 +1,18 @@
+#include "async_sheet.h"
+#include "cell.h"
 #include "common.h"
+#include "dependency_graph.h"
 #include "formula.h"
+#include "oplog.h"
+#include "recording_sheet.h"
+#include "sheet.h"
+#include "workbook.h"
 #include "test_runner_p.h"
+#include "trace.h"
+
+#include <atomic>
+#include <set>
+#include <thread>
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -28,6 +40,15 @@ std::string ToString(FormulaError::Category category) {
     return std::string(FormulaError(category).ToString());
 }
 
+//Letters of column col, including the columns past MAX_COLS
+std::string ColumnName(int col) {
+    std::string name;
+    for (; col >= 0; col = col / 26 - 1) {
+        name.insert(name.begin(), static_cast<char>('A' + col % 26));
+    }
+    return name;
+}
+
 void TestPositionAndStringConversion() {
     auto testSingle = [](Position pos, std::string_view str) {
         ASSERT_EQUAL(pos.ToString(), str);
@@ -51,7 +72,8 @@ void TestPositionAndStringConversion() {
     testSingle(Position{0, 701}, "ZZ1");
     testSingle(Position{0, 702}, "AAA1");
     testSingle(Position{136, 2}, "C137");
-    testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
+    testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1},
+               ColumnName(Position::MAX_COLS - 1) + std::to_string(Position::MAX_ROWS));
 }
 
 void TestPositionToStringInvalid() {
@@ -60,6 +82,28 @@ void TestPositionToStringInvalid() {
     ASSERT_EQUAL((Position{1, -3}).ToString(), "");
 }
 
+void TestPositionKey() {
+    ASSERT((Position{ 1, 0 }.GetKey() != Position{ 0, 1 }.GetKey()));
+    ASSERT((Position::NONE.GetKey() != Position{ 0, 0 }.GetKey()));
+    ASSERT((Position::NONE.GetKey() != Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 }.GetKey()));
+
+    //The limits are set at build time, and the longest name fits MAX_STRING_LENGTH
+    const Position last{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 };
+    ASSERT(last.ToString().size() <= Position::MAX_STRING_LENGTH);
+    ASSERT(Position::FromString(last.ToString()) == last);
+    ASSERT(Position::FromString("A" + std::to_string(Position::MAX_ROWS)) == (Position{ Position::MAX_ROWS - 1, 0 }));
+    ASSERT(!Position::FromString("A" + std::to_string(Position::MAX_ROWS + 1)).IsValid());
+
+    //A dense block spreads over the buckets instead of piling up on its diagonals
+    std::set<size_t> buckets;
+    for (int row = 0; row < 64; ++row) {
+        for (int col = 0; col < 64; ++col) {
+            buckets.insert(PositionHasher{}({ row, col }) % 4099);
+        }
+    }
+    ASSERT(buckets.size() > 2000);
+}
+
 void TestStringToPositionInvalid() {
     ASSERT(!Position::FromString("").IsValid());
     ASSERT(!Position::FromString("A").IsValid());
@@ -70,12 +114,40 @@ void TestStringToPositionInvalid() {
     ASSERT(!Position::FromString("A+1").IsValid());
     ASSERT(!Position::FromString("R2D2").IsValid());
     ASSERT(!Position::FromString("C3PO").IsValid());
-    ASSERT(!Position::FromString("XFD16385").IsValid());
-    ASSERT(!Position::FromString("XFE16384").IsValid());
+    ASSERT(!Position::FromString(ColumnName(Position::MAX_COLS - 1) + std::to_string(Position::MAX_ROWS + 1)).IsValid());
+    ASSERT(!Position::FromString(ColumnName(Position::MAX_COLS) + std::to_string(Position::MAX_ROWS)).IsValid());
     ASSERT(!Position::FromString("A1234567890123456789").IsValid());
     ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
 }
 
+void TestPositionBatchConversion() {
+    for (int col = 0; col < Position::MAX_COLS; ++col) {
+        for (int row : {0, 9, 99, 999, Position::MAX_ROWS - 1}) {
+            const Position pos{row, col};
+            char buffer[Position::MAX_STRING_LENGTH];
+            const std::string name(buffer, pos.ToString(buffer));
+            ASSERT_EQUAL(name, pos.ToString());
+            ASSERT_EQUAL(Position::FromString(name), pos);
+        }
+    }
+
+    const Position last{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+    const std::string last_name = ColumnName(last.col) + std::to_string(Position::MAX_ROWS);
+    const Position positions[] = {{0, 0}, {9, 26}, {-1, 0}, last};
+    std::string names = "cells:";
+    AppendPositions(std::begin(positions), std::end(positions), ' ', names);
+    ASSERT_EQUAL(names, "cells:A1 AA10  " + last_name);
+
+    const std::string_view strings[] = {"A1", "AA10", "A0", last_name, "a1"};
+    Position parsed[std::size(strings)];
+    ParsePositions(std::begin(strings), std::end(strings), parsed);
+    ASSERT_EQUAL(parsed[0], (Position{0, 0}));
+    ASSERT_EQUAL(parsed[1], (Position{9, 26}));
+    ASSERT_EQUAL(parsed[2], Position::NONE);
+    ASSERT_EQUAL(parsed[3], last);
+    ASSERT_EQUAL(parsed[4], Position::NONE);
+}
+
 void TestEmpty() {
     auto sheet = CreateSheet();
     ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
@@ -179,6 +251,23 @@ void TestFormulaExpressionFormatting() {
     ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
 }
 
+void TestFormulaCanonicalText() {
+    auto formula = ParseFormula("( A1 + 2 ) * Sheet2!B2");
+    ASSERT_EQUAL(formula->GetText(), "=(A1+2)*Sheet2!B2");
+    ASSERT_EQUAL(formula->GetExpression(), "(A1+2)*Sheet2!B2");
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "= 1 +  ( 2 )");
+    const auto* cell = static_cast<const Cell*>(sheet.GetCell("A1"_pos));
+    ASSERT_EQUAL(cell->GetTextView(), "=1+2");
+    ASSERT_EQUAL(cell->GetText(), "=1+2");
+
+    std::ostringstream texts;
+    sheet.SetCell("B1"_pos, "'=text");
+    sheet.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "=1+2\t'=text\n");
+}
+
 void TestFormulaReferencedCells() {
     ASSERT(ParseFormula("1")->GetReferencedCells().empty());
 
@@ -266,10 +355,10 @@ void TestFormulaInvalidPosition() {
 
     try_formula("=X0");
     try_formula("=ABCD1");
-    try_formula("=A123456");
+    try_formula("=A" + std::to_string(Position::MAX_ROWS * 10));
     try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
-    try_formula("=XFD16385");
-    try_formula("=XFE16384");
+    try_formula("=" + ColumnName(Position::MAX_COLS - 1) + std::to_string(Position::MAX_ROWS + 1));
+    try_formula("=" + ColumnName(Position::MAX_COLS) + std::to_string(Position::MAX_ROWS));
     try_formula("=R2D2");
 }
 
@@ -623,10 +712,1311 @@ void TestClearPrint() {
         sheet->PrintValues(std::cout);
         std::cout << "==========================================================" << std::endl;
     }
+
+    //Empty cells created for references leave the print area with the formulas that reference them
+    sheet->SetCell("A1"_pos, "=B1");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 1, 2 }));
+    sheet->ClearCell("A1"_pos);
+    sheet->ClearCell("B1"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 0, 0 }));
+    std::ostringstream texts;
+    sheet->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "");
+
+    sheet->SetCell("A1"_pos, "=B1");
+    sheet->SetCell("A1"_pos, "=C1");
+    sheet->SetCell("A1"_pos, "1");
+    sheet->ClearCell("B1"_pos);
+    sheet->ClearCell("C1"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 1, 1 }));
+
+    //A cleared cell is erased even while a formula references it
+    sheet->SetCell("A2"_pos, "=C2");
+    sheet->SetCell("C2"_pos, "5");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 2, 3 }));
+    sheet->ClearCell("C2"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 2, 1 }));
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value(0.0));
+    sheet->SetCell("C2"_pos, "6");
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value(6.0));
+}
+
+void TestDependentsAfterRewrite() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=B1");
+    sheet->SetCell("B1"_pos, "1");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(1));
+    sheet->SetCell("B1"_pos, "2");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(2));
+    sheet->ClearCell("B1"_pos);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0));
+    sheet->SetCell("B1"_pos, "3");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(3));
+
+    //A rewritten formula no longer depends on the cells it referenced before
+    Sheet rewritten;
+    rewritten.SetCell("A1"_pos, "=B1");
+    rewritten.SetCell("A1"_pos, "=C1");
+    ASSERT_EQUAL(rewritten.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+    rewritten.ResetStats();
+    rewritten.SetCell("B1"_pos, "1");
+    ASSERT_EQUAL(rewritten.GetStats().cells_invalidated, 0u);
+    rewritten.SetCell("C1"_pos, "2");
+    ASSERT_EQUAL(rewritten.GetStats().cells_invalidated, 1u);
+    ASSERT_EQUAL(rewritten.GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    //A formula rejected by the cycle check adds neither edges nor cells
+    rewritten.SetCell("A3"_pos, "=B2");
+    bool caught = false;
+    try {
+        rewritten.SetCell("B2"_pos, "=A2+A3");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT(rewritten.GetCell("A2"_pos) == nullptr);
+}
+
+void TestSnapshot() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("A2"_pos, "'=text");
+
+    auto snapshot = sheet.Snapshot();
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCell("C3"_pos, "new");
+    sheet.ClearCell("A2"_pos);
+
+    ASSERT_EQUAL(snapshot->GetPrintableSize(), (Size{ 2, 2 }));
+    ASSERT_EQUAL(snapshot->GetCell("B1"_pos)->GetValue(), CellInterface::Value(2));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10));
+    {
+        std::ostringstream oss;
+        snapshot->PrintTexts(oss);
+        ASSERT_EQUAL(oss.str(), "1\t=A1*2\n'=text\t\n");
+    }
+    {
+        std::ostringstream oss;
+        snapshot->PrintValues(oss);
+        ASSERT_EQUAL(oss.str(), "1\t2\n=text\t\n");
+    }
+
+    auto latest = sheet.Snapshot();
+    ASSERT(latest->GetEpoch() > snapshot->GetEpoch());
+    ASSERT_EQUAL(latest->GetCell("B1"_pos)->GetValue(), CellInterface::Value(10));
+    ASSERT(latest->GetCell("A2"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.Snapshot()->GetEpoch(), latest->GetEpoch());
+}
+
+void TestSnapshotConcurrentWrites() {
+    Sheet sheet;
+    for (int i = 0; i < 100; ++i) {
+        sheet.SetCell(Position{ i, 0 }, std::to_string(i));
+        sheet.SetCell(Position{ i, 1 }, "=A" + std::to_string(i + 1) + "*2");
+    }
+    auto snapshot = sheet.Snapshot();
+
+    std::thread writer([&sheet] {
+        for (int i = 0; i < 100; ++i) {
+            sheet.SetCell(Position{ i, 0 }, std::to_string(-i));
+        }
+    });
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_EQUAL(snapshot->GetCell(Position{ i, 1 })->GetValue(), CellInterface::Value(2.0 * i));
+    }
+    writer.join();
+    ASSERT_EQUAL(sheet.Snapshot()->GetCell(Position{ 99, 1 })->GetValue(), CellInterface::Value(-198.0));
+}
+
+void TestSnapshotConsistency() {
+    //Every round rewrites the cells in the same order across different tiles, so the values
+    //a snapshot holds must not increase along that order
+    const int count = 1000;
+    const int rounds = 50;
+    auto write_pos = [](int i) {
+        return Position{ i * 97 % count, i % 8 * Tile::SIZE };
+    };
+    Sheet sheet;
+    std::atomic<bool> done = false;
+    std::thread writer([&] {
+        for (int round = 0; round < rounds; ++round) {
+            for (int i = 0; i < count; ++i) {
+                sheet.SetCell(write_pos(i), std::to_string(round));
+            }
+        }
+        done = true;
+    });
+    int inconsistent = 0;
+    while (!done) {
+        auto snapshot = sheet.Snapshot();
+        int previous = rounds;
+        Size size;
+        for (int i = 0; i < count; ++i) {
+            const Position pos = write_pos(i);
+            const CellInterface* cell = snapshot->GetCell(pos);
+            const int value = cell != nullptr ? std::stoi(cell->GetText()) : -1;
+            if (value > previous) {
+                ++inconsistent;
+            }
+            previous = value;
+            if (cell != nullptr) {
+                size = { std::max(size.rows, pos.row + 1), std::max(size.cols, pos.col + 1) };
+            }
+        }
+        if (!(snapshot->GetPrintableSize() == size)) {
+            ++inconsistent;
+        }
+    }
+    writer.join();
+    ASSERT_EQUAL(inconsistent, 0);
+}
+
+void TestConcurrentWrites() {
+    Sheet sheet;
+    sheet.SetConcurrentWrites(true);
+
+    const int threads_count = 16;
+    const int rows = 200;
+    std::vector<std::thread> writers;
+    for (int t = 0; t < threads_count; ++t) {
+        writers.emplace_back([&sheet, t] {
+            const int col = t * Sheet::REGION_SIZE;
+            for (int i = 0; i < rows; ++i) {
+                sheet.SetCell(Position{ i, col }, std::to_string(i));
+            }
+            const std::string last = Position{ rows - 1, col }.ToString();
+            sheet.SetCell(Position{ rows, col }, "=" + last + "*2");
+        });
+    }
+    for (auto& writer : writers) {
+        writer.join();
+    }
+    sheet.SetConcurrentWrites(false);
+
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ rows + 1, (threads_count - 1) * Sheet::REGION_SIZE + 1 }));
+    for (int t = 0; t < threads_count; ++t) {
+        const int col = t * Sheet::REGION_SIZE;
+        ASSERT_EQUAL(sheet.GetCell(Position{ 7, col })->GetText(), "7");
+        ASSERT_EQUAL(sheet.GetCell(Position{ rows, col })->GetValue(), CellInterface::Value(2.0 * (rows - 1)));
+    }
+}
+
+void TestConcurrentCircularReferences() {
+    for (int attempt = 0; attempt < 20; ++attempt) {
+        Sheet sheet;
+        sheet.SetConcurrentWrites(true);
+        std::atomic<int> failures = 0;
+        auto write = [&](Position pos, std::string text) {
+            try {
+                sheet.SetCell(pos, std::move(text));
+            } catch (const CircularDependencyException&) {
+                ++failures;
+            }
+        };
+        std::thread first(write, "A1"_pos, "=ZZ500");
+        std::thread second(write, "ZZ500"_pos, "=A1");
+        first.join();
+        second.join();
+        ASSERT_EQUAL(failures.load(), 1);
+    }
+}
+
+void TestAsyncSheet() {
+    AsyncSheet sheet;
+    auto first = sheet.SetCell("A1"_pos, "2");
+    auto batch = sheet.SetCells({ { "A2"_pos, "=A1*10" }, { "A3"_pos, "=A2+1" } });
+    auto recalc = sheet.Recalculate();
+    auto value = sheet.GetValue("A3"_pos);
+
+    first.get();
+    batch.get();
+    recalc.get();
+    ASSERT_EQUAL(value.get(), CellInterface::Value(21.0));
+
+    bool caught = false;
+    try {
+        sheet.SetCell("A1"_pos, "=A3").get();
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    caught = false;
+    try {
+        sheet.SetCells({ { "B1"_pos, "ok" }, { "B2"_pos, "=1+" }, { "B3"_pos, "skipped" } }).get();
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet.GetValue("B1"_pos).get(), CellInterface::Value(std::string("ok")));
+    ASSERT_EQUAL(sheet.GetValue("B3"_pos).get(), CellInterface::Value(std::string()));
+
+    sheet.ClearCell("A1"_pos).get();
+    ASSERT_EQUAL(sheet.Snapshot()->GetCell("A3"_pos)->GetValue(), CellInterface::Value(1.0));
 }
 
 }  // namespace
 
+void TestWorkbook() {
+    Workbook book;
+    Sheet& first = book.AddSheet("Sheet1");
+    Sheet& second = book.AddSheet("Sheet2");
+
+    second.SetCell("B2"_pos, "3");
+    first.SetCell("A1"_pos, "=Sheet2!B2*2");
+    ASSERT_EQUAL(first.GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(first.GetCell("A1"_pos)->GetText(), "=Sheet2!B2*2");
+
+    second.SetCell("B2"_pos, "5");
+    ASSERT_EQUAL(first.GetCell("A1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+    first.SetCell("A2"_pos, "=Sheet2!C3+1");
+    ASSERT_EQUAL(first.GetCell("A2"_pos)->GetValue(), CellInterface::Value(1.0));
+    second.SetCell("C3"_pos, "4");
+    ASSERT_EQUAL(first.GetCell("A2"_pos)->GetValue(), CellInterface::Value(5.0));
+
+    bool caught = false;
+    try {
+        second.SetCell("B2"_pos, "=Sheet1!A1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(second.GetCell("B2"_pos)->GetText(), "5");
+
+    caught = false;
+    try {
+        first.SetCell("A3"_pos, "=Sheet3!A1");
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    caught = false;
+    try {
+        book.AddSheet("Sheet1");
+    } catch (const std::invalid_argument&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    caught = false;
+    try {
+        auto standalone = CreateSheet();
+        standalone->SetCell("A1"_pos, "=Sheet2!A1");
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    Sheet& third = book.AddSheet("Sheet3");
+    third.SetCell("A1"_pos, "7");
+    third.SetCell("A2"_pos, "=A1*A1");
+    book.Recalculate();
+    ASSERT_EQUAL(third.GetCell("A2"_pos)->GetValue(), CellInterface::Value(49.0));
+    ASSERT_EQUAL(first.GetCell("A1"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(book.GetSheetNames(), (std::vector<std::string>{ "Sheet1", "Sheet2", "Sheet3" }));
+
+    //Filled formulas shift references to other sheets and check cycles across them
+    first.FillRange("A2"_pos, { "A2"_pos, "B3"_pos });
+    ASSERT_EQUAL(first.GetCell("B3"_pos)->GetText(), "=Sheet2!D4+1");
+    second.SetCell("D4"_pos, "2");
+    ASSERT_EQUAL(first.GetCell("B3"_pos)->GetValue(), CellInterface::Value(3.0));
+    second.SetCell("C5"_pos, "=Sheet1!B4");
+    caught = false;
+    try {
+        first.FillRange("A1"_pos, { "A4"_pos, "B4"_pos });
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(first.GetCell("B4"_pos)->GetText(), "");
+
+    //Inserting and deleting rows rewrites the references of other sheets
+    second.InsertRows(0);
+    ASSERT_EQUAL(first.GetCell("A1"_pos)->GetText(), "=Sheet2!B3*2");
+    ASSERT_EQUAL(first.GetCell("B3"_pos)->GetText(), "=Sheet2!D5+1");
+    second.SetCell("B3"_pos, "6");
+    ASSERT_EQUAL(first.GetCell("A1"_pos)->GetValue(), CellInterface::Value(12.0));
+    first.InsertRows(3);
+    ASSERT_EQUAL(second.GetCell("C6"_pos)->GetText(), "=Sheet1!B5");
+    second.DeleteRows(2);
+    ASSERT_EQUAL(first.GetCell("A1"_pos)->GetText(), "=#REF!*2");
+    ASSERT_EQUAL(first.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(first.GetCell("A2"_pos)->GetText(), "=Sheet2!C3+1");
+    ASSERT_EQUAL(first.GetCell("A2"_pos)->GetValue(), CellInterface::Value(5.0));
+    second.SetCell("C3"_pos, "8");
+    ASSERT_EQUAL(first.GetCell("A2"_pos)->GetValue(), CellInterface::Value(9.0));
+}
+
+void TestStats() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2*2");
+
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(4.0));
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(4.0));
+
+    SheetStats stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.writes, 3u);
+    ASSERT_EQUAL(stats.formulas_parsed, 2u);
+    ASSERT_EQUAL(stats.evaluations, 2u);
+    ASSERT_EQUAL(stats.cache_misses, 3u);
+    ASSERT_EQUAL(stats.cache_hits, 1u);
+    ASSERT(stats.cycle_check_nodes >= 2u);
+    ASSERT_EQUAL(stats.set_cell.count, 3u);
+    ASSERT_EQUAL(stats.get_value.count, 2u);
+    ASSERT(stats.set_cell.p50_ns <= stats.set_cell.p99_ns);
+
+    sheet.SetCell("A1"_pos, "5");
+    stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.cells_invalidated, 2u);
+
+    sheet.ResetStats();
+    stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.writes, 0u);
+    ASSERT_EQUAL(stats.set_cell.count, 0u);
+
+    std::thread writer([&sheet] {
+        sheet.SetCell("B1"_pos, "=A3+1");
+        sheet.GetCell("B1"_pos)->GetValue();
+    });
+    writer.join();
+    stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.writes, 1u);
+    ASSERT_EQUAL(stats.evaluations, 3u);
+
+    //Percentiles are upper bounds of the latencies
+    {
+        StatsRegistry registry;
+        for (int i = 0; i < 10; ++i) {
+            registry.Local().set_cell.Record(std::chrono::nanoseconds(1000));
+        }
+        const LatencyStats latency = registry.GetStats().set_cell;
+        ASSERT(latency.p50_ns >= 1000u && latency.p50_ns < 2000u);
+        ASSERT_EQUAL(latency.p99_ns, latency.p50_ns);
+    }
+
+    //A registry that takes the slot of a destroyed one starts from its own counters
+    for (int i = 0; i < 100; ++i) {
+        StatsRegistry registry;
+        ASSERT_EQUAL(registry.GetStats().writes, 0u);
+        registry.Local().writes.Add();
+        ASSERT_EQUAL(registry.GetStats().writes, 1u);
+    }
+}
+
+void TestTrace() {
+    Tracer::Clear();
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.GetCell("A2"_pos)->GetValue();
+    sheet.SetCell("A1"_pos, "2");
+
+    std::ostringstream output;
+    Tracer::WriteChromeTrace(output);
+    const std::string trace = output.str();
+    ASSERT(trace.find("\"traceEvents\"") != std::string::npos);
+    if constexpr (TRACING_ENABLED) {
+        ASSERT(trace.find("\"name\":\"ParseFormula\"") != std::string::npos);
+        ASSERT(trace.find("\"name\":\"Evaluate\"") != std::string::npos);
+        ASSERT(trace.find("\"cell\":\"A2\"") != std::string::npos);
+        ASSERT(trace.find("\"name\":\"InvalidateDepended\"") != std::string::npos);
+    }
+    else {
+        ASSERT(trace.find("\"ph\"") == std::string::npos);
+    }
+
+    //Threads that run one after another share one buffer
+    std::set<const TraceBuffer*> thread_buffers;
+    for (int i = 0; i < 20; ++i) {
+        std::thread([&thread_buffers] { thread_buffers.insert(&Tracer::LocalBuffer()); }).join();
+    }
+    ASSERT_EQUAL(thread_buffers.size(), 1u);
+}
+
+void TestRecordingSheet() {
+    auto sheet = CreateSheet();
+    std::stringstream log;
+    {
+        RecordingSheet recording(*sheet, log, { true });
+        recording.SetCell("A1"_pos, "secret");
+        recording.SetCell("A2"_pos, "=A3+1");
+        recording.SetCell("A3"_pos, "41");
+        ASSERT_EQUAL(recording.GetCell("A2"_pos)->GetValue(), CellInterface::Value(42.0));
+        ASSERT(recording.GetCell("B1"_pos) == nullptr);
+        recording.ClearCell("A1"_pos);
+        std::ostringstream output;
+        recording.PrintValues(output);
+        ASSERT_EQUAL(output.str(), "\n42\n41\n");
+    }
+
+    OpLogReader reader(log);
+    std::vector<Op> ops;
+    for (Op op; reader.Next(op);) {
+        ops.push_back(op);
+    }
+    ASSERT_EQUAL(ops.size(), 6u);
+    ASSERT(ops[0].type == OpType::SetCell);
+    ASSERT_EQUAL(ops[0].text, "xxxxxx");
+    ASSERT_EQUAL(ops[1].text, "=A3+1");
+    ASSERT_EQUAL(ops[2].pos, "A3"_pos);
+    ASSERT(ops[3].type == OpType::GetValue);
+    ASSERT_EQUAL(ops[3].pos, "A2"_pos);
+    ASSERT(ops[4].type == OpType::ClearCell);
+    ASSERT(ops[5].type == OpType::PrintValues);
+
+    bool caught = false;
+    try {
+        std::istringstream garbage("not a log");
+        OpLogReader bad_reader(garbage);
+    } catch (const std::runtime_error&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    //Clearing a cell drops its proxy, a later read gets a new one
+    std::stringstream reuse_log;
+    RecordingSheet reuse(*sheet, reuse_log);
+    for (int i = 0; i < 3; ++i) {
+        reuse.SetCell("C1"_pos, "=" + std::to_string(i));
+        ASSERT_EQUAL(reuse.GetCell("C1"_pos)->GetValue(), CellInterface::Value(static_cast<double>(i)));
+        reuse.ClearCell("C1"_pos);
+    }
+}
+
+void TestProfiler() {
+    Sheet sheet;
+    sheet.SetProfiling(true);
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2*2");
+    sheet.SetCell("C1"_pos, "5");
+    sheet.SetCell("B1"_pos, "=A3+C1");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(9.0));
+
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(11.0));
+
+    const auto profile = sheet.GetProfile();
+    ASSERT_EQUAL(profile.size(), 3u);
+    for (const CellProfile& cell : profile) {
+        ASSERT_EQUAL(cell.evaluations, 2u);
+        ASSERT_EQUAL(cell.invalidations, 1u);
+        ASSERT(cell.self_ns <= cell.inclusive_ns);
+    }
+    ASSERT_EQUAL(profile[0].pos, "B1"_pos);
+    ASSERT(profile[0].inclusive_ns >= profile[2].inclusive_ns);
+
+    const auto top = sheet.GetTopCells(1, ProfileOrder::InclusiveTime);
+    ASSERT_EQUAL(top.size(), 1u);
+    ASSERT_EQUAL(top[0].pos, "B1"_pos);
+
+    const CriticalPath path = sheet.GetCriticalPath("B1"_pos);
+    ASSERT_EQUAL(path.cells, (std::vector<Position>{ "B1"_pos, "A3"_pos, "A2"_pos }));
+
+    sheet.ResetProfile();
+    sheet.SetProfiling(false);
+    sheet.SetCell("A1"_pos, "3");
+    sheet.GetCell("B1"_pos)->GetValue();
+    ASSERT(sheet.GetProfile().empty());
+    ASSERT(sheet.GetCriticalPath("B1"_pos).cells.empty());
+
+    //A chain far deeper than the stack would allow a recursive search
+    Sheet chain;
+    chain.SetProfiling(true);
+    const int length = 100000;
+    auto chain_pos = [](int i) { return Position{ i % Position::MAX_ROWS, i / Position::MAX_ROWS }; };
+    //Each formula refers to a cell that is still empty and is evaluated after it, so neither step recurses
+    for (int i = 0; i + 1 < length; ++i) {
+        chain.SetCell(chain_pos(i), "=" + chain_pos(i + 1).ToString() + "+1");
+    }
+    chain.SetCell(chain_pos(length - 1), "1");
+    for (int i = length - 2; i >= 0; --i) {
+        chain.GetCell(chain_pos(i))->GetValue();
+    }
+    const CriticalPath chain_path = chain.GetCriticalPath(chain_pos(0));
+    ASSERT_EQUAL(chain_path.cells.size(), static_cast<size_t>(length - 1));
+    ASSERT_EQUAL(chain_path.cells.back(), chain_pos(length - 2));
+}
+
+void TestDependencyGraph() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2+A1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("B2"_pos, "=C5");
+    sheet.SetCell("D1"_pos, "text");
+
+    DependencyGraph graph(sheet);
+    const DependencyGraphStats stats = graph.Analyze();
+    ASSERT_EQUAL(stats.nodes, 7u);
+    ASSERT_EQUAL(stats.edges, 5u);
+    ASSERT_EQUAL(stats.fan_in_histogram, (std::map<size_t, size_t>{ { 0, 3 }, { 1, 3 }, { 2, 1 } }));
+    ASSERT_EQUAL(stats.fan_out_histogram, (std::map<size_t, size_t>{ { 0, 4 }, { 1, 2 }, { 3, 1 } }));
+    ASSERT_EQUAL(stats.max_depth, 2u);
+    ASSERT_EQUAL(stats.level_widths, (std::vector<size_t>{ 3, 3, 1 }));
+    ASSERT_EQUAL(stats.largest_cone_root, "A1"_pos);
+    ASSERT_EQUAL(stats.largest_cone_size, 3u);
+    ASSERT_EQUAL(graph.GetConeSize("A2"_pos), 1u);
+
+    std::ostringstream dot;
+    graph.WriteDot(dot);
+    ASSERT(dot.str().find("\"A1\" -> \"A3\";") != std::string::npos);
+
+    std::ostringstream json;
+    graph.WriteJson(json);
+    ASSERT(json.str().find("\"largest_cone\": {\"cell\": \"A1\", \"size\": 3}") != std::string::npos);
+
+    //Cones too large to be compared exactly
+    Sheet wide;
+    wide.SetCell("A1"_pos, "=Z1+1");
+    for (int row = 1; row < 200; ++row) {
+        wide.SetCell({ row, 0 }, "=" + Position{ row - 1, 0 }.ToString() + "+1");
+    }
+    for (int row = 0; row < 50; ++row) {
+        wide.SetCell({ row, 1 }, "=Y1");
+    }
+    const DependencyGraphStats wide_stats = DependencyGraph(wide).Analyze();
+    ASSERT_EQUAL(wide_stats.largest_cone_root, "Z1"_pos);
+    ASSERT_EQUAL(wide_stats.largest_cone_size, 200u);
+}
+
+void TestMemoryUsage() {
+    Sheet sheet;
+    ASSERT_EQUAL(sheet.MemoryUsage().Total(), 0u);
+
+    const std::string long_text(40, 'x');
+    sheet.SetCell("A1"_pos, long_text);
+    sheet.SetCell("B1"_pos, "=C1+1");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(long_text));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.0));
+
+    const SheetMemoryUsage usage = sheet.MemoryUsage();
+    ASSERT(usage.cell_storage >= 3 * sizeof(Cell));
+    ASSERT(usage.text >= long_text.size());
+    ASSERT(usage.formula_asts > 0u);
+    ASSERT(usage.dependency_graph > 0u);
+    ASSERT_EQUAL(usage.Total(), usage.cell_storage + usage.formula_asts + usage.text
+                                + usage.dependency_graph + usage.lookup_indexes);
+
+    sheet.ClearCell("A1"_pos);
+    const SheetMemoryUsage cleared = sheet.MemoryUsage();
+    ASSERT(cleared.text < usage.text);
+    ASSERT(cleared.cell_storage < usage.cell_storage);
+    ASSERT_EQUAL(cleared.formula_asts, usage.formula_asts);
+
+    sheet.SetCell("B1"_pos, "text");
+    ASSERT_EQUAL(sheet.MemoryUsage().formula_asts, 0u);
+
+    //A tree shared by several cells is counted while any of them holds it
+    sheet.SetCell("D1"_pos, "=E1*2");
+    const size_t tree = sheet.MemoryUsage().formula_asts;
+    sheet.SetCell("D2"_pos, "=E1*2");
+    ASSERT_EQUAL(sheet.MemoryUsage().formula_asts, tree);
+    sheet.SetCell("D1"_pos, "text");
+    ASSERT_EQUAL(sheet.MemoryUsage().formula_asts, tree);
+    sheet.FillRange("D2"_pos, { "D2"_pos, "D4"_pos });
+    ASSERT(sheet.MemoryUsage().formula_asts > tree);
+    sheet.ClearCell("D3"_pos);
+    sheet.ClearCell("D4"_pos);
+    ASSERT_EQUAL(sheet.MemoryUsage().formula_asts, tree);
+    sheet.ClearCell("D2"_pos);
+    ASSERT_EQUAL(sheet.MemoryUsage().formula_asts, 0u);
+}
+
+void TestCompactCells() {
+    ASSERT(sizeof(Cell) <= 40u);
+
+    Sheet sheet;
+    const std::string inline_text(TextImpl::MAX_INLINE_SIZE, 'a');
+    const std::string pooled_text(TextImpl::MAX_INLINE_SIZE + 1, 'b');
+    sheet.SetCell("A1"_pos, inline_text);
+    ASSERT_EQUAL(sheet.MemoryUsage().text, 0u);
+    sheet.SetCell("A2"_pos, pooled_text);
+    ASSERT(sheet.MemoryUsage().text > 0u);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), inline_text);
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(pooled_text));
+    sheet.SetCell("A3"_pos, "'=1");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value("=1"));
+
+    //Numbers take no memory outside the cell map, and cells without dependents none in the graph
+    Sheet numbers;
+    const int count = 1000;
+    for (int row = 0; row < count; ++row) {
+        numbers.SetCell({ row, 0 }, std::to_string(row * 1.5));
+    }
+    const SheetMemoryUsage usage = numbers.MemoryUsage();
+    ASSERT(usage.cell_storage / count < 100u);
+    ASSERT_EQUAL(usage.text, 0u);
+    ASSERT_EQUAL(usage.dependency_graph, 0u);
+
+    //Dependents are kept by position, so they outlive the cells written over them
+    numbers.SetCell("B1"_pos, "=A2*2");
+    ASSERT(numbers.MemoryUsage().dependency_graph > 0u);
+    ASSERT_EQUAL(numbers.GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+    numbers.SetCell("A2"_pos, "5");
+    ASSERT_EQUAL(numbers.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+    numbers.ClearCell("A2"_pos);
+    ASSERT_EQUAL(numbers.GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+    numbers.InsertRows(0);
+    numbers.SetCell("A3"_pos, "4");
+    ASSERT_EQUAL(numbers.GetCell("B2"_pos)->GetText(), "=A3*2");
+    ASSERT_EQUAL(numbers.GetCell("B2"_pos)->GetValue(), CellInterface::Value(8.0));
+}
+
+void TestStringPool() {
+    MemoryTracker tracker;
+    {
+        StringPool pool(tracker);
+        const std::string long_text(10000, 'z');
+        const StringPool::Id pending = pool.Intern("status: pending");
+        ASSERT_EQUAL(pool.Intern("status: pending"), pending);
+        const StringPool::Id long_id = pool.Intern(long_text);
+        const StringPool::Id empty = pool.Intern("");
+        ASSERT(pending != long_id);
+        ASSERT_EQUAL(pool.GetSize(), 3u);
+        ASSERT_EQUAL(pool.View(pending), "status: pending");
+        ASSERT_EQUAL(pool.View(long_id), long_text);
+        ASSERT_EQUAL(pool.View(empty), "");
+        ASSERT((pool.Find("status: pending") == std::optional(pending)));
+        ASSERT(!pool.Find("status: done").has_value());
+
+        //The text stays while any reference is left
+        pool.Release(pending);
+        ASSERT_EQUAL(pool.View(pending), "status: pending");
+        pool.Release(pending);
+        ASSERT(!pool.Find("status: pending").has_value());
+        ASSERT_EQUAL(pool.GetSize(), 2u);
+
+        std::vector<StringPool::Id> ids;
+        const int count = 10000;
+        for (int i = 0; i < count; ++i) {
+            ids.push_back(pool.Intern("category number " + std::to_string(i)));
+        }
+        for (int i = 0; i < count; i += 2) {
+            pool.Release(ids[i]);
+        }
+        ASSERT_EQUAL(pool.GetSize(), 2u + count / 2);
+        for (int i = 1; i < count; i += 2) {
+            ASSERT((pool.Find("category number " + std::to_string(i)) == std::optional(ids[i])));
+            ASSERT_EQUAL(pool.View(ids[i]), "category number " + std::to_string(i));
+        }
+        for (int i = 1; i < count; i += 2) {
+            pool.Release(ids[i]);
+        }
+        pool.Release(long_id);
+        pool.Release(empty);
+        ASSERT_EQUAL(pool.GetSize(), 0u);
+    }
+    ASSERT_EQUAL(tracker.GetUsage().Total(), 0u);
+
+    //Threads interning and releasing the same texts see them intact
+    {
+        StringPool pool(tracker);
+        std::atomic<int> failures = 0;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&pool, &failures] {
+                for (int i = 0; i < 2000; ++i) {
+                    const std::string text = "shared category " + std::to_string(i % 100);
+                    const StringPool::Id id = pool.Intern(text);
+                    if (pool.View(id) != text) {
+                        ++failures;
+                    }
+                    pool.Release(id);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        ASSERT_EQUAL(failures.load(), 0);
+        ASSERT_EQUAL(pool.GetSize(), 0u);
+    }
+
+    //Equal long texts of a sheet share one copy and compare by their keys
+    Sheet sheet;
+    const std::string status = "awaiting confirmation";
+    for (int row = 0; row < 1000; ++row) {
+        sheet.SetCell({ row, 0 }, row % 2 == 0 ? status : "'" + status);
+    }
+    ASSERT_EQUAL(sheet.GetStringPool().GetSize(), 2u);
+    const size_t shared_text = sheet.MemoryUsage().text;
+    ASSERT(shared_text < 1000 * status.size());
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(status));
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(status));
+    const auto key = [&sheet](Position pos) {
+        return static_cast<const Cell*>(sheet.GetCell(pos))->GetTextKey();
+    };
+    ASSERT((key("A1"_pos) == key("A3"_pos)));
+    ASSERT((key("A1"_pos) != key("A2"_pos)));
+    sheet.SetCell("B1"_pos, "OK");
+    sheet.SetCell("B2"_pos, "OK");
+    sheet.SetCell("B3"_pos, "=1");
+    ASSERT((key("B1"_pos) == key("B2"_pos)));
+    ASSERT((key("B1"_pos) != key("A1"_pos)));
+    ASSERT(!key("B3"_pos).has_value());
+
+    for (int row = 0; row < 1000; ++row) {
+        sheet.ClearCell({ row, 0 });
+    }
+    ASSERT_EQUAL(sheet.GetStringPool().GetSize(), 0u);
+    ASSERT(sheet.MemoryUsage().text < shared_text);
+}
+
+void TestScanFormula() {
+    const std::string expressions[] = {
+        "1", " -1 ", "+-(2)", "1.5e-3*.5", "A1+B2*(C3-A1)", "Sheet2!B2/ (A1)", "((1))+2E+5",
+        "", "1+", "*1", "(1", "1)", "()", "1 2", "A1 B2", "A0", "a1", "Sheet2!", "Sheet2!1", "1.", "1e", "XFD16385",
+        "1e999", "A1!B2!C3", "MATCH(A1,B1:B10,0)", "VLOOKUP( 2 , A2:C9 , 3 )+1", "XLOOKUP(A1,B1:B3,C3:C1,1)",
+        "MATCH(A1,B1:B10)", "MATCH(B1:B2,B1:B2)", "MATCH(A1,B1:B10,0,0)", "SUM(A1)", "MATCH(A1,B1)", "A1:B2",
+        "MATCH(A1,B1:)", "MATCH (1,A1:A2)", "MATCH(,A1:A2)",
+    };
+    for (const auto& expression : expressions) {
+        std::unique_ptr<FormulaInterface> formula;
+        try {
+            formula = ParseFormula(expression);
+        } catch (const FormulaException&) {
+        }
+        try {
+            const FormulaReferences references = ScanFormula(expression);
+            ASSERT(formula != nullptr);
+            ASSERT_EQUAL(references.cells, formula->GetReferencedCells());
+            ASSERT(references.sheet_cells == formula->GetReferencedSheetCells());
+            ASSERT(references.ranges == formula->GetReferencedRanges());
+        } catch (const FormulaException&) {
+            ASSERT(formula == nullptr);
+        }
+    }
+}
+
+void TestDeferredParsing() {
+    Sheet sheet;
+    sheet.SetDeferredParsing(true);
+    sheet.SetCell("A1"_pos, "=B1 + 1");
+    sheet.SetCell("A2"_pos, "=A1*(2)");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetReferencedCells(), (std::vector{"B1"_pos}));
+
+    bool caught = false;
+    try {
+        sheet.SetCell("B1"_pos, "=A2");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    caught = false;
+    try {
+        sheet.SetCell("B1"_pos, "=A2+");
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    sheet.SetCell("B1"_pos, "3");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(8.0));
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=A1*2");
+
+    sheet.SetCell("C1"_pos, "=A2/B1");
+    sheet.WarmUp().get();
+    sheet.SetCell("B1"_pos, "4");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.5));
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "=B1+1\t4\t=A2/B1\n=A1*2\t\t\n");
+}
+
+void TestFormulaCache() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B1 + 1");
+    sheet.SetCell("A2"_pos, "=B1 + 1");
+    sheet.SetCell("A3"_pos, "=B1+1");
+    sheet.SetCell("A4"_pos, "=B2+1");
+    const auto* a1 = static_cast<const Cell*>(sheet.GetCell("A1"_pos));
+    const auto* a3 = static_cast<const Cell*>(sheet.GetCell("A3"_pos));
+    ASSERT(a1->GetFormula() == a3->GetFormula());
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=B1+1");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetReferencedCells(), (std::vector{"B1"_pos}));
+
+    FormulaCacheStats stats = sheet.GetFormulaCacheStats();
+    ASSERT_EQUAL(stats.hits, 2u);
+    ASSERT_EQUAL(stats.misses, 2u);
+    ASSERT_EQUAL(stats.size, 3u);
+
+    //Shared formulas are evaluated separately for every cell
+    sheet.SetCell("B1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(3.0));
+    sheet.SetCell("B1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+    //The AST memory is counted once
+    const size_t formula_asts = sheet.MemoryUsage().formula_asts;
+    sheet.SetCell("A5"_pos, "=B1+1");
+    ASSERT_EQUAL(sheet.MemoryUsage().formula_asts, formula_asts);
+
+    sheet.SetFormulaCacheCapacity(1);
+    stats = sheet.GetFormulaCacheStats();
+    ASSERT_EQUAL(stats.size, 1u);
+    ASSERT_EQUAL(stats.evictions, 2u);
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "=B2+1");
+
+    sheet.SetFormulaCacheCapacity(0);
+    sheet.SetCell("C1"_pos, "=B1+1");
+    sheet.SetCell("C2"_pos, "=B1+1");
+    ASSERT(static_cast<const Cell*>(sheet.GetCell("C1"_pos))->GetFormula()
+           != static_cast<const Cell*>(sheet.GetCell("C2"_pos))->GetFormula());
+}
+
+void TestFormulaOptimization() {
+    Sheet sheet;
+    auto value = [&](std::string text) {
+        sheet.SetCell("B1"_pos, text);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), ParseFormula(text.substr(1))->GetText());
+        return sheet.GetCell("B1"_pos)->GetValue();
+    };
+    const CellInterface::Value div0(FormulaError::Category::Div0);
+
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(value("=2*3*A1/4"), CellInterface::Value(7.5));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=2*3*A1/4");
+    ASSERT_EQUAL(value("=(1+2)*A1"), CellInterface::Value(15.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=(1+2)*A1");
+    ASSERT_EQUAL(value("=A1/3-+A1*-2"), CellInterface::Value(5.0 / 3 + 10));
+    ASSERT_EQUAL(value("=A1/0.1"), CellInterface::Value(5.0 / 0.1));
+
+    //The divisor check also rejects negative and tiny constants
+    ASSERT_EQUAL(value("=A1/0"), div0);
+    ASSERT_EQUAL(value("=A1/(1-1)"), div0);
+    ASSERT_EQUAL(value("=A1/-2"), div0);
+    ASSERT_EQUAL(value("=A1/1e-20"), div0);
+    ASSERT_EQUAL(value("=1/0+A1"), div0);
+    ASSERT_EQUAL(value("=A1*1e308*10"), div0);
+
+    //Division does not check the result for overflow, multiplication does
+    sheet.SetCell("A1"_pos, "1e308");
+    ASSERT_EQUAL(value("=A1/0.5"), CellInterface::Value(std::numeric_limits<double>::infinity()));
+    ASSERT_EQUAL(value("=A1/0.5*1"), div0);
+
+    sheet.SetCell("A1"_pos, "text");
+    ASSERT_EQUAL(value("=2*3+A1"), CellInterface::Value(FormulaError::Category::Value));
+}
+
+void TestFormulaCellSlots() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B1+C1*2");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    //Referenced cells are replaced, cleared and rewritten in place of their slots
+    sheet.SetCell("B1"_pos, "1");
+    sheet.SetCell("C1"_pos, "=D1+1");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(3.0));
+    sheet.ClearCell("B1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+    sheet.SetCell("B1"_pos, "text");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    sheet.SetCell("B1"_pos, "10");
+    sheet.SetCell("D1"_pos, "4");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(20.0));
+
+    //Many new cells rehash the storage without moving the slots
+    for (int row = 1; row < 2000; ++row) {
+        sheet.SetCell({ row, 1 }, std::to_string(row));
+    }
+    sheet.SetCell("B1"_pos, "11");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(21.0));
+
+    //A snapshot evaluates the same formula by positions
+    const auto snapshot = sheet.Snapshot();
+    sheet.SetCell("B1"_pos, "12");
+    ASSERT_EQUAL(snapshot->GetCell("A1"_pos)->GetValue(), CellInterface::Value(21.0));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(22.0));
+}
+
+void TestCellKinds() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B1*2");
+    sheet.SetCell("A2"_pos, "'=text");
+    sheet.SetCell("A3"_pos, "text");
+    const auto kind = [&sheet](Position pos) {
+        return static_cast<const Cell*>(sheet.GetCell(pos))->GetTypeCell();
+    };
+    ASSERT(kind("A1"_pos) == TypeCell::FormulaImpl);
+    ASSERT(kind("B1"_pos) == TypeCell::EmptyImpl);
+    ASSERT(kind("A2"_pos) == TypeCell::TextImpl);
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(std::string("=text")));
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), std::string("'=text"));
+    ASSERT(static_cast<const Cell*>(sheet.GetCell("A3"_pos))->GetFormula() == nullptr);
+
+    //A cell changes its kind in place of the old one and keeps its dependents
+    sheet.SetCell("B1"_pos, "=C1+1");
+    ASSERT(kind("B1"_pos) == TypeCell::FormulaImpl);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+    sheet.SetCell("B1"_pos, "4");
+    ASSERT(kind("B1"_pos) == TypeCell::TextImpl);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(8.0));
+    sheet.ClearCell("B1"_pos);
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+}
+
+void TestLookupFunctions() {
+    const auto value = [](const Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "apple");
+    sheet.SetCell("A2"_pos, "banana");
+    sheet.SetCell("A3"_pos, "cherry");
+    sheet.SetCell("A4"_pos, "'10");
+    sheet.SetCell("B1"_pos, "10");
+    sheet.SetCell("B2"_pos, "20");
+    sheet.SetCell("B3"_pos, "30");
+    sheet.SetCell("B4"_pos, "40");
+
+    sheet.SetCell("D1"_pos, "=MATCH(20,B1:B4,0)");
+    sheet.SetCell("D2"_pos, "=MATCH(25,B1:B4)");
+    sheet.SetCell("D3"_pos, "=MATCH(25,B1:B4,-1)");
+    sheet.SetCell("D4"_pos, "=MATCH(5,B1:B4)");
+    sheet.SetCell("D5"_pos, "=VLOOKUP(F1,A1:B4,2,0)");
+    sheet.SetCell("D6"_pos, "=VLOOKUP(10,A1:B4,2,0)");
+    sheet.SetCell("D7"_pos, "=XLOOKUP(30,B1:B4,A1:A4)");
+    sheet.SetCell("D8"_pos, "=XLOOKUP(35,B2:B4,B1:B3,1)");
+    sheet.SetCell("F1"_pos, "cherry");
+    ASSERT_EQUAL(value(sheet, "D1"), CellInterface::Value(2));
+    ASSERT_EQUAL(value(sheet, "D2"), CellInterface::Value(2));
+    ASSERT_EQUAL(value(sheet, "D3"), CellInterface::Value(3));
+    ASSERT_EQUAL(value(sheet, "D4"), CellInterface::Value(FormulaError::Category::NA));
+    ASSERT_EQUAL(value(sheet, "D5"), CellInterface::Value(30));
+    ASSERT_EQUAL(value(sheet, "D6"), CellInterface::Value(40));    //numeric text is matched as a number
+    ASSERT_EQUAL(value(sheet, "D7"), CellInterface::Value(FormulaError::Category::Value));    //the result converts like a reference
+    ASSERT_EQUAL(value(sheet, "D8"), CellInterface::Value(30));
+    ASSERT_EQUAL(sheet.GetCell("D8"_pos)->GetText(), std::string("=XLOOKUP(35,B2:B4,B1:B3,1)"));
+
+    sheet.SetCell("E1"_pos, "=VLOOKUP(F1,A1:B4,3)");
+    ASSERT_EQUAL(value(sheet, "E1"), CellInterface::Value(FormulaError::Category::Ref));
+    sheet.SetCell("E1"_pos, "=VLOOKUP(F1,A1:B4,0)");
+    ASSERT_EQUAL(value(sheet, "E1"), CellInterface::Value(FormulaError::Category::Value));
+    sheet.SetCell("E1"_pos, "=XLOOKUP(F1,A1:A4,B1:B3)");
+    ASSERT_EQUAL(value(sheet, "E1"), CellInterface::Value(FormulaError::Category::Value));
+    sheet.SetCell("E1"_pos, "=MATCH(F1,A1:B4,0)");
+    ASSERT_EQUAL(value(sheet, "E1"), CellInterface::Value(FormulaError::Category::NA));
+
+    //Writes and clears in a range invalidate the lookups over it
+    sheet.SetCell("B5"_pos, "20");
+    sheet.SetCell("D9"_pos, "=MATCH(20,B3:B9,0)");
+    ASSERT_EQUAL(value(sheet, "D9"), CellInterface::Value(3));
+    sheet.SetCell("B3"_pos, "20");
+    ASSERT_EQUAL(value(sheet, "D1"), CellInterface::Value(2));
+    ASSERT_EQUAL(value(sheet, "D9"), CellInterface::Value(1));
+    sheet.ClearCell("B2"_pos);
+    ASSERT_EQUAL(value(sheet, "D1"), CellInterface::Value(3));
+    sheet.SetCell("F1"_pos, "banana");
+    ASSERT_EQUAL(value(sheet, "D5"), CellInterface::Value(0));
+    sheet.SetCell("B6"_pos, "=B1*2");
+    sheet.SetCell("D10"_pos, "=MATCH(20,B4:B9,0)");
+    sheet.ClearCell("B5"_pos);
+    ASSERT_EQUAL(value(sheet, "D10"), CellInterface::Value(3));   //formula results are searched as well
+    sheet.SetCell("B1"_pos, "1");
+    ASSERT_EQUAL(value(sheet, "D10"), CellInterface::Value(FormulaError::Category::NA));
+
+    bool caught = false;
+    try {
+        sheet.SetCell("B7"_pos, "=D10");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    caught = false;
+    try {
+        sheet.SetCell("B7"_pos, "=MATCH(1,B1:B9)");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    for (std::string expression : { "MATCH(1,B1:B9,0,0,0)", "SUM(B1:B9)", "MATCH(B1:B9,B1:B9)", "B1:B9", "match(1,B1:B9)" }) {
+        caught = false;
+        try {
+            ParseFormula(expression);
+        } catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+    ASSERT_EQUAL(ParseFormula(" MATCH( A1 ,B10:B1 ) ")->GetExpression(), std::string("MATCH(A1,B1:B10)"));
+    ASSERT(ParseFormula("MATCH(A1,B10:B1)")->GetReferencedRanges() == (std::vector{ CellRange{ "B1"_pos, "B10"_pos } }));
+
+    //Snapshots search without the index, deferred formulas find their ranges by the scanner
+    auto snapshot = sheet.Snapshot();
+    ASSERT_EQUAL(snapshot->GetCell("D10"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::NA));
+    ASSERT_EQUAL(snapshot->GetCell("D3"_pos)->GetValue(), value(sheet, "D3"));
+    ASSERT_EQUAL(value(sheet, "D3"), CellInterface::Value(4));
+    Sheet deferred;
+    deferred.SetDeferredParsing(true);
+    deferred.SetCell("A1"_pos, "=MATCH(2,B1:B3,0)");
+    deferred.SetCell("B2"_pos, "2");
+    ASSERT_EQUAL(value(deferred, "A1"), CellInterface::Value(2));
+    ASSERT(sheet.MemoryUsage().lookup_indexes > 0);
+}
+
+void TestLookupIndexes() {
+    //Approximate lookups over parts of a tall column agree with a snapshot, which searches without the index
+    Sheet sheet;
+    for (int row = 0; row < 2000; ++row) {
+        sheet.SetCell({ row, 1 }, std::to_string(row * 7919 % 1000));
+    }
+    const std::vector<std::pair<int, int>> spans = { { 0, 1999 }, { 10, 20 }, { 16, 47 }, { 250, 260 }, { 255, 1300 },
+                                                      { 17, 1503 }, { 1999, 1999 } };
+    int formulas = 0;
+    for (const auto& [from, to] : spans) {
+        for (std::string key : { "-1", "0", "500", "777.5", "2000" }) {
+            for (std::string mode : { "1", "-1" }) {
+                sheet.SetCell({ formulas++, 3 }, "=MATCH(" + key + "," + Position{ from, 1 }.ToString() + ":"
+                                                 + Position{ to, 1 }.ToString() + "," + mode + ")");
+            }
+        }
+    }
+    auto snapshot = sheet.Snapshot();
+    for (int row = 0; row < formulas; ++row) {
+        ASSERT_EQUAL(sheet.GetCell({ row, 3 })->GetValue(), snapshot->GetCell({ row, 3 })->GetValue());
+    }
+
+    //Formula values are indexed too, so a lookup evaluates only the formulas changed since the previous one
+    Sheet values;
+    for (int row = 0; row < 1000; ++row) {
+        values.SetCell({ row, 1 }, "=" + std::to_string(row) + "*2");
+    }
+    values.SetCell("B1001"_pos, "=C1");
+    values.SetCell("C1"_pos, "7");
+    values.SetCell("C2"_pos, "7");
+    values.SetCell("A1"_pos, "=MATCH(C2,B1:B1001,0)");
+    ASSERT_EQUAL(values.GetCell("A1"_pos)->GetValue(), CellInterface::Value(1001.0));
+    values.SetCell("A2"_pos, "=MATCH(999,B1:B1001,1)");
+    ASSERT_EQUAL(values.GetCell("A2"_pos)->GetValue(), CellInterface::Value(500.0));
+    values.ResetStats();
+    values.SetCell("C1"_pos, "3");
+    values.SetCell("C2"_pos, "3");
+    ASSERT_EQUAL(values.GetCell("A1"_pos)->GetValue(), CellInterface::Value(1001.0));
+    ASSERT_EQUAL(values.GetStats().evaluations, 2u);
+    ASSERT_EQUAL(values.GetStats().cache_hits, 0u);
+    values.SetCell("B500"_pos, "=999");
+    ASSERT_EQUAL(values.GetCell("A2"_pos)->GetValue(), CellInterface::Value(500.0));
+    values.SetCell("B500"_pos, "=C1");
+    ASSERT_EQUAL(values.GetCell("A2"_pos)->GetValue(), CellInterface::Value(499.0));
+
+    //A replaced formula forgets its ranges, a rejected one never adds them
+    Sheet ranges;
+    ranges.SetCell("A1"_pos, "=MATCH(1,B1:B10)");
+    const size_t graph = ranges.MemoryUsage().dependency_graph;
+    for (int i = 1; i <= 100; ++i) {
+        ranges.SetCell("A1"_pos, "=MATCH(1,B" + std::to_string(i) + ":B" + std::to_string(i + 9) + ")");
+    }
+    ranges.SetCell("A1"_pos, "=MATCH(1,B1:B10)");
+    ASSERT_EQUAL(ranges.MemoryUsage().dependency_graph, graph);
+    bool caught = false;
+    try {
+        ranges.SetCell("B5"_pos, "=MATCH(1,B1:B9)");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(ranges.MemoryUsage().dependency_graph, graph);
+
+    //Indexes are built while other regions are written
+    Sheet concurrent;
+    concurrent.SetConcurrentWrites(true);
+    const int first_col = 2 * Sheet::REGION_SIZE;
+    const int cols = 20;
+    std::thread writer([&concurrent, first_col, cols] {
+        for (int row = 1; row < 100; ++row) {
+            for (int col = first_col; col < first_col + cols; ++col) {
+                concurrent.SetCell({ row, col }, std::to_string(row));
+            }
+        }
+    });
+    for (int col = first_col; col < first_col + cols; ++col) {
+        const std::string cell = Position{ 0, col }.ToString();
+        concurrent.SetCell("A1"_pos, "=MATCH(50," + cell + ":" + cell + ")");
+        concurrent.GetCell("A1"_pos)->GetValue();
+    }
+    writer.join();
+    concurrent.SetConcurrentWrites(false);
+    for (int col = first_col; col < first_col + cols; ++col) {
+        concurrent.SetCell("A2"_pos, "=MATCH(50," + Position{ 0, col }.ToString() + ":" + Position{ 99, col }.ToString() + ")");
+        ASSERT_EQUAL(concurrent.GetCell("A2"_pos)->GetValue(), CellInterface::Value(51.0));
+    }
+}
+
+void TestFillRange() {
+    const auto text = [](const Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetText();
+    };
+    const auto value = [](const Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    Sheet sheet;
+    for (int row = 0; row < 5; ++row) {
+        sheet.SetCell({ row, 0 }, std::to_string(row + 1));
+    }
+    sheet.SetCell("F1"_pos, "=B3+1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    ASSERT_EQUAL(value(sheet, "F1"), CellInterface::Value(1));
+    sheet.FillRange("B1"_pos, { "B1"_pos, "B5"_pos });
+    ASSERT_EQUAL(text(sheet, "B5"), std::string("=A5*2"));
+    ASSERT_EQUAL(value(sheet, "B5"), CellInterface::Value(10));
+    ASSERT_EQUAL(value(sheet, "F1"), CellInterface::Value(7));    //dependents of a filled cell are invalidated
+    sheet.SetCell("A3"_pos, "10");
+    ASSERT_EQUAL(value(sheet, "F1"), CellInterface::Value(21));
+
+    //The copies have the texts that parsing the shifted expressions gives
+    sheet.SetCell("C2"_pos, "=(A1+B2)*C3/MATCH(1,A1:A3,0)");
+    sheet.FillRange("C2"_pos, { "C1"_pos, "D3"_pos });
+    ASSERT_EQUAL(text(sheet, "D3"), std::string("=(B2+C3)*D4/MATCH(1,B2:B4,0)"));
+    ASSERT_EQUAL(text(sheet, "C1"), std::string("=(#REF!+B1)*C2/MATCH(1,#REF!,0)"));
+    ASSERT_EQUAL(value(sheet, "C1"), CellInterface::Value(FormulaError::Category::Ref));
+    for (std::string_view pos : { "C1", "D1", "C3", "D3" }) {
+        const std::string expression = text(sheet, pos).substr(1);
+        ASSERT_EQUAL(ParseFormula(expression)->GetExpression(), expression);
+        ASSERT(ScanFormula(expression).ranges == ParseFormula(expression)->GetReferencedRanges());
+    }
+    sheet.SetCell("E1"_pos, "=#REF!*2");
+    ASSERT_EQUAL(text(sheet, "E1"), std::string("=#REF!*2"));
+    for (std::string expression : { "MATCH(1,(#REF!))", "#REF!#REF!", "A1:#REF!" }) {
+        bool caught = false;
+        try {
+            ParseFormula(expression);
+        } catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+
+    //A cycle through a cell outside the block or a range leaves the sheet unchanged
+    sheet.SetCell("H3"_pos, "=G3");
+    sheet.SetCell("J5"_pos, "=MATCH(1,G1:G9)");
+    sheet.SetCell("G1"_pos, "=H1");
+    for (Position end : { "G3"_pos, "G5"_pos }) {
+        bool caught = false;
+        try {
+            sheet.FillRange("G1"_pos, { "G1"_pos, end });
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT(sheet.GetCell("G2"_pos) == nullptr || text(sheet, "G2").empty());
+    }
+    sheet.SetCell("G1"_pos, "=G2+1");
+    sheet.FillRange("G1"_pos, { "G1"_pos, "G2"_pos });
+    ASSERT_EQUAL(text(sheet, "G2"), std::string("=G3+1"));
+
+    //Text is copied as it is and an empty source clears the block
+    sheet.SetCell("K1"_pos, "'=text");
+    sheet.FillRange("K1"_pos, { "K2"_pos, "L3"_pos });
+    ASSERT_EQUAL(text(sheet, "L3"), std::string("'=text"));
+    sheet.FillRange("M1"_pos, { "K2"_pos, "L3"_pos });
+    ASSERT(sheet.GetCell("L3"_pos) == nullptr);
+
+    bool caught = false;
+    try {
+        sheet.FillRange("B1"_pos, { "B1"_pos, Position{ Position::MAX_ROWS, 1 } });
+    } catch (const InvalidPositionException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    Sheet deferred;
+    deferred.SetDeferredParsing(true);
+    deferred.SetCell("A1"_pos, "=B1+1");
+    deferred.FillRange("A1"_pos, { "A1"_pos, "A1000"_pos });
+    deferred.SetCell("B1000"_pos, "5");
+    ASSERT_EQUAL(value(deferred, "A1000"), CellInterface::Value(6));
+    ASSERT_EQUAL(deferred.Snapshot()->GetCell("A999"_pos)->GetText(), std::string("=B999+1"));
+}
+
+void TestStructureEdit() {
+    const auto text = [](const Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetText();
+    };
+    const auto value = [](const Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    Sheet sheet;
+    for (int row = 0; row < 4; ++row) {
+        sheet.SetCell({ row, 0 }, std::to_string(row + 1));
+    }
+    sheet.SetCell("B1"_pos, "=A3*2");
+    sheet.SetCell("B2"_pos, "=MATCH(3,A1:A4,0)");
+    sheet.SetCell("C5"_pos, "=A4+B1");
+    ASSERT_EQUAL(value(sheet, "C5"), CellInterface::Value(10));
+    const uint64_t parsed = sheet.GetStats().formulas_parsed;
+
+    //Inserted rows move the cells below them, and the ranges crossing them grow
+    sheet.InsertRows(1, 2);
+    ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+    ASSERT_EQUAL(text(sheet, "A5"), std::string("3"));
+    ASSERT_EQUAL(text(sheet, "B1"), std::string("=A5*2"));
+    ASSERT_EQUAL(text(sheet, "B4"), std::string("=MATCH(3,A1:A6,0)"));
+    ASSERT_EQUAL(text(sheet, "C7"), std::string("=A6+B1"));
+    ASSERT_EQUAL(value(sheet, "B4"), CellInterface::Value(5));
+    ASSERT_EQUAL(value(sheet, "C7"), CellInterface::Value(10));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 7, 3 }));
+    ASSERT_EQUAL(sheet.GetStats().formulas_parsed, parsed);
+    ASSERT_EQUAL(sheet.Snapshot()->GetCell("C7"_pos)->GetText(), std::string("=A6+B1"));
+    sheet.SetCell("A5"_pos, "10");   //the dependents follow the moved cells
+    ASSERT_EQUAL(value(sheet, "C7"), CellInterface::Value(24));
+
+    //References to deleted cells become #REF!, ranges losing rows shrink
+    sheet.DeleteRows(4);
+    ASSERT_EQUAL(text(sheet, "B1"), std::string("=#REF!*2"));
+    ASSERT_EQUAL(text(sheet, "B4"), std::string("=MATCH(3,A1:A5,0)"));
+    ASSERT_EQUAL(text(sheet, "C6"), std::string("=A5+B1"));
+    ASSERT_EQUAL(value(sheet, "B1"), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(value(sheet, "B4"), CellInterface::Value(FormulaError::Category::NA));
+    ASSERT_EQUAL(value(sheet, "C6"), CellInterface::Value(FormulaError::Category::Ref));
+    sheet.SetCell("A4"_pos, "3");
+    ASSERT_EQUAL(value(sheet, "B4"), CellInterface::Value(4));
+
+    sheet.InsertCols(0);
+    ASSERT_EQUAL(text(sheet, "C4"), std::string("=MATCH(3,B1:B5,0)"));
+    ASSERT_EQUAL(text(sheet, "D6"), std::string("=B5+C1"));
+    sheet.DeleteCols(1);
+    ASSERT_EQUAL(text(sheet, "B4"), std::string("=MATCH(3,#REF!,0)"));
+    ASSERT_EQUAL(text(sheet, "C6"), std::string("=#REF!+B1"));
+    ASSERT_EQUAL(value(sheet, "B4"), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 6, 3 }));
+    for (std::string_view pos : { "B1", "B4", "C6" }) {
+        const std::string expression = text(sheet, pos).substr(1);
+        ASSERT_EQUAL(ParseFormula(expression)->GetExpression(), expression);
+    }
+
+    //An insertion that would push cells off the sheet leaves it unchanged
+    sheet.SetCell({ Position::MAX_ROWS - 1, 0 }, "last");
+    bool caught = false;
+    try {
+        sheet.InsertRows(0);
+    } catch (const InvalidPositionException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(text(sheet, "C6"), std::string("=#REF!+B1"));
+    sheet.DeleteRows(Position::MAX_ROWS - 1, 10);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 6, 3 }));
+
+    Sheet deferred;
+    deferred.SetDeferredParsing(true);
+    deferred.SetCell("A1"_pos, "=B2+1");
+    deferred.SetCell("A2"_pos, "=B1+1");
+    deferred.InsertRows(1);
+    ASSERT_EQUAL(text(deferred, "A1"), std::string("=B3+1"));
+    ASSERT_EQUAL(text(deferred, "A3"), std::string("=B1+1"));
+    deferred.SetCell("B3"_pos, "4");
+    ASSERT_EQUAL(value(deferred, "A1"), CellInterface::Value(5));
+}
+
 int main() {
     TestRunner tr;
     RUN_TEST(tr, TestClearPrint);
@@ -638,7 +2028,9 @@ int main() {
     RUN_TEST(tr, TestCash);
     RUN_TEST(tr, TestPositionAndStringConversion);
     RUN_TEST(tr, TestPositionToStringInvalid);
+    RUN_TEST(tr, TestPositionKey);
     RUN_TEST(tr, TestStringToPositionInvalid);
+    RUN_TEST(tr, TestPositionBatchConversion);
     RUN_TEST(tr, TestEmpty);
     RUN_TEST(tr, TestInvalidPosition);
     RUN_TEST(tr, TestSetCellPlainText);
@@ -646,6 +2038,7 @@ int main() {
     RUN_TEST(tr, TestFormulaArithmetic);
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
+    RUN_TEST(tr, TestFormulaCanonicalText);
     RUN_TEST(tr, TestFormulaReferencedCells);
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestErrorDiv0);
@@ -655,5 +2048,31 @@ int main() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestDependentsAfterRewrite);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestSnapshotConcurrentWrites);
+    RUN_TEST(tr, TestSnapshotConsistency);
+    RUN_TEST(tr, TestConcurrentWrites);
+    RUN_TEST(tr, TestConcurrentCircularReferences);
+    RUN_TEST(tr, TestAsyncSheet);
+    RUN_TEST(tr, TestWorkbook);
+    RUN_TEST(tr, TestStats);
+    RUN_TEST(tr, TestTrace);
+    RUN_TEST(tr, TestRecordingSheet);
+    RUN_TEST(tr, TestProfiler);
+    RUN_TEST(tr, TestDependencyGraph);
+    RUN_TEST(tr, TestMemoryUsage);
+    RUN_TEST(tr, TestCompactCells);
+    RUN_TEST(tr, TestStringPool);
+    RUN_TEST(tr, TestScanFormula);
+    RUN_TEST(tr, TestDeferredParsing);
+    RUN_TEST(tr, TestFormulaCache);
+    RUN_TEST(tr, TestFormulaOptimization);
+    RUN_TEST(tr, TestFormulaCellSlots);
+    RUN_TEST(tr, TestCellKinds);
+    RUN_TEST(tr, TestLookupFunctions);
+    RUN_TEST(tr, TestLookupIndexes);
+    RUN_TEST(tr, TestFillRange);
+    RUN_TEST(tr, TestStructureEdit);
     return 0;
 }
\ No newline at end of file
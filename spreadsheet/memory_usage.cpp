@@ -0,0 +1,78 @@
+#include "memory_usage.h"
+
+namespace {
+
+thread_local AllocationScope* current_scope = nullptr;
+
+}  // namespace
+
+//MemoryTracker
+void MemoryTracker::Allocate(const SheetMemoryUsage& usage) {
+	Allocate(MemoryCategory::CellStorage, usage.cell_storage);
+	Allocate(MemoryCategory::FormulaAst, usage.formula_asts);
+	Allocate(MemoryCategory::Text, usage.text);
+	Allocate(MemoryCategory::DependencyGraph, usage.dependency_graph);
+	Allocate(MemoryCategory::LookupIndex, usage.lookup_indexes);
+}
+
+void MemoryTracker::Deallocate(const SheetMemoryUsage& usage) {
+	Deallocate(MemoryCategory::CellStorage, usage.cell_storage);
+	Deallocate(MemoryCategory::FormulaAst, usage.formula_asts);
+	Deallocate(MemoryCategory::Text, usage.text);
+	Deallocate(MemoryCategory::DependencyGraph, usage.dependency_graph);
+	Deallocate(MemoryCategory::LookupIndex, usage.lookup_indexes);
+}
+
+SheetMemoryUsage MemoryTracker::GetUsage() const {
+	auto get = [this](MemoryCategory category) {
+		return bytes_[static_cast<size_t>(category)].load(std::memory_order_relaxed);
+	};
+	SheetMemoryUsage usage;
+	usage.cell_storage = get(MemoryCategory::CellStorage);
+	usage.formula_asts = get(MemoryCategory::FormulaAst);
+	usage.text = get(MemoryCategory::Text);
+	usage.dependency_graph = get(MemoryCategory::DependencyGraph);
+	usage.lookup_indexes = get(MemoryCategory::LookupIndex);
+	return usage;
+}
+
+//SharedMemoryCounter
+SharedMemoryCounter::SharedMemoryCounter(MemoryTracker& tracker, MemoryCategory category)
+	: tracker_(tracker)
+	, category_(category)
+	, refs_(RefMap::allocator_type(tracker, MemoryCategory::CellStorage)) {
+}
+
+void SharedMemoryCounter::Acquire(const void* object, size_t bytes) {
+	std::lock_guard lock(mutex_);
+	if (++refs_[object] == 1) {
+		tracker_.Allocate(category_, bytes);
+	}
+}
+
+void SharedMemoryCounter::Release(const void* object, size_t bytes) {
+	std::lock_guard lock(mutex_);
+	auto it = refs_.find(object);
+	if (--it->second == 0) {
+		refs_.erase(it);
+		tracker_.Deallocate(category_, bytes);
+	}
+}
+
+//AllocationScope
+AllocationScope::AllocationScope(): parent_(current_scope) {
+	current_scope = this;
+}
+
+AllocationScope::~AllocationScope() {
+	current_scope = parent_;
+	if (parent_ != nullptr) {
+		parent_->bytes_ += bytes_;
+	}
+}
+
+void AllocationScope::Add(size_t bytes) {
+	if (current_scope != nullptr) {
+		current_scope->bytes_ += bytes;
+	}
+}
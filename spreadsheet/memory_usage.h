@@ -0,0 +1,195 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+
+enum class MemoryCategory {
+    CellStorage,        // хеш-таблицы ячеек, объекты Cell и записи формул
+    FormulaAst,         // деревья формул и списки ссылок
+    Text,               // текст ячеек, не поместившийся в саму ячейку
+    DependencyGraph,    // множества зависимых ячеек
+    LookupIndex,        // индексы столбцов для функций поиска
+};
+
+inline constexpr size_t MEMORY_CATEGORY_COUNT = 5;
+
+// Память таблицы в байтах по категориям. Учитываются запрошенные у
+// аллокатора размеры, без служебных данных самого аллокатора.
+struct SheetMemoryUsage {
+    size_t cell_storage = 0;
+    size_t formula_asts = 0;
+    size_t text = 0;
+    size_t dependency_graph = 0;
+    size_t lookup_indexes = 0;
+
+    size_t Total() const {
+        return cell_storage + formula_asts + text + dependency_graph + lookup_indexes;
+    }
+};
+
+// Счётчики памяти одной таблицы. Потокобезопасны.
+class MemoryTracker {
+public:
+    void Allocate(MemoryCategory category, size_t bytes) {
+        bytes_[static_cast<size_t>(category)].fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void Deallocate(MemoryCategory category, size_t bytes) {
+        bytes_[static_cast<size_t>(category)].fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    void Allocate(const SheetMemoryUsage& usage);
+    void Deallocate(const SheetMemoryUsage& usage);
+
+    SheetMemoryUsage GetUsage() const;
+
+private:
+    std::array<std::atomic<size_t>, MEMORY_CATEGORY_COUNT> bytes_{};
+};
+
+// Аллокатор контейнеров, который учитывает выделенную память в MemoryTracker.
+// Аллокатор по умолчанию ничего не учитывает; он нужен, чтобы контейнер можно
+// было создать до того, как ему назначат счётчик присваиванием.
+template <typename T>
+class TrackingAllocator {
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    TrackingAllocator() noexcept = default;
+
+    TrackingAllocator(MemoryTracker& tracker, MemoryCategory category) noexcept
+        : tracker_(&tracker)
+        , category_(category) {
+    }
+
+    template <typename U>
+    TrackingAllocator(const TrackingAllocator<U>& other) noexcept
+        : tracker_(other.tracker_)
+        , category_(other.category_) {
+    }
+
+    T* allocate(size_t n) {
+        T* result = std::allocator<T>().allocate(n);
+        if (tracker_ != nullptr) {
+            tracker_->Allocate(category_, n * sizeof(T));
+        }
+        return result;
+    }
+
+    void deallocate(T* ptr, size_t n) noexcept {
+        if (tracker_ != nullptr) {
+            tracker_->Deallocate(category_, n * sizeof(T));
+        }
+        std::allocator<T>().deallocate(ptr, n);
+    }
+
+    template <typename U>
+    bool operator==(const TrackingAllocator<U>& other) const noexcept {
+        return tracker_ == other.tracker_ && category_ == other.category_;
+    }
+
+    template <typename U>
+    bool operator!=(const TrackingAllocator<U>& other) const noexcept {
+        return !(*this == other);
+    }
+
+private:
+    template <typename U>
+    friend class TrackingAllocator;
+
+    MemoryTracker* tracker_ = nullptr;
+    MemoryCategory category_ = MemoryCategory::CellStorage;
+};
+
+// Учитывает память объектов, которые разделяют несколько владельцев, один
+// раз на объект: первая ссылка добавляет его байты в категорию category,
+// последняя снимает. Записи счётчика учитываются как CellStorage.
+// Потокобезопасен.
+class SharedMemoryCounter {
+public:
+    SharedMemoryCounter(MemoryTracker& tracker, MemoryCategory category);
+
+    // bytes не должны меняться, пока на объект есть ссылки.
+    void Acquire(const void* object, size_t bytes);
+    void Release(const void* object, size_t bytes);
+
+private:
+    using RefMap = std::unordered_map<const void*, size_t, std::hash<const void*>, std::equal_to<const void*>,
+                                      TrackingAllocator<std::pair<const void* const, size_t>>>;
+
+    MemoryTracker& tracker_;
+    MemoryCategory category_;
+    std::mutex mutex_;
+    RefMap refs_;
+};
+
+// Считает память, выделенную в текущем потоке через ScopedCountingAllocator
+// (и операторы new узлов дерева формулы), пока объект жив. Так при разборе
+// формулы измеряется размер дерева, которое потом не меняется.
+class AllocationScope {
+public:
+    AllocationScope();
+    ~AllocationScope();
+
+    AllocationScope(const AllocationScope&) = delete;
+    AllocationScope& operator=(const AllocationScope&) = delete;
+
+    size_t GetBytes() const {
+        return bytes_;
+    }
+
+    static void Add(size_t bytes);
+
+private:
+    size_t bytes_ = 0;
+    AllocationScope* parent_;
+};
+
+template <typename T>
+class ScopedCountingAllocator {
+public:
+    using value_type = T;
+
+    ScopedCountingAllocator() noexcept = default;
+
+    template <typename U>
+    ScopedCountingAllocator(const ScopedCountingAllocator<U>&) noexcept {
+    }
+
+    T* allocate(size_t n) {
+        AllocationScope::Add(n * sizeof(T));
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* ptr, size_t n) noexcept {
+        std::allocator<T>().deallocate(ptr, n);
+    }
+
+    template <typename U>
+    bool operator==(const ScopedCountingAllocator<U>&) const noexcept {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const ScopedCountingAllocator<U>&) const noexcept {
+        return false;
+    }
+};
+
+// Память, которую строка заняла в куче: короткие строки хранятся внутри
+// объекта std::string и кучу не используют.
+inline size_t GetHeapBytes(const std::string& str) {
+    static const size_t inline_capacity = std::string().capacity();
+    return str.capacity() > inline_capacity ? str.capacity() + 1 : 0;
+}
@@ -0,0 +1,114 @@
+#include "oplog.h"
+
+#include <istream>
+#include <ostream>
+
+using namespace std::literals;
+
+namespace {
+
+const uint64_t MAX_TEXT_SIZE = 1 << 24;
+
+}  // namespace
+
+bool HasPosition(OpType type) {
+	return type == OpType::SetCell || type == OpType::ClearCell || type == OpType::GetValue || type == OpType::GetText;
+}
+
+std::string_view ToString(OpType type) {
+	switch (type) {
+	case OpType::SetCell:
+		return "SetCell"sv;
+	case OpType::ClearCell:
+		return "ClearCell"sv;
+	case OpType::GetValue:
+		return "GetValue"sv;
+	case OpType::GetText:
+		return "GetText"sv;
+	case OpType::GetPrintableSize:
+		return "GetPrintableSize"sv;
+	case OpType::PrintValues:
+		return "PrintValues"sv;
+	case OpType::PrintTexts:
+		return "PrintTexts"sv;
+	}
+	return "Unknown"sv;
+}
+
+//OpLogWriter
+OpLogWriter::OpLogWriter(std::ostream& output): output_(output) {
+	output_.write(OPLOG_MAGIC.data(), OPLOG_MAGIC.size());
+}
+
+void OpLogWriter::Write(const Op& op) {
+	output_.put(static_cast<char>(op.type));
+	WriteVarint(op.delta_ns);
+	if (HasPosition(op.type)) {
+		WriteVarint(static_cast<uint32_t>(op.pos.row));
+		WriteVarint(static_cast<uint32_t>(op.pos.col));
+	}
+	if (op.type == OpType::SetCell) {
+		WriteVarint(op.text.size());
+		output_.write(op.text.data(), op.text.size());
+	}
+}
+
+void OpLogWriter::WriteVarint(uint64_t value) {
+	while (value >= 0x80) {
+		output_.put(static_cast<char>((value & 0x7F) | 0x80));
+		value >>= 7;
+	}
+	output_.put(static_cast<char>(value));
+}
+
+//OpLogReader
+OpLogReader::OpLogReader(std::istream& input): input_(input) {
+	std::string magic(OPLOG_MAGIC.size(), '\0');
+	if (!input_.read(magic.data(), magic.size()) || magic != OPLOG_MAGIC) {
+		throw std::runtime_error("Not an operation log"s);
+	}
+}
+
+bool OpLogReader::Next(Op& op) {
+	const int type = input_.get();
+	if (type == std::char_traits<char>::eof()) {
+		return false;
+	}
+	if (type < static_cast<int>(OpType::SetCell) || type > static_cast<int>(OpType::PrintTexts)) {
+		throw std::runtime_error("Unknown operation in log: "s + std::to_string(type));
+	}
+	op.type = static_cast<OpType>(type);
+	op.delta_ns = ReadVarint();
+	op.pos = Position::NONE;
+	op.text.clear();
+	if (HasPosition(op.type)) {
+		op.pos.row = static_cast<int>(ReadVarint());
+		op.pos.col = static_cast<int>(ReadVarint());
+	}
+	if (op.type == OpType::SetCell) {
+		const uint64_t size = ReadVarint();
+		if (size > MAX_TEXT_SIZE) {
+			throw std::runtime_error("Corrupted operation log"s);
+		}
+		op.text.resize(size);
+		if (!input_.read(op.text.data(), size)) {
+			throw std::runtime_error("Truncated operation log"s);
+		}
+	}
+	return true;
+}
+
+uint64_t OpLogReader::ReadVarint() {
+	uint64_t value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		const int byte = input_.get();
+		if (byte == std::char_traits<char>::eof()) {
+			throw std::runtime_error("Truncated operation log"s);
+		}
+		value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) {
+			return value;
+		}
+	}
+	throw std::runtime_error("Corrupted operation log"s);
+}
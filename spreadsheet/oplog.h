@@ -0,0 +1,62 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+// Журнал операций с таблицей в компактном двоичном формате. Файл начинается
+// с сигнатуры OPLOG_MAGIC, за ней идут записи: байт типа операции, время от
+// предыдущей записи в наносекундах (varint), затем аргументы операции -
+// строка и столбец (varint) и текст (длина varint и байты).
+enum class OpType : uint8_t {
+    SetCell = 1,
+    ClearCell = 2,
+    GetValue = 3,
+    GetText = 4,
+    GetPrintableSize = 5,
+    PrintValues = 6,
+    PrintTexts = 7,
+};
+
+struct Op {
+    OpType type = OpType::SetCell;
+    uint64_t delta_ns = 0;
+    Position pos = Position::NONE;
+    std::string text;
+};
+
+inline constexpr std::string_view OPLOG_MAGIC = "SSOPLOG1";
+
+class OpLogWriter {
+public:
+    // Записывает сигнатуру в начало потока.
+    explicit OpLogWriter(std::ostream& output);
+
+    void Write(const Op& op);
+
+private:
+    void WriteVarint(uint64_t value);
+
+    std::ostream& output_;
+};
+
+// Бросает std::runtime_error, если поток не является журналом операций или
+// запись в нём повреждена.
+class OpLogReader {
+public:
+    explicit OpLogReader(std::istream& input);
+
+    // Читает следующую операцию; возвращает false в конце журнала.
+    bool Next(Op& op);
+
+private:
+    uint64_t ReadVarint();
+
+    std::istream& input_;
+};
+
+// Позиция есть у всех операций, кроме печати и запроса размера.
+bool HasPosition(OpType type);
+std::string_view ToString(OpType type);
@@ -0,0 +1,102 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+
+//Inclusive time of the evaluations nested into the current one on this thread
+thread_local uint64_t children_ns = 0;
+
+uint64_t GetKey(const CellProfile& profile, ProfileOrder order) {
+	switch (order) {
+	case ProfileOrder::SelfTime:
+		return profile.self_ns;
+	case ProfileOrder::InclusiveTime:
+		return profile.inclusive_ns;
+	case ProfileOrder::Evaluations:
+		return profile.evaluations;
+	case ProfileOrder::Invalidations:
+		return profile.invalidations;
+	}
+	return 0;
+}
+
+}  // namespace
+
+//CellProfiler::Evaluation
+CellProfiler::Evaluation::Evaluation(CellProfiler& profiler, Position pos)
+    : profiler_(profiler)
+    , pos_(pos)
+    , saved_children_ns_(std::exchange(children_ns, 0))
+    , start_(std::chrono::steady_clock::now()) {
+}
+
+CellProfiler::Evaluation::~Evaluation() {
+	const uint64_t inclusive_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start_).count();
+	const uint64_t self_ns = inclusive_ns - std::min(children_ns, inclusive_ns);
+	children_ns = saved_children_ns_ + inclusive_ns;
+	profiler_.RecordEvaluation(pos_, self_ns, inclusive_ns);
+}
+
+//CellProfiler
+void CellProfiler::SetEnabled(bool enabled) {
+	enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+void CellProfiler::Reset() {
+	std::lock_guard lock(mutex_);
+	profiles_.clear();
+}
+
+void CellProfiler::RecordEvaluation(Position pos, uint64_t self_ns, uint64_t inclusive_ns) {
+	std::lock_guard lock(mutex_);
+	CellProfile& profile = profiles_[pos];
+	profile.pos = pos;
+	++profile.evaluations;
+	profile.self_ns += self_ns;
+	profile.inclusive_ns += inclusive_ns;
+}
+
+void CellProfiler::RecordInvalidation(Position pos) {
+	std::lock_guard lock(mutex_);
+	CellProfile& profile = profiles_[pos];
+	profile.pos = pos;
+	++profile.invalidations;
+}
+
+std::vector<CellProfile> CellProfiler::GetProfile() const {
+	std::lock_guard lock(mutex_);
+	std::vector<CellProfile> result;
+	result.reserve(profiles_.size());
+	for (const auto& [pos, profile] : profiles_) {
+		result.push_back(profile);
+	}
+	std::sort(result.begin(), result.end(), [](const CellProfile& lhs, const CellProfile& rhs) {
+		return lhs.pos < rhs.pos;
+	});
+	return result;
+}
+
+std::vector<CellProfile> CellProfiler::GetTop(size_t count, ProfileOrder order) const {
+	std::vector<CellProfile> result = GetProfile();
+	count = std::min(count, result.size());
+	std::partial_sort(result.begin(), result.begin() + count, result.end(),
+		[order](const CellProfile& lhs, const CellProfile& rhs) {
+			const uint64_t lhs_key = GetKey(lhs, order);
+			const uint64_t rhs_key = GetKey(rhs, order);
+			return lhs_key != rhs_key ? lhs_key > rhs_key : lhs.pos < rhs.pos;
+		});
+	result.resize(count);
+	return result;
+}
+
+std::optional<CellProfile> CellProfiler::Find(Position pos) const {
+	std::lock_guard lock(mutex_);
+	auto it = profiles_.find(pos);
+	if (it == profiles_.end()) {
+		return std::nullopt;
+	}
+	return it->second;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+// Профиль вычислений одной формулы. Инклюзивное время включает вычисление
+// ячеек, на которые ссылается формула, собственное - нет.
+struct CellProfile {
+    Position pos;
+    uint64_t evaluations = 0;
+    uint64_t self_ns = 0;
+    uint64_t inclusive_ns = 0;
+    uint64_t invalidations = 0;
+};
+
+enum class ProfileOrder {
+    SelfTime,
+    InclusiveTime,
+    Evaluations,
+    Invalidations,
+};
+
+// Самая долгая цепочка зависимостей за ячейкой: от самой ячейки до дальней
+// формулы, на которую она опирается. Время - сумма среднего собственного
+// времени вычисления формул цепочки.
+struct CriticalPath {
+    std::vector<Position> cells;
+    uint64_t time_ns = 0;
+};
+
+// Профилировщик формул таблицы. Пока он выключен, стоимость - одна проверка
+// флага на вычисление; во включённом режиме записи идут под мьютексом.
+class CellProfiler {
+public:
+    // Замеряет вычисление одной формулы на время своей жизни. Время
+    // вложенных вычислений в том же потоке вычитается из собственного.
+    class Evaluation {
+    public:
+        Evaluation(CellProfiler& profiler, Position pos);
+        ~Evaluation();
+
+        Evaluation(const Evaluation&) = delete;
+        Evaluation& operator=(const Evaluation&) = delete;
+
+    private:
+        CellProfiler& profiler_;
+        Position pos_;
+        uint64_t saved_children_ns_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    bool IsEnabled() const {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    void SetEnabled(bool enabled);
+    void Reset();
+
+    void RecordInvalidation(Position pos);
+
+    std::vector<CellProfile> GetProfile() const;
+    std::vector<CellProfile> GetTop(size_t count, ProfileOrder order) const;
+    std::optional<CellProfile> Find(Position pos) const;
+
+private:
+    void RecordEvaluation(Position pos, uint64_t self_ns, uint64_t inclusive_ns);
+
+    std::atomic<bool> enabled_ = false;
+    mutable std::mutex mutex_;
+    std::unordered_map<Position, CellProfile, PositionHasher> profiles_;
+};
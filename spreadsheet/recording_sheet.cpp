@@ -0,0 +1,101 @@
+#include "recording_sheet.h"
+
+#include <cctype>
+
+RecordingSheet::RecordingSheet(SheetInterface& sheet, std::ostream& log)
+    : RecordingSheet(sheet, log, Options{}) {
+}
+
+RecordingSheet::RecordingSheet(SheetInterface& sheet, std::ostream& log, Options options)
+    : sheet_(sheet)
+    , options_(options)
+    , writer_(log)
+    , last_op_(std::chrono::steady_clock::now()) {
+}
+
+void RecordingSheet::SetCell(Position pos, std::string text) {
+	Record(OpType::SetCell, pos, options_.anonymize ? Anonymize(text) : text);
+	sheet_.SetCell(pos, std::move(text));
+}
+
+const CellInterface* RecordingSheet::GetCell(Position pos) const {
+	return const_cast<RecordingSheet*>(this)->GetCell(pos);
+}
+
+CellInterface* RecordingSheet::GetCell(Position pos) {
+	if (sheet_.GetCell(pos) == nullptr) {
+		return nullptr;
+	}
+	std::lock_guard lock(mutex_);
+	return &cells_.try_emplace(pos, *this, pos).first->second;
+}
+
+void RecordingSheet::ClearCell(Position pos) {
+	Record(OpType::ClearCell, pos);
+	sheet_.ClearCell(pos);
+	std::lock_guard lock(mutex_);
+	cells_.erase(pos);
+}
+
+Size RecordingSheet::GetPrintableSize() const {
+	Record(OpType::GetPrintableSize);
+	return sheet_.GetPrintableSize();
+}
+
+void RecordingSheet::PrintValues(std::ostream& output) const {
+	Record(OpType::PrintValues);
+	sheet_.PrintValues(output);
+}
+
+void RecordingSheet::PrintTexts(std::ostream& output) const {
+	Record(OpType::PrintTexts);
+	sheet_.PrintTexts(output);
+}
+
+void RecordingSheet::Record(OpType type, Position pos, std::string_view text) const {
+	std::lock_guard lock(mutex_);
+	const auto now = std::chrono::steady_clock::now();
+	Op op;
+	op.type = type;
+	op.delta_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_op_).count();
+	op.pos = pos;
+	op.text = text;
+	writer_.Write(op);
+	last_op_ = now;
+}
+
+std::string RecordingSheet::Anonymize(std::string_view text) const {
+	if (text.size() > 1 && text.front() == FORMULA_SIGN && text[1] != ESCAPE_SIGN) {	//formulas hold only numbers and references
+		return std::string(text);
+	}
+	std::string result(text);
+	for (char& c : result) {
+		if (std::isalpha(static_cast<unsigned char>(c)) || static_cast<unsigned char>(c) >= 0x80) {
+			c = 'x';
+		}
+	}
+	return result;
+}
+
+//RecordingCell
+RecordingSheet::RecordingCell::RecordingCell(const RecordingSheet& sheet, Position pos)
+    : sheet_(sheet)
+    , pos_(pos) {
+}
+
+CellInterface::Value RecordingSheet::RecordingCell::GetValue() const {
+	sheet_.Record(OpType::GetValue, pos_);
+	const CellInterface* cell = sheet_.sheet_.GetCell(pos_);
+	return cell != nullptr ? cell->GetValue() : Value();
+}
+
+std::string RecordingSheet::RecordingCell::GetText() const {
+	sheet_.Record(OpType::GetText, pos_);
+	const CellInterface* cell = sheet_.sheet_.GetCell(pos_);
+	return cell != nullptr ? cell->GetText() : std::string();
+}
+
+std::vector<Position> RecordingSheet::RecordingCell::GetReferencedCells() const {
+	const CellInterface* cell = sheet_.sheet_.GetCell(pos_);
+	return cell != nullptr ? cell->GetReferencedCells() : std::vector<Position>();
+}
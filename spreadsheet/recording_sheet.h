@@ -0,0 +1,59 @@
+#pragma once
+
+#include "common.h"
+#include "oplog.h"
+
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+
+// Декоратор таблицы, который записывает в журнал (см. oplog.h) все вызовы
+// SetCell, ClearCell, GetPrintableSize, Print* и GetValue/GetText ячеек,
+// полученных через GetCell, а затем передаёт их исходной таблице. Журнал
+// воспроизводит spreadsheet_replay. Ячейка, полученная через GetCell,
+// действительна до очистки этой ячейки через ClearCell.
+class RecordingSheet : public SheetInterface {
+public:
+    struct Options {
+        // Заменяет буквы в текстовых ячейках на 'x', оставляя формулы,
+        // числа и длину текста, чтобы журналом можно было поделиться.
+        bool anonymize = false;
+    };
+
+    RecordingSheet(SheetInterface& sheet, std::ostream& log);
+    RecordingSheet(SheetInterface& sheet, std::ostream& log, Options options);
+
+    void SetCell(Position pos, std::string text) override;
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+    void ClearCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+private:
+    class RecordingCell : public CellInterface {
+    public:
+        RecordingCell(const RecordingSheet& sheet, Position pos);
+
+        Value GetValue() const override;
+        std::string GetText() const override;
+        std::vector<Position> GetReferencedCells() const override;
+
+    private:
+        const RecordingSheet& sheet_;
+        Position pos_;
+    };
+
+    void Record(OpType type, Position pos = Position::NONE, std::string_view text = {}) const;
+    std::string Anonymize(std::string_view text) const;
+
+    SheetInterface& sheet_;
+    Options options_;
+    mutable std::mutex mutex_;
+    mutable OpLogWriter writer_;
+    mutable std::chrono::steady_clock::time_point last_op_;
+    // Обёртки ячеек, выданные GetCell; ClearCell удаляет обёртку ячейки.
+    mutable std::unordered_map<Position, RecordingCell, PositionHasher> cells_;
+};
@@ -1,26 +1,100 @@
 #include "sheet.h"
 
+#include "workbook.h"
+
+#include <algorithm>
 #include <functional>
 #include <iostream>
 #include <optional>
+#include <shared_mutex>
 
 using namespace std::literals;
 
-Sheet::Sheet() {}
+const UniqCellPtr Sheet::NO_CELL;
+
+Sheet::Sheet()
+    : Sheet(nullptr, std::string()) {
+}
+
+Sheet::Sheet(Workbook* workbook, std::string name)
+    : workbook_(workbook)
+    , name_(std::move(name))
+    , strings_(memory_)
+    , formula_memory_(memory_, MemoryCategory::FormulaAst)
+    , column_indexes_(*this, memory_) {
+    for (Region& region : regions_) {
+        region.cells = CellMap(0, PositionHasher{}, std::equal_to<Position>{},
+                               CellMap::allocator_type(memory_, MemoryCategory::CellStorage));
+        region.dependents = DependentEdges(DependentEdges::allocator_type(memory_, MemoryCategory::DependencyGraph));
+    }
+}
+
 Sheet::~Sheet() {}
 
+const std::string& Sheet::GetName() const {
+    return name_;
+}
+
 void Sheet::SetCell(Position pos, std::string text) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position"s);
     }
+    TraceScope trace("Sheet::SetCell", pos);
+    ThreadStats& stats = stats_.Local();
+    stats.writes.Add();
+    ScopedLatency latency(stats.set_cell);
+    const auto versions_lock = versions_.LockWrites();
+    if (!concurrent_writes_) {
+        DoSetCell(pos, std::move(text));
+        return;
+    }
+
+    if (text.size() <= 1 || text.front() != FORMULA_SIGN) {
+        std::shared_lock graph_lock(graph_mutex_);
+        Region& region = GetRegion(pos);
+        std::lock_guard region_lock(region.mutex);
+        //Replacing a formula drops its edges in other regions
+        const Cell* cell = FindCell(pos);
+        const bool formula = cell != nullptr && cell->GetTypeCell() == TypeCell::FormulaImpl;
+        if (!formula && !HasDependents(pos) && !column_indexes_.HasRangeDependents(pos)) {
+            DoSetCell(pos, std::move(text));
+            return;
+        }
+    }
+    std::unique_lock graph_lock(graph_mutex_);
+    DoSetCell(pos, std::move(text));
+}
+
+void Sheet::DoSetCell(Position pos, std::string text) {
     CellBuilder cb(this, pos);
-    UniqCellPtr cell = cb.CreateCell(text);
+    PlaceCell(pos, cb.CreateCell(text));
+}
+
+void Sheet::PlaceCell(Position pos, UniqCellPtr cell) {
+    Cell* new_cell = cell.get();
 
-    if (sheet_.count(pos)) {
-        dynamic_cast<Cell*>(sheet_.at(pos).get())->InvalidateCache();
+    auto& cells = GetRegion(pos).cells;
+    if (auto it = cells.find(pos); it != cells.end()) {
+        {
+            TraceScope trace("InvalidateDepended", pos);
+            InvalidateDependents(pos);
+        }
+        column_indexes_.Update(pos, it->second.get(), new_cell);
+        if (it->second->GetTypeCell() == TypeCell::FormulaImpl) {
+            EraseDependents(pos, *it->second, new_cell);
+        }
+        it->second = std::move(cell);
+    }
+    else {
+        column_indexes_.Update(pos, nullptr, new_cell);
+        cells.emplace(pos, std::move(cell));
+        ++cells_count_;
+        //Formulas may reference the cell while it is missing
+        InvalidateDependents(pos);
+        RebindDependents(pos);
     }
 
-    sheet_.insert_or_assign(pos, std::move(cell));
+    versions_.Write(pos, MakeVersionedCell(*new_cell));
     IncreasePrintArea(pos);
 }
 
@@ -32,22 +106,506 @@ CellInterface* Sheet::GetCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position"s);
     }
-    if (sheet_.count(pos)) {
-        return sheet_.at(pos).get();
+    if (concurrent_writes_) {
+        std::lock_guard region_lock(GetRegion(pos).mutex);
+        return FindCell(pos);
+    }
+    return FindCell(pos);
+}
+
+Cell* Sheet::FindCell(Position pos) const {
+    const auto& cells = GetRegion(pos).cells;
+    if (auto it = cells.find(pos); it != cells.end()) {
+        return it->second.get();
     }
     return nullptr;
 }
 
+std::optional<int> Sheet::FindInColumn(const CellRange& range, const LookupKey& key, LookupMode mode) const {
+    LookupSearch search(key, mode);
+    column_indexes_.Find(range, key, mode, search);
+    return search.GetIndex();
+}
+
+void Sheet::AddDependent(Position pos, Dependent dependent) {
+    GetRegion(pos).dependents.insert({ pos, dependent });
+}
+
+void Sheet::EraseDependents(Position pos, const Cell& old_cell, const Cell* new_cell) {
+    //The new formula has added its edges before it replaces the old one. Both lists are sorted
+    const std::vector<Position> kept = new_cell != nullptr ? new_cell->GetReferencedCells() : std::vector<Position>();
+    for (Position cell_pos : old_cell.GetReferencedCells()) {
+        if (!std::binary_search(kept.begin(), kept.end(), cell_pos)) {
+            EraseDependent(cell_pos, { this, pos });
+        }
+    }
+    const std::vector<SheetPosition> kept_sheet_cells = new_cell != nullptr ? new_cell->GetReferencedSheetCells()
+                                                                            : std::vector<SheetPosition>();
+    for (const auto& sheet_pos : old_cell.GetReferencedSheetCells()) {
+        Sheet* target = GetWorkbookSheet(sheet_pos.sheet);
+        if (target != nullptr && !std::binary_search(kept_sheet_cells.begin(), kept_sheet_cells.end(), sheet_pos)) {
+            target->EraseDependent(sheet_pos.pos, { this, pos });
+        }
+    }
+}
+
+void Sheet::EraseDependent(Position pos, Dependent dependent) {
+    GetRegion(pos).dependents.erase({ pos, dependent });
+    //An empty cell without dependents is erased, so the cells created for references don't pile up
+    const Cell* cell = FindCell(pos);
+    if (cell != nullptr && cell->GetTypeCell() == TypeCell::EmptyImpl && !HasDependents(pos)) {
+        DoClearCell(pos);
+    }
+}
+
+void Sheet::RebindDependents(Position pos) {
+    const CellSlot slot = GetCellSlot(pos);
+    const auto [begin, end] = GetRegion(pos).dependents.equal_range(pos);
+    for (auto it = begin; it != end; ++it) {
+        //Formulas of other sheets find the cell by its position
+        if (it->dependent.sheet == this) {
+            if (Cell* cell = FindCell(it->dependent.pos)) {
+                cell->RebindCell(pos, slot);
+            }
+        }
+    }
+}
+
+bool Sheet::HasDependents(Position pos) const {
+    const auto& dependents = GetRegion(pos).dependents;
+    return dependents.find(pos) != dependents.end();
+}
+
+void Sheet::InvalidateDependents(Position pos) const {
+    const auto [begin, end] = GetRegion(pos).dependents.equal_range(pos);
+    for (auto it = begin; it != end; ++it) {
+        const auto& [sheet, dependent] = it->dependent;
+        CellInterface* cell = const_cast<Sheet*>(sheet)->GetCell(dependent);
+        if (cell != nullptr) {  //the dependent cell has been cleared
+            static_cast<Cell*>(cell)->InvalidateCache();
+        }
+    }
+    InvalidateRangeDependents(pos);
+}
+
+void Sheet::RelocateDependents(const Sheet* edited, const StructureEdit& edit) {
+    //Moved edges are put back once all regions are walked, they may change their region
+    std::vector<DependentEdges::node_type> moved;
+    for (Region& region : regions_) {
+        for (auto it = region.dependents.begin(); it != region.dependents.end();) {
+            const std::optional<Position> pos = edited == this ? edit.Map(it->pos) : it->pos;
+            const std::optional<Position> dependent = it->dependent.sheet == edited ? edit.Map(it->dependent.pos)
+                                                                                    : it->dependent.pos;
+            if (pos && dependent && *pos == it->pos && *dependent == it->dependent.pos) {
+                ++it;
+                continue;
+            }
+            auto node = region.dependents.extract(it++);
+            if (pos && dependent) {
+                node.value().pos = *pos;
+                node.value().dependent.pos = *dependent;
+                moved.push_back(std::move(node));
+            }
+        }
+    }
+    for (auto& node : moved) {
+        GetRegion(node.value().pos).dependents.insert(std::move(node));
+    }
+}
+
+void Sheet::InvalidateRangeDependents(Position pos) const {
+    if (!column_indexes_.HasRangeDependents()) {
+        return;
+    }
+    for (Position dependent : column_indexes_.GetRangeDependents(pos)) {
+        if (Cell* cell = FindCell(dependent)) {
+            cell->InvalidateCache();
+        }
+    }
+}
+
+CellSlot Sheet::GetCellSlot(Position pos) const {
+    const auto& cells = GetRegion(pos).cells;
+    auto it = cells.find(pos);
+    return it != cells.end() ? &it->second : &NO_CELL;  //Nodes of unordered_map keep their address on rehash
+}
+
+Sheet::Region& Sheet::GetRegion(Position pos) const {
+    const int row_block = pos.row / REGION_SIZE;
+    const int col_block = pos.col / REGION_SIZE;
+    return regions_[(row_block * 131 + col_block) % REGION_COUNT];
+}
+
+SheetStats Sheet::GetStats() const {
+    return stats_.GetStats();
+}
+
+void Sheet::ResetStats() {
+    stats_.Reset();
+}
+
+ThreadStats& Sheet::GetThreadStats() const {
+    return stats_.Local();
+}
+
+void Sheet::SetProfiling(bool enabled) {
+    profiler_.SetEnabled(enabled);
+}
+
+void Sheet::ResetProfile() {
+    profiler_.Reset();
+}
+
+std::vector<CellProfile> Sheet::GetProfile() const {
+    return profiler_.GetProfile();
+}
+
+std::vector<CellProfile> Sheet::GetTopCells(size_t count, ProfileOrder order) const {
+    return profiler_.GetTop(count, order);
+}
+
+CriticalPath Sheet::GetCriticalPath(Position pos) const {
+    struct Step {
+        uint64_t time_ns = 0;
+        Position next = Position::NONE;
+    };
+    std::unordered_map<Position, Step, PositionHasher> steps;
+
+    //The dependency graph is acyclic, so the longest path is found by memoized depth-first search.
+    //The search is iterative: a chain of formulas may be as long as the sheet
+    struct Frame {
+        Position pos;
+        std::vector<Position> next;
+        size_t index = 0;
+        uint64_t self_ns = 0;
+    };
+    std::vector<Frame> frames;
+    auto enter = [&](Position current) {
+        steps.emplace(current, Step());
+        Frame frame{ current, {}, 0, 0 };
+        const CellInterface* cell = FindCell(current);
+        const std::optional<CellProfile> profile = profiler_.Find(current);
+        if (cell != nullptr && profile.has_value() && profile->evaluations != 0) {
+            frame.next = cell->GetReferencedCells();
+            frame.self_ns = profile->self_ns / profile->evaluations;
+        }
+        frames.push_back(std::move(frame));
+    };
+
+    enter(pos);
+    while (!frames.empty()) {
+        Frame& frame = frames.back();
+        if (frame.index == frame.next.size()) {
+            steps[frame.pos].time_ns += frame.self_ns;
+            frames.pop_back();
+            continue;
+        }
+        const Position referenced = frame.next[frame.index];
+        auto it = steps.find(referenced);
+        if (it == steps.end()) {
+            enter(referenced);  //The frame is revisited once the referenced cell is done
+            continue;
+        }
+        Step& step = steps[frame.pos];
+        if (step.next == Position::NONE || it->second.time_ns > step.time_ns) {
+            step.time_ns = it->second.time_ns;
+            step.next = referenced;
+        }
+        ++frame.index;
+    }
+
+    CriticalPath path;
+    path.time_ns = steps[pos].time_ns;
+    for (Position current = pos; !(current == Position::NONE); current = steps[current].next) {
+        const std::optional<CellProfile> profile = profiler_.Find(current);
+        if (!profile.has_value() || profile->evaluations == 0) {
+            break;
+        }
+        path.cells.push_back(current);
+    }
+    return path;
+}
+
+CellProfiler& Sheet::GetProfiler() const {
+    return profiler_;
+}
+
+SheetMemoryUsage Sheet::MemoryUsage() const {
+    return memory_.GetUsage();
+}
+
+MemoryTracker& Sheet::GetMemoryTracker() const {
+    return memory_;
+}
+
+StringPool& Sheet::GetStringPool() const {
+    return strings_;
+}
+
+SharedMemoryCounter& Sheet::GetFormulaMemory() const {
+    return formula_memory_;
+}
+
+void Sheet::SetConcurrentWrites(bool enabled) {
+    concurrent_writes_ = enabled;
+}
+
+void Sheet::SetDeferredParsing(bool enabled) {
+    deferred_parsing_ = enabled;
+}
+
+std::future<void> Sheet::WarmUp() {
+    std::vector<std::shared_ptr<const FormulaInterface>> formulas;
+    {
+        std::shared_lock graph_lock(graph_mutex_);  //Formula writes hold the graph lock exclusively
+        for (Region& region : regions_) {
+            std::lock_guard region_lock(region.mutex);
+            for (const auto& [pos, cell] : region.cells) {
+                if (auto formula = cell->GetFormula()) {
+                    formulas.push_back(std::move(formula));
+                }
+            }
+        }
+    }
+    return std::async(std::launch::async, [formulas = std::move(formulas)] {
+        TraceScope trace("Sheet::WarmUp");
+        for (const auto& formula : formulas) {
+            formula->EnsureParsed();
+        }
+    });
+}
+
+void Sheet::FillRange(Position source, const CellRange& target) {
+    if (!source.IsValid() || !target.from.IsValid() || !target.to.IsValid()
+        || target.from.row > target.to.row || target.from.col > target.to.col) {
+        throw InvalidPositionException("Invalid position"s);
+    }
+    TraceScope trace("Sheet::FillRange", source);
+    ThreadStats& stats = stats_.Local();
+    stats.writes.Add(static_cast<uint64_t>(target.GetRows()) * target.GetCols());
+    const auto versions_lock = versions_.LockWrites();
+    std::unique_lock graph_lock(graph_mutex_, std::defer_lock);
+    if (concurrent_writes_) {
+        graph_lock.lock();
+    }
+
+    const Cell* cell = FindCell(source);
+    std::shared_ptr<const FormulaInterface> formula = cell != nullptr ? cell->GetFormula() : nullptr;
+    if (formula == nullptr) {
+        const std::string text = cell != nullptr ? cell->GetText() : std::string();
+        for (int row = target.from.row; row <= target.to.row; ++row) {
+            for (int col = target.from.col; col <= target.to.col; ++col) {
+                if (text.empty()) {
+                    DoClearCell({ row, col });
+                }
+                else {
+                    DoSetCell({ row, col }, text);
+                }
+            }
+        }
+        return;
+    }
+
+    CellBuilder::BlockFormulas formulas;
+    formulas.reserve(static_cast<size_t>(target.GetRows()) * target.GetCols());
+    for (int row = target.from.row; row <= target.to.row; ++row) {
+        for (int col = target.from.col; col <= target.to.col; ++col) {
+            if (row == source.row && col == source.col) {
+                formulas.push_back(formula);
+            }
+            else {
+                formulas.push_back(formula->Shift(row - source.row, col - source.col));
+            }
+        }
+    }
+    CellBuilder cb(this, target.from);
+    std::vector<UniqCellPtr> cells = cb.CreateCells(target, formulas);
+    auto it = cells.begin();
+    for (int row = target.from.row; row <= target.to.row; ++row) {
+        for (int col = target.from.col; col <= target.to.col; ++col) {
+            PlaceCell({ row, col }, std::move(*it++));
+        }
+    }
+}
+
+void Sheet::InsertRows(int row, int count) {
+    EditStructure({ StructureEdit::Axis::Rows, true, row, count });
+}
+
+void Sheet::DeleteRows(int row, int count) {
+    EditStructure({ StructureEdit::Axis::Rows, false, row, count });
+}
+
+void Sheet::InsertCols(int col, int count) {
+    EditStructure({ StructureEdit::Axis::Cols, true, col, count });
+}
+
+void Sheet::DeleteCols(int col, int count) {
+    EditStructure({ StructureEdit::Axis::Cols, false, col, count });
+}
+
+void Sheet::EditStructure(StructureEdit edit) {
+    const int lines = edit.axis == StructureEdit::Axis::Rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    if (edit.first < 0 || edit.first >= lines || edit.count < 0) {
+        throw InvalidPositionException("Invalid position"s);
+    }
+    edit.count = std::min(edit.count, lines - edit.first);
+    if (edit.count == 0) {
+        return;
+    }
+    TraceScope trace("Sheet::EditStructure");
+    //Formulas of the other sheets are relocated as a part of the edit. Their write locks are
+    //taken in the order of addresses, so that concurrent edits of different sheets don't deadlock
+    std::vector<Sheet*> other_sheets;
+    if (workbook_ != nullptr) {
+        for (const auto& name : workbook_->GetSheetNames()) {
+            if (Sheet* sheet = workbook_->GetSheet(name); sheet != this) {
+                other_sheets.push_back(sheet);
+            }
+        }
+    }
+    std::vector<Sheet*> locked_sheets = other_sheets;
+    locked_sheets.push_back(this);
+    std::sort(locked_sheets.begin(), locked_sheets.end(), std::less<Sheet*>());
+    std::vector<SheetVersions::WriteLock> versions_locks;
+    for (Sheet* sheet : locked_sheets) {
+        versions_locks.push_back(sheet->versions_.LockWrites());
+    }
+    std::unique_lock graph_lock(graph_mutex_, std::defer_lock);
+    if (concurrent_writes_) {
+        graph_lock.lock();
+    }
+    if (edit.insert) {
+        ForEachCell([&edit](Position pos, const CellInterface& /* cell */) {
+            if (!edit.Map(pos)) {
+                throw InvalidPositionException("Cells would be shifted off the sheet"s);
+            }
+        });
+    }
+
+    //Moved cells keep their map nodes, so the slots bound to them stay valid. Deleted cells
+    //live until the formulas that reference them are rebound.
+    std::vector<CellMap::node_type> moved;
+    std::vector<CellMap::node_type> deleted;
+    for (Region& region : regions_) {
+        for (auto it = region.cells.begin(); it != region.cells.end();) {
+            const Position pos = it->first;
+            const std::optional<Position> target = edit.Map(pos);
+            if (target && *target == pos) {
+                ++it;
+                continue;
+            }
+            versions_.Erase(pos);
+            (target ? moved : deleted).push_back(region.cells.extract(it++));
+        }
+    }
+    for (auto& node : moved) {
+        const Position pos = *edit.Map(node.key());
+        node.key() = pos;
+        node.mapped()->SetPosition(pos);
+        versions_.Write(pos, MakeVersionedCell(*node.mapped()));
+        GetRegion(pos).cells.insert(std::move(node));
+    }
+    cells_count_ -= deleted.size();
+
+    for (Sheet* sheet : other_sheets) {
+        sheet->RelocateDependents(this, edit);
+    }
+    RelocateDependents(this, edit);
+    //Range dependents are stored with the ranges as they are after the edit
+    column_indexes_.Clear();
+    std::vector<std::pair<Position, std::shared_ptr<const FormulaInterface>>> formulas;
+    for (Region& region : regions_) {
+        for (auto& [pos, cell] : region.cells) {
+            if (auto formula = cell->GetFormula()) {
+                column_indexes_.Update(pos, nullptr, cell.get());
+                for (const auto& range : formula->GetReferencedRanges()) {
+                    if (auto moved_range = edit.Map(range)) {
+                        column_indexes_.AddRangeDependent(*moved_range, pos);
+                    }
+                }
+                formulas.emplace_back(pos, std::move(formula));
+            }
+        }
+    }
+
+    //Only the formulas whose references change are copied; placing them invalidates their dependents
+    for (auto& [pos, formula] : formulas) {
+        if (auto relocated = formula->Relocate(edit, name_, true)) {
+            CellBuilder cb(this, pos);
+            PlaceCell(pos, cb.CreateRelocatedCell(std::move(relocated)));
+        }
+    }
+    for (Sheet* sheet : other_sheets) {
+        formulas.clear();
+        for (Region& region : sheet->regions_) {
+            for (auto& [pos, cell] : region.cells) {
+                if (auto formula = cell->GetFormula()) {
+                    if (auto relocated = formula->Relocate(edit, name_, false)) {
+                        formulas.emplace_back(pos, std::move(relocated));
+                    }
+                }
+            }
+        }
+        for (auto& [pos, formula] : formulas) {
+            CellBuilder cb(sheet, pos);
+            sheet->PlaceCell(pos, cb.CreateRelocatedCell(std::move(formula)));
+        }
+    }
+    deleted.clear();
+
+    min_print_area_.rows = 0;
+    min_print_area_.cols = 0;
+    ForEachCell([this](Position pos, const CellInterface& /* cell */) {
+        IncreasePrintArea(pos);
+    });
+    profiler_.Reset();  //Profiles are kept by position
+}
+
+void Sheet::SetFormulaCacheCapacity(size_t capacity) {
+    formula_cache_.SetCapacity(capacity);
+}
+
+FormulaCacheStats Sheet::GetFormulaCacheStats() const {
+    return formula_cache_.GetStats();
+}
+
 void Sheet::ClearCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position"s);
     }
+    const auto versions_lock = versions_.LockWrites();
+    if (!concurrent_writes_) {
+        DoClearCell(pos);
+        return;
+    }
+    std::unique_lock graph_lock(graph_mutex_);
+    DoClearCell(pos);
+}
 
-    if (!sheet_.count(pos)) {
+void Sheet::DoClearCell(Position pos) {
+    auto& cells = GetRegion(pos).cells;
+    auto it = cells.find(pos);
+    if (it == cells.end()) {
         return;
     }
-    sheet_.erase(pos);
+    Cell* cell = it->second.get();
+    {
+        TraceScope trace("InvalidateDepended", pos);
+        InvalidateDependents(pos);
+    }
+    if (cell->GetTypeCell() == TypeCell::FormulaImpl) {
+        EraseDependents(pos, *cell, nullptr);
+    }
+    column_indexes_.Update(pos, cell, nullptr);
+    cells.erase(it);
+    --cells_count_;
+    RebindDependents(pos);
+    versions_.Erase(pos);
+    DecreasePrintArea(pos);
+}
 
+void Sheet::DecreasePrintArea(Position pos) {
     if (pos.col < (min_print_area_.cols - 1) && (pos.row < min_print_area_.rows - 1)) { //Don't change print area
         return;
     }
@@ -62,22 +620,55 @@ void Sheet::ClearCell(Position pos) {
         DecreasePrintAreaCol(pos);
     }
 
-    if (sheet_.empty()) {
-        min_print_area_ = { 0, 0 };
+    if (cells_count_ == 0) {
+        min_print_area_.rows = 0;
+        min_print_area_.cols = 0;
     }
 }
 
 Size Sheet::GetPrintableSize() const {
-    return min_print_area_;
+    return { min_print_area_.rows, min_print_area_.cols };
+}
+
+const SheetInterface* Sheet::FindSheet(std::string_view name) const {
+    return GetWorkbookSheet(name);
+}
+
+Sheet* Sheet::GetWorkbookSheet(std::string_view name) const {
+    return workbook_ != nullptr ? workbook_->GetSheet(name) : nullptr;
+}
+
+std::set<std::string> Sheet::GetReferencedSheets() const {
+    std::set<std::string> result;
+    for (const Region& region : regions_) {
+        for (const auto& [pos, cell] : region.cells) {
+            for (auto& sheet_pos : cell->GetReferencedSheetCells()) {
+                result.insert(std::move(sheet_pos.sheet));
+            }
+        }
+    }
+    return result;
+}
+
+void Sheet::Recalculate() {
+    TraceScope trace("Sheet::Recalculate");
+    for (Region& region : regions_) {
+        for (const auto& [pos, cell] : region.cells) {
+            if (cell->GetTypeCell() == TypeCell::FormulaImpl) {
+                cell->GetValue();
+            }
+        }
+    }
 }
 
 void Sheet::PrintValue(std::ostream& output, Position pos) const {
-    if (!sheet_.count(pos)) {
+    const CellInterface* cell = FindCell(pos);
+    if (cell == nullptr) {
         output << ""s;
         return;
     }
 
-    auto value = sheet_.at(pos).get()->GetValue();
+    auto value = cell->GetValue();
     if (IsType<std::string>(value)) {
         output << std::get<std::string>(value);
     }
@@ -90,9 +681,10 @@ void Sheet::PrintValue(std::ostream& output, Position pos) const {
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
-    for (int i = 0; i < min_print_area_.rows; ++i) {
+    const Size size = GetPrintableSize();
+    for (int i = 0; i < size.rows; ++i) {
         bool is_start = true;
-        for (int j = 0; j < min_print_area_.cols; ++j) {
+        for (int j = 0; j < size.cols; ++j) {
             Position pos{ i, j };
             if (is_start) {
                 PrintValue(output, pos);
@@ -107,18 +699,26 @@ void Sheet::PrintValues(std::ostream& output) const {
     }
 }
 
+void Sheet::PrintText(std::ostream& output, Position pos) const {
+    //All cells of the sheet are created by CellBuilder
+    if (const Cell* cell = FindCell(pos)) {
+        output << cell->GetTextView();
+    }
+}
+
 void Sheet::PrintTexts(std::ostream& output) const {
-    for (int i = 0; i < min_print_area_.rows; ++i) {
+    const Size size = GetPrintableSize();
+    for (int i = 0; i < size.rows; ++i) {
         bool is_start = true;
-        for (int j = 0; j < min_print_area_.cols; ++j) {
+        for (int j = 0; j < size.cols; ++j) {
             Position pos{ i, j };
             if (is_start) {
-                output << (sheet_.count(pos) ? (sheet_.at(pos).get()->GetText()) : ""s);
+                PrintText(output, pos);
                 is_start = false;
             }
             else {
                 output << '\t';
-                output << (sheet_.count(pos) ? (sheet_.at(pos).get()->GetText()) : ""s);
+                PrintText(output, pos);
             }
         }
         output << '\n';
@@ -126,23 +726,21 @@ void Sheet::PrintTexts(std::ostream& output) const {
 }
 
 void Sheet::IncreasePrintArea(Position pos) {
-    if (pos.row >= min_print_area_.rows && pos.col >= min_print_area_.cols) {
-        min_print_area_ = { ++pos.row, ++pos.col };
-    }
-    else if (pos.row < min_print_area_.rows && pos.col >= min_print_area_.cols) {
-        min_print_area_.cols = ++pos.col;
-    }
-    else if (pos.row >= min_print_area_.rows && pos.col < min_print_area_.cols) {
-        min_print_area_.rows = ++pos.row;
-    }
+    auto increase = [](std::atomic<int>& bound, int value) {
+        int current = bound.load();
+        while (current < value && !bound.compare_exchange_weak(current, value)) {
+        }
+    };
+    increase(min_print_area_.rows, pos.row + 1);
+    increase(min_print_area_.cols, pos.col + 1);
 }
 
 void Sheet::DecreasePrintAreaRow(Position pos) {
-    if (sheet_.empty()) {
+    if (cells_count_ == 0) {
         return;
     }
     for (int i = 0; i < min_print_area_.cols; ++i) {
-        if (sheet_.count({ pos.row, i })) {
+        if (FindCell({ pos.row, i }) != nullptr) {
             return;
         }
     }
@@ -151,11 +749,11 @@ void Sheet::DecreasePrintAreaRow(Position pos) {
 }
 
 void Sheet::DecreasePrintAreaCol(Position pos) {
-    if (sheet_.empty()) {
+    if (cells_count_ == 0) {
         return;
     }
     for (int i = 0; i < min_print_area_.rows; ++i) {
-        if (sheet_.count({ i, pos.col })) {
+        if (FindCell({ i, pos.col }) != nullptr) {
             return;
         }
     }
@@ -163,6 +761,21 @@ void Sheet::DecreasePrintAreaCol(Position pos) {
     DecreasePrintAreaCol(Position{ pos.row, --pos.col });
 }
 
+std::unique_ptr<SheetSnapshot> Sheet::Snapshot() const {
+    return std::make_unique<SheetSnapshot>(versions_.Publish([this] {
+        return GetPrintableSize();
+    }));
+}
+
+VersionedCell Sheet::MakeVersionedCell(const Cell& cell) {
+    VersionedCell version;
+    version.formula = cell.GetFormula();
+    if (version.formula == nullptr) {
+        version.text = CompactText(cell.GetTextView());
+    }
+    return version;
+}
+
 std::unique_ptr<SheetInterface> CreateSheet() {
     return std::make_unique<Sheet>();
 }
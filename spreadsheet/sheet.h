@@ -1,24 +1,78 @@
 #pragma once
 
 #include "cell.h"
+#include "column_index.h"
 #include "common.h"
+#include "formula_cache.h"
+#include "memory_usage.h"
+#include "profiler.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "string_pool.h"
 
+#include <array>
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string_view>
 #include <unordered_map>
 
-using UniqCellPtr = std::unique_ptr<CellInterface>;
+class Cell;
+class Sheet;
+class Workbook;
+using UniqCellPtr = std::unique_ptr<Cell>;
 
-struct SheetHasher {
-    uint64_t operator()(Position pos) const {
-        return pos.row + pos.col;
+// Формула, которая ссылается на ячейку: лист формулы и её позиция.
+struct Dependent {
+    const Sheet* sheet;
+    Position pos;
+};
+
+// Ребро графа зависимостей: ячейка pos и формула, которая на неё ссылается.
+// Рёбра упорядочены по ячейке, поэтому все зависимые одной ячейки лежат
+// подряд и ищутся по одной позиции.
+struct DependentEdge {
+    Position pos;
+    Dependent dependent;
+};
+
+//Keys of positions on the sheet are ordered like the positions themselves and compare inline
+struct DependentEdgeLess {
+    using is_transparent = void;
+
+    bool operator()(const DependentEdge& lhs, const DependentEdge& rhs) const {
+        if (lhs.pos.GetKey() != rhs.pos.GetKey()) {
+            return lhs.pos.GetKey() < rhs.pos.GetKey();
+        }
+        if (lhs.dependent.sheet != rhs.dependent.sheet) {
+            return std::less<const Sheet*>{}(lhs.dependent.sheet, rhs.dependent.sheet);
+        }
+        return lhs.dependent.pos.GetKey() < rhs.dependent.pos.GetKey();
+    }
+    bool operator()(const DependentEdge& lhs, Position rhs) const {
+        return lhs.pos.GetKey() < rhs.GetKey();
+    }
+    bool operator()(Position lhs, const DependentEdge& rhs) const {
+        return lhs.GetKey() < rhs.pos.GetKey();
     }
 };
 
-class Sheet : public SheetInterface {
+using DependentEdges = std::set<DependentEdge, DependentEdgeLess, TrackingAllocator<DependentEdge>>;
+
+class Sheet final : public SheetInterface {
 public:
+    friend class Cell;
+    friend class CellBuilder;
+    friend class ColumnIndexes;
 
     Sheet();
+    Sheet(Workbook* workbook, std::string name);
     ~Sheet();
 
+    const std::string& GetName() const;
+
     void SetCell(Position pos, std::string text) override;
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
@@ -28,17 +82,232 @@ public:
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
     void PrintValue(std::ostream& output, Position pos) const;
+    void PrintText(std::ostream& output, Position pos) const;
+    const SheetInterface* FindSheet(std::string_view name) const override;
+    std::optional<int> FindInColumn(const CellRange& range, const LookupKey& key, LookupMode mode) const override;
+
+    // Возвращает лист той же книги с указанным именем либо nullptr.
+    Sheet* GetWorkbookSheet(std::string_view name) const;
+
+    // Вызывает f(pos, cell) для каждой хранимой ячейки в произвольном порядке.
+    template <typename F>
+    void ForEachCell(F&& f) const;
+
+    // Возвращает имена листов, на ячейки которых ссылаются формулы этого листа.
+    std::set<std::string> GetReferencedSheets() const;
+
+    // Вычисляет значения всех формул, кеш которых был сброшен записью.
+    void Recalculate();
+
+    // Возвращает неизменяемый снимок текущего состояния таблицы. Снимок можно
+    // читать из другого потока, пока в таблицу продолжается запись. Создание
+    // снимка дожидается начатых операций записи, поэтому каждая из них
+    // попадает в снимок целиком или не попадает совсем.
+    std::unique_ptr<SheetSnapshot> Snapshot() const;
+
+    // Включает режим параллельной записи. Ячейки разбиты на регионы
+    // REGION_SIZE x REGION_SIZE со своими мьютексами, и запись текста в разные
+    // регионы идёт параллельно. Порядок блокировок:
+    // * запись текста в ячейку без зависимых - граф зависимостей в разделяемом
+    //   режиме, затем мьютекс региона;
+    // * запись формулы, запись в ячейку, от которой зависят другие, и очистка
+    //   ячейки - граф зависимостей в монопольном режиме, регионы не
+    //   блокируются. Так проверка циклов всегда видит согласованный граф.
+    // Пока режим включён, каждый поток должен читать через GetCell() только
+    // свои регионы; согласованное чтение всей таблицы - через Snapshot().
+    // Переключать режим можно только когда таблицу никто не использует.
+    void SetConcurrentWrites(bool enabled);
+
+    // Режим загрузки: формулы, записываемые через SetCell, только проверяются
+    // быстрым сканером, а дерево строится при первом вычислении или в
+    // WarmUp(). Ссылки формул сканер находит сразу, поэтому граф зависимостей
+    // и проверка циклов работают как обычно. По умолчанию выключен.
+    void SetDeferredParsing(bool enabled);
+
+    // Строит в фоновом потоке деревья формул, разбор которых был отложен.
+    // Список формул собирается при вызове, после чего таблицу можно читать и
+    // изменять; формулы, к которым обратятся раньше, разбираются при обращении.
+    std::future<void> WarmUp();
+
+    // Заполняет ячейки target содержимым ячейки source, как при копировании:
+    // ссылки формулы сдвигаются на смещение каждой ячейки от source (см.
+    // FormulaInterface::Shift), текст копируется как есть, пустая ячейка
+    // очищает target. Формулы не разбираются заново, а циклы проверяются
+    // один раз для всего блока; при цикле бросает
+    // CircularDependencyException и лист не меняется.
+    void FillRange(Position source, const CellRange& target);
+
+    // Вставляет count пустых строк перед строкой row (столбцов перед col)
+    // либо удаляет count строк начиная с row (столбцов начиная с col).
+    // Ячейки за ними сдвигаются целиком, без копирования. Ссылки формул
+    // листа и формул других листов книги на него переносятся в готовых
+    // деревьях без повторного разбора (см. FormulaInterface::Relocate):
+    // ссылки на удалённые ячейки становятся #REF!, диапазоны растягиваются
+    // и сжимаются. Если вставка вытеснила бы ячейки за границу листа,
+    // бросает InvalidPositionException и лист не меняется.
+    void InsertRows(int row, int count = 1);
+    void DeleteRows(int row, int count = 1);
+    void InsertCols(int col, int count = 1);
+    void DeleteCols(int col, int count = 1);
+
+    // Кеш разобранных формул листа: одинаковые выражения разбираются один
+    // раз и разделяют дерево. Ёмкость 0 выключает кеш.
+    void SetFormulaCacheCapacity(size_t capacity);
+    FormulaCacheStats GetFormulaCacheStats() const;
+
+    // Счётчики производительности таблицы: разбор формул, проверка циклов,
+    // сброс кеша, попадания в кеш, перцентили задержек SetCell и GetValue.
+    // Каждый поток пишет в свои счётчики, поэтому GetStats() можно вызывать
+    // в любой момент из любого потока.
+    SheetStats GetStats() const;
+    void ResetStats();
+
+    // Счётчики текущего потока для этой таблицы.
+    ThreadStats& GetThreadStats() const;
+
+    // Профилирование формул: число вычислений и сбросов кеша, собственное и
+    // инклюзивное время каждой формулы. По умолчанию выключено.
+    void SetProfiling(bool enabled);
+    void ResetProfile();
+    std::vector<CellProfile> GetProfile() const;
+    std::vector<CellProfile> GetTopCells(size_t count, ProfileOrder order = ProfileOrder::SelfTime) const;
+
+    // Возвращает самую долгую по среднему собственному времени цепочку формул
+    // этого листа, от которых зависит значение ячейки pos.
+    CriticalPath GetCriticalPath(Position pos) const;
+
+    CellProfiler& GetProfiler() const;
+
+    // Возвращает память, которую занимают ячейки листа, по категориям.
+    // Снимки и счётчики производительности не учитываются.
+    SheetMemoryUsage MemoryUsage() const;
+
+    MemoryTracker& GetMemoryTracker() const;
+    // Словарь текстов ячеек листа.
+    StringPool& GetStringPool() const;
+    // Счётчик памяти деревьев формул: формулу разделяют ячейки, у которых
+    // одинаковое выражение, а её память учитывается один раз.
+    SharedMemoryCounter& GetFormulaMemory() const;
+
+    static const int REGION_SIZE = 64;
 
 private:
+    static const int REGION_COUNT = 256;
+
+    using CellMap = std::unordered_map<Position, UniqCellPtr, PositionHasher, std::equal_to<Position>,
+                                       TrackingAllocator<std::pair<const Position, UniqCellPtr>>>;
+
+    struct Region {
+        std::mutex mutex;
+        CellMap cells;
+        // Формулы, которые ссылаются на ячейки региона, в том числе на
+        // очищенные. Рёбра формулы удаляются, когда её ячейку изменяют или
+        // очищают.
+        DependentEdges dependents;
+    };
+
+    struct AtomicSize {
+        std::atomic<int> rows = 0;
+        std::atomic<int> cols = 0;
+    };
+
+    // Место отсутствующей ячейки: к нему привязаны ссылки формул на
+    // очищенные ячейки, пока ячейку не создадут снова.
+    static const UniqCellPtr NO_CELL;
+
+    Region& GetRegion(Position pos) const;
+    // Вызывает f(pos, cell) для каждой ячейки столбца col. В режиме
+    // параллельной записи f вызывается под мьютексом региона ячейки.
+    template <typename F>
+    void ForEachCellInColumn(int col, F&& f) const;
+    Cell* FindCell(Position pos) const;
+    CellSlot GetCellSlot(Position pos) const;
+    void DoSetCell(Position pos, std::string text);
+    // Ставит cell на место pos, сбрасывая кеш зависимых от прежней ячейки.
+    void PlaceCell(Position pos, UniqCellPtr cell);
+    void DoClearCell(Position pos);
+    void EditStructure(StructureEdit edit);
+    // Запоминает, что формула dependent ссылается на ячейку pos.
+    void AddDependent(Position pos, Dependent dependent);
+    // Забывает рёбра прежней формулы old_cell ячейки pos к ячейкам, на
+    // которые не ссылается новая ячейка new_cell (nullptr - ячейки нет).
+    // Пустые ячейки, на которые больше никто не ссылается, удаляются.
+    void EraseDependents(Position pos, const Cell& old_cell, const Cell* new_cell);
+    void EraseDependent(Position pos, Dependent dependent);
+    // Привязывает ссылки формул этого листа на ячейку pos к её месту или,
+    // если ячейки нет, к NO_CELL.
+    void RebindDependents(Position pos);
+    bool HasDependents(Position pos) const;
+    // Сбрасывает кеш формул, которые ссылаются на ячейку pos или на
+    // диапазоны с ней.
+    void InvalidateDependents(Position pos) const;
+    // Сбрасывает кеш формул, которые ссылаются на диапазоны с ячейкой pos.
+    void InvalidateRangeDependents(Position pos) const;
+    // Переносит по правке edit листа edited позиции зависимых формул этого
+    // листа, а для edited == this - и позиции самих ячеек, забывая удалённые.
+    void RelocateDependents(const Sheet* edited, const StructureEdit& edit);
+
     void IncreasePrintArea(Position pos);
+    void DecreasePrintArea(Position pos);
     void DecreasePrintAreaRow(Position pos);
     void DecreasePrintAreaCol(Position pos);
+    static VersionedCell MakeVersionedCell(const Cell& cell);
 
     template <typename T>
     [[nodiscard]] bool IsType(const CellInterface::Value& value) const {
         return std::holds_alternative<T>(value);
     }
     
-    std::unordered_map<Position, UniqCellPtr, SheetHasher> sheet_;
-    Size min_print_area_ = { 0, 0 };
+    Workbook* workbook_ = nullptr;
+    std::string name_;
+    mutable MemoryTracker memory_;  //Declared before the cells so that it outlives them
+    mutable StringPool strings_;    //Cells release their texts when destroyed
+    mutable SharedMemoryCounter formula_memory_;    //and their formulas
+    mutable std::array<Region, REGION_COUNT> regions_;
+    mutable ColumnIndexes column_indexes_;
+    std::atomic<size_t> cells_count_ = 0;
+    AtomicSize min_print_area_;
+    bool concurrent_writes_ = false;
+    bool deferred_parsing_ = false;
+    std::shared_mutex graph_mutex_;
+    mutable SheetVersions versions_;
+    StatsRegistry stats_;
+    mutable CellProfiler profiler_;
+    FormulaCache formula_cache_;
 };
+
+template <typename F>
+void Sheet::ForEachCell(F&& f) const {
+    for (const Region& region : regions_) {
+        for (const auto& [pos, cell] : region.cells) {
+            f(pos, static_cast<const CellInterface&>(*cell));
+        }
+    }
+}
+
+template <typename F>
+void Sheet::ForEachCellInColumn(int col, F&& f) const {
+    const auto lock = [this](Region& region) {
+        return concurrent_writes_ ? std::unique_lock(region.mutex) : std::unique_lock<std::mutex>();
+    };
+    //Rows are probed unless the sheet has fewer cells than rows
+    const int rows = min_print_area_.rows.load();
+    if (static_cast<size_t>(rows) <= cells_count_.load()) {
+        for (int row = 0; row < rows; ++row) {
+            const Position pos{ row, col };
+            const auto region_lock = lock(GetRegion(pos));
+            if (const Cell* cell = FindCell(pos)) {
+                f(pos, *cell);
+            }
+        }
+        return;
+    }
+    for (Region& region : regions_) {
+        const auto region_lock = lock(region);
+        for (const auto& [pos, cell] : region.cells) {
+            if (pos.col == col) {
+                f(pos, static_cast<const Cell&>(*cell));
+            }
+        }
+    }
+}
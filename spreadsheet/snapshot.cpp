@@ -0,0 +1,222 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <iostream>
+
+using namespace std::literals;
+
+//SheetVersion
+const VersionedCell* SheetVersion::Find(Position pos) const {
+	auto it = tiles.find(Tile::GetKey(pos));
+	if (it == tiles.end()) {
+		return nullptr;
+	}
+	return it->second->Find(Tile::GetIndex(pos));
+}
+
+//Tile
+const VersionedCell* Tile::Find(int index) const {
+	return slots_[index] != 0 ? &cells_[slots_[index] - 1] : nullptr;
+}
+
+void Tile::Write(int index, VersionedCell cell) {
+	if (slots_[index] != 0) {
+		cells_[slots_[index] - 1] = std::move(cell);
+		return;
+	}
+	cells_.push_back(std::move(cell));
+	slots_[index] = static_cast<uint16_t>(cells_.size());
+}
+
+void Tile::Erase(int index) {
+	if (slots_[index] == 0) {
+		return;
+	}
+	//The last cell takes the place of the erased one
+	const uint16_t last = static_cast<uint16_t>(cells_.size());
+	if (slots_[index] != last) {
+		*std::find(slots_.begin(), slots_.end(), last) = slots_[index];
+		cells_[slots_[index] - 1] = std::move(cells_.back());
+	}
+	cells_.pop_back();
+	slots_[index] = 0;
+}
+
+//SheetVersions
+SheetVersions::Stripe& SheetVersions::GetStripe(TileKey key) {
+	return stripes_[key % STRIPE_COUNT];
+}
+
+Tile& SheetVersions::GetWritableTile(TileDirectory& tiles, TileKey key) {
+	std::shared_ptr<Tile>& tile = tiles[key];
+	if (tile == nullptr) {
+		tile = std::make_shared<Tile>();
+	}
+	else if (tile.use_count() > 1) {	//the tile belongs to a published version, copy on write
+		tile = std::make_shared<Tile>(*tile);
+	}
+	return *tile;
+}
+
+void SheetVersions::Write(Position pos, VersionedCell cell) {
+	const TileKey key = Tile::GetKey(pos);
+	Stripe& stripe = GetStripe(key);
+	std::lock_guard guard(stripe.mutex);
+	GetWritableTile(stripe.tiles, key).Write(Tile::GetIndex(pos), std::move(cell));
+	++epoch_;
+}
+
+void SheetVersions::Erase(Position pos) {
+	const TileKey key = Tile::GetKey(pos);
+	Stripe& stripe = GetStripe(key);
+	std::lock_guard guard(stripe.mutex);
+	if (!stripe.tiles.count(key)) {
+		return;
+	}
+	GetWritableTile(stripe.tiles, key).Erase(Tile::GetIndex(pos));
+	++epoch_;
+}
+
+SheetVersions::WriteLock SheetVersions::LockWrites() const {
+	return WriteLock(publish_mutex_);
+}
+
+std::shared_ptr<const SheetVersion> SheetVersions::Publish(const std::function<Size()>& get_printable_size) {
+	std::lock_guard guard(publish_mutex_);	//waits for the write operations in progress
+	const uint64_t epoch = epoch_;
+	const Size printable_size = get_printable_size();
+	if (published_ != nullptr && published_->epoch == epoch && published_->printable_size == printable_size) {
+		return published_;
+	}
+
+	auto version = std::make_shared<SheetVersion>();
+	version->epoch = epoch;
+	version->printable_size = printable_size;
+	for (Stripe& stripe : stripes_) {
+		std::lock_guard stripe_guard(stripe.mutex);
+		version->tiles.insert(stripe.tiles.begin(), stripe.tiles.end());
+	}
+	published_ = std::move(version);
+	return published_;
+}
+
+//SnapshotCell
+SnapshotCell::SnapshotCell(const SheetSnapshot& snapshot, const VersionedCell& cell)
+	: snapshot_(snapshot)
+	, cell_(cell) {
+}
+
+CellInterface::Value SnapshotCell::GetValue() const {
+	if (cache_.has_value()) {
+		return cache_.value();
+	}
+	if (cell_.formula != nullptr) {
+		FormulaInterface::Value value = cell_.formula->Evaluate(snapshot_);
+		if (std::holds_alternative<FormulaError>(value)) {
+			cache_ = std::get<FormulaError>(value);
+		}
+		else {
+			cache_ = std::get<double>(value);
+		}
+	}
+	else {
+		std::string_view text = cell_.text.View();
+		if (!text.empty() && text.front() == ESCAPE_SIGN) {
+			text.remove_prefix(1);
+		}
+		cache_ = std::string(text);
+	}
+	return cache_.value();
+}
+
+std::string SnapshotCell::GetText() const {
+	if (cell_.formula != nullptr) {
+		return std::string(cell_.formula->GetText());
+	}
+	return std::string(cell_.text.View());
+}
+
+std::vector<Position> SnapshotCell::GetReferencedCells() const {
+	if (cell_.formula != nullptr) {
+		return cell_.formula->GetReferencedCells();
+	}
+	return {};
+}
+
+//SheetSnapshot
+SheetSnapshot::SheetSnapshot(std::shared_ptr<const SheetVersion> version)
+	: version_(std::move(version)) {
+}
+
+uint64_t SheetSnapshot::GetEpoch() const {
+	return version_->epoch;
+}
+
+void SheetSnapshot::SetCell(Position pos, std::string text) {
+	throw std::logic_error("Snapshot is read-only"s);
+}
+
+const CellInterface* SheetSnapshot::GetCell(Position pos) const {
+	if (!pos.IsValid()) {
+		throw InvalidPositionException("Invalid position"s);
+	}
+	if (auto it = cells_.find(pos); it != cells_.end()) {
+		return &it->second;
+	}
+	const VersionedCell* cell = version_->Find(pos);
+	if (cell == nullptr) {
+		return nullptr;
+	}
+	return &cells_.emplace(pos, SnapshotCell(*this, *cell)).first->second;
+}
+
+CellInterface* SheetSnapshot::GetCell(Position pos) {
+	return const_cast<CellInterface*>(static_cast<const SheetSnapshot*>(this)->GetCell(pos));
+}
+
+void SheetSnapshot::ClearCell(Position pos) {
+	throw std::logic_error("Snapshot is read-only"s);
+}
+
+Size SheetSnapshot::GetPrintableSize() const {
+	return version_->printable_size;
+}
+
+void SheetSnapshot::PrintValues(std::ostream& output) const {
+	const Size size = GetPrintableSize();
+	for (int i = 0; i < size.rows; ++i) {
+		for (int j = 0; j < size.cols; ++j) {
+			if (j > 0) {
+				output << '\t';
+			}
+			const CellInterface* cell = GetCell({ i, j });
+			if (cell == nullptr) {
+				continue;
+			}
+			std::visit([&output](const auto& value) {
+				output << value;
+			}, cell->GetValue());
+		}
+		output << '\n';
+	}
+}
+
+void SheetSnapshot::PrintTexts(std::ostream& output) const {
+	const Size size = GetPrintableSize();
+	for (int i = 0; i < size.rows; ++i) {
+		for (int j = 0; j < size.cols; ++j) {
+			if (j > 0) {
+				output << '\t';
+			}
+			if (const VersionedCell* cell = version_->Find({ i, j })) {
+				if (cell->formula != nullptr) {
+					output << cell->formula->GetText();
+				}
+				else {
+					output << cell->text.View();
+				}
+			}
+		}
+		output << '\n';
+	}
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "common.h"
+#include "compact_text.h"
+#include "formula.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+// Неизменяемое содержимое ячейки в одной из версий таблицы.
+// Формула разделяется между версиями и живой таблицей: FormulaInterface
+// после разбора не меняется, поэтому её можно вычислять параллельно.
+struct VersionedCell {
+    CompactText text;
+    std::shared_ptr<const FormulaInterface> formula;
+};
+
+// Квадратный блок ячеек. Версии разделяют тайлы, которые между ними не
+// менялись; писатель копирует тайл только при первой записи в него после
+// публикации версии. Ячейки тайла хранятся по значению подряд, поэтому
+// тайл занимает память по числу ячеек в нём, а не по своей площади.
+using TileKey = uint64_t;
+
+struct Tile {
+    static const int SIZE = 16;
+
+    static TileKey GetKey(Position pos) {
+        return Position{ pos.row / SIZE, pos.col / SIZE }.GetKey();
+    }
+
+    static int GetIndex(Position pos) {
+        return (pos.row % SIZE) * SIZE + pos.col % SIZE;
+    }
+
+    const VersionedCell* Find(int index) const;
+    void Write(int index, VersionedCell cell);
+    void Erase(int index);
+
+private:
+    // slots_[i] - номер ячейки i в cells_, начиная с 1; 0 - ячейки нет.
+    std::array<uint16_t, SIZE * SIZE> slots_{};
+    std::vector<VersionedCell> cells_;
+};
+
+using TileDirectory = std::unordered_map<TileKey, std::shared_ptr<Tile>>;
+
+// Опубликованная версия таблицы. Живёт, пока её держит хотя бы один снимок
+// (или пока она последняя опубликованная), после чего освобождается вместе
+// с тайлами, которые больше никому не нужны.
+struct SheetVersion {
+    uint64_t epoch = 0;
+    Size printable_size;
+    TileDirectory tiles;
+
+    const VersionedCell* Find(Position pos) const;
+};
+
+// Хранилище версий, которое ведёт писатель. Все методы потокобезопасны;
+// каталог тайлов разбит на полосы со своими мьютексами, поэтому писатели в
+// разные тайлы не мешают друг другу. Каждая операция записи в лист целиком
+// выполняется под блокировкой LockWrites(), а публикация захватывает её
+// монопольно: версия содержит операцию целиком или не содержит её вовсе.
+class SheetVersions {
+public:
+    using WriteLock = std::shared_lock<std::shared_mutex>;
+
+    // Блокировка операции записи. Повторно в том же потоке не захватывается.
+    WriteLock LockWrites() const;
+
+    void Write(Position pos, VersionedCell cell);
+    void Erase(Position pos);
+
+    // Возвращает последнюю версию, публикуя накопленные изменения.
+    // get_printable_size вызывается, пока операции записи остановлены.
+    std::shared_ptr<const SheetVersion> Publish(const std::function<Size()>& get_printable_size);
+
+private:
+    static const int STRIPE_COUNT = 64;
+
+    struct Stripe {
+        std::mutex mutex;
+        TileDirectory tiles;
+    };
+
+    Stripe& GetStripe(TileKey key);
+    static Tile& GetWritableTile(TileDirectory& tiles, TileKey key);
+
+    std::array<Stripe, STRIPE_COUNT> stripes_;
+    std::atomic<uint64_t> epoch_ = 0;
+    mutable std::shared_mutex publish_mutex_;
+    std::shared_ptr<const SheetVersion> published_;
+};
+
+class SheetSnapshot;
+
+class SnapshotCell : public CellInterface {
+public:
+    SnapshotCell(const SheetSnapshot& snapshot, const VersionedCell& cell);
+
+    Value GetValue() const override;
+    std::string GetText() const override;
+    std::vector<Position> GetReferencedCells() const override;
+
+private:
+    const SheetSnapshot& snapshot_;
+    const VersionedCell& cell_;
+    mutable std::optional<Value> cache_;
+};
+
+// Снимок таблицы: согласованное состояние на момент вызова Sheet::Snapshot().
+// Запись в таблицу после создания снимка на него не влияет. Снимок рассчитан
+// на одного читателя: значения формул вычисляются лениво и кешируются внутри
+// снимка. Методы изменения бросают std::logic_error. Ссылки на другие листы
+// книги снимок не разрешает: такие ячейки вычисляются в #REF!.
+class SheetSnapshot : public SheetInterface {
+public:
+    explicit SheetSnapshot(std::shared_ptr<const SheetVersion> version);
+
+    uint64_t GetEpoch() const;
+
+    void SetCell(Position pos, std::string text) override;
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+    void ClearCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+private:
+    std::shared_ptr<const SheetVersion> version_;
+    mutable std::unordered_map<Position, SnapshotCell, PositionHasher> cells_;
+};
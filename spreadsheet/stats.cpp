@@ -0,0 +1,170 @@
+#include "stats.h"
+
+#include <limits>
+
+namespace {
+
+std::atomic<uint64_t> next_registry_id = 1;
+
+//Slots of destroyed registries are reused, so the tables of the threads stay as large
+//as the most registries alive at once
+std::mutex slots_mutex;
+std::vector<uint32_t> free_slots;
+uint32_t slot_count = 0;
+
+uint32_t AcquireSlot() {
+	std::lock_guard lock(slots_mutex);
+	if (free_slots.empty()) {
+		return slot_count++;
+	}
+	const uint32_t slot = free_slots.back();
+	free_slots.pop_back();
+	return slot;
+}
+
+void ReleaseSlot(uint32_t slot) {
+	std::lock_guard lock(slots_mutex);
+	free_slots.push_back(slot);
+}
+
+int GetBucket(uint64_t ns) {
+	int bucket = 0;
+	while (ns > 1 && bucket < LatencyHistogram::BUCKET_COUNT - 1) {
+		ns >>= 1;
+		++bucket;
+	}
+	return bucket;
+}
+
+LatencyStats MakeLatencyStats(const std::array<uint64_t, LatencyHistogram::BUCKET_COUNT>& buckets) {
+	LatencyStats stats;
+	for (uint64_t count : buckets) {
+		stats.count += count;
+	}
+	if (stats.count == 0) {
+		return stats;
+	}
+	const uint64_t p50_rank = (stats.count + 1) / 2;
+	const uint64_t p99_rank = stats.count - stats.count / 100;
+	uint64_t seen = 0;
+	for (int i = 0; i < LatencyHistogram::BUCKET_COUNT; ++i) {
+		const uint64_t previous = seen;
+		seen += buckets[i];
+		//Bucket i holds latencies in [2^i, 2^(i + 1))
+		const uint64_t upper_bound = i + 1 < LatencyHistogram::BUCKET_COUNT ? uint64_t(1) << (i + 1)
+		                                                                    : std::numeric_limits<uint64_t>::max();
+		if (previous < p50_rank && seen >= p50_rank) {
+			stats.p50_ns = upper_bound;
+		}
+		if (previous < p99_rank && seen >= p99_rank) {
+			stats.p99_ns = upper_bound;
+			break;
+		}
+	}
+	return stats;
+}
+
+}  // namespace
+
+//LatencyHistogram
+void LatencyHistogram::Record(std::chrono::nanoseconds latency) {
+	const auto ns = latency.count();
+	buckets_[GetBucket(ns > 0 ? static_cast<uint64_t>(ns) : 0)].Add();
+}
+
+std::array<uint64_t, LatencyHistogram::BUCKET_COUNT> LatencyHistogram::GetBuckets() const {
+	std::array<uint64_t, BUCKET_COUNT> result;
+	for (int i = 0; i < BUCKET_COUNT; ++i) {
+		result[i] = buckets_[i].Get();
+	}
+	return result;
+}
+
+//StatsRegistry
+StatsRegistry::StatsRegistry()
+	: id_(next_registry_id++)
+	, slot_(AcquireSlot()) {
+}
+
+StatsRegistry::~StatsRegistry() {
+	ReleaseSlot(slot_);
+}
+
+ThreadStats& StatsRegistry::Local() const {
+	//Registry ids are never reused, so an entry left by a destroyed registry in a reused slot
+	//is told apart by its id and replaced
+	thread_local uint64_t last_id = 0;
+	thread_local ThreadStats* last_stats = nullptr;
+	if (last_id == id_) {
+		return *last_stats;
+	}
+	thread_local std::vector<std::pair<uint64_t, ThreadStats*>> thread_stats;
+	if (thread_stats.size() <= slot_) {
+		thread_stats.resize(slot_ + 1);
+	}
+	auto& [id, stats] = thread_stats[slot_];
+	if (id != id_) {
+		id = id_;
+		stats = &AddThread();
+	}
+	last_id = id_;
+	last_stats = stats;
+	return *stats;
+}
+
+ThreadStats& StatsRegistry::AddThread() const {
+	std::lock_guard lock(mutex_);
+	threads_.push_back(std::make_unique<ThreadStats>());
+	return *threads_.back();
+}
+
+StatsRegistry::Totals StatsRegistry::Collect() const {
+	Totals totals;
+	for (const auto& thread : threads_) {
+		const StatCounter* counters[] = {
+			&thread->formulas_parsed, &thread->parse_time_ns, &thread->cycle_check_nodes, &thread->writes,
+			&thread->cells_invalidated, &thread->cache_hits, &thread->cache_misses, &thread->evaluations,
+		};
+		for (size_t i = 0; i < totals.counters.size(); ++i) {
+			totals.counters[i] += counters[i]->Get();
+		}
+		const auto set_cell = thread->set_cell.GetBuckets();
+		const auto get_value = thread->get_value.GetBuckets();
+		for (int i = 0; i < LatencyHistogram::BUCKET_COUNT; ++i) {
+			totals.set_cell[i] += set_cell[i];
+			totals.get_value[i] += get_value[i];
+		}
+	}
+	return totals;
+}
+
+SheetStats StatsRegistry::GetStats() const {
+	std::unique_lock lock(mutex_);
+	Totals totals = Collect();
+	for (size_t i = 0; i < totals.counters.size(); ++i) {
+		totals.counters[i] -= baseline_.counters[i];
+	}
+	for (int i = 0; i < LatencyHistogram::BUCKET_COUNT; ++i) {
+		totals.set_cell[i] -= baseline_.set_cell[i];
+		totals.get_value[i] -= baseline_.get_value[i];
+	}
+	lock.unlock();
+
+	SheetStats stats;
+	stats.formulas_parsed = totals.counters[0];
+	stats.parse_time_ns = totals.counters[1];
+	stats.cycle_check_nodes = totals.counters[2];
+	stats.writes = totals.counters[3];
+	stats.cells_invalidated = totals.counters[4];
+	stats.cache_hits = totals.counters[5];
+	stats.cache_misses = totals.counters[6];
+	stats.evaluations = totals.counters[7];
+	stats.set_cell = MakeLatencyStats(totals.set_cell);
+	stats.get_value = MakeLatencyStats(totals.get_value);
+	return stats;
+}
+
+void StatsRegistry::Reset() {
+	std::lock_guard lock(mutex_);
+	baseline_ = Collect();
+}
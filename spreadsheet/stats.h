@@ -0,0 +1,132 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Перцентили задержки операции. Гистограмма хранит задержки в корзинах по
+// степеням двойки, поэтому перцентиль - это верхняя граница корзины: не
+// меньше настоящего значения и не больше чем вдвое выше него.
+struct LatencyStats {
+    uint64_t count = 0;
+    uint64_t p50_ns = 0;
+    uint64_t p99_ns = 0;
+};
+
+// Значения счётчиков таблицы с момента создания или последнего ResetStats().
+struct SheetStats {
+    uint64_t formulas_parsed = 0;
+    uint64_t parse_time_ns = 0;
+    uint64_t cycle_check_nodes = 0;
+    uint64_t writes = 0;
+    uint64_t cells_invalidated = 0;
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    uint64_t evaluations = 0;
+    LatencyStats set_cell;
+    LatencyStats get_value;
+
+    double InvalidatedPerWrite() const {
+        return writes == 0 ? 0.0 : static_cast<double>(cells_invalidated) / writes;
+    }
+};
+
+// Счётчик с единственным писателем: увеличивать его может только поток-владелец,
+// читать - любой поток.
+class StatCounter {
+public:
+    void Add(uint64_t n = 1) {
+        value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    uint64_t Get() const {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> value_ = 0;
+};
+
+class LatencyHistogram {
+public:
+    static const int BUCKET_COUNT = 64;
+
+    void Record(std::chrono::nanoseconds latency);
+
+    std::array<uint64_t, BUCKET_COUNT> GetBuckets() const;
+
+private:
+    std::array<StatCounter, BUCKET_COUNT> buckets_;
+};
+
+// Счётчики одного потока. Выровнены по кеш-линии, чтобы потоки не делили
+// линии и не мешали друг другу на горячих путях.
+struct alignas(64) ThreadStats {
+    StatCounter formulas_parsed;
+    StatCounter parse_time_ns;
+    StatCounter cycle_check_nodes;
+    StatCounter writes;
+    StatCounter cells_invalidated;
+    StatCounter cache_hits;
+    StatCounter cache_misses;
+    StatCounter evaluations;
+    LatencyHistogram set_cell;
+    LatencyHistogram get_value;
+    int get_value_depth = 0;    //Nested GetValue calls are not timed separately
+};
+
+// Счётчики таблицы: по блоку ThreadStats на каждый поток, который с ней
+// работал. Local() потокобезопасен и не блокирует после первого обращения
+// потока; GetStats() суммирует блоки, Reset() запоминает текущие суммы как
+// точку отсчёта, не трогая блоки других потоков. Поток находит свой блок
+// по номеру слота реестра; слоты уничтоженных реестров переиспользуются,
+// поэтому память потока не растёт с числом созданных за его жизнь таблиц.
+class StatsRegistry {
+public:
+    StatsRegistry();
+    StatsRegistry(const StatsRegistry&) = delete;
+    StatsRegistry& operator=(const StatsRegistry&) = delete;
+    ~StatsRegistry();
+
+    ThreadStats& Local() const;
+
+    SheetStats GetStats() const;
+    void Reset();
+
+private:
+    struct Totals {
+        std::array<uint64_t, 8> counters{};
+        std::array<uint64_t, LatencyHistogram::BUCKET_COUNT> set_cell{};
+        std::array<uint64_t, LatencyHistogram::BUCKET_COUNT> get_value{};
+    };
+
+    Totals Collect() const;     //Requires mutex_ to be held
+    ThreadStats& AddThread() const;
+
+    const uint64_t id_;
+    const uint32_t slot_;
+    mutable std::mutex mutex_;
+    mutable std::vector<std::unique_ptr<ThreadStats>> threads_;
+    Totals baseline_;
+};
+
+// Измеряет время жизни объекта и записывает его в гистограмму.
+class ScopedLatency {
+public:
+    explicit ScopedLatency(LatencyHistogram& histogram)
+        : histogram_(histogram)
+        , start_(std::chrono::steady_clock::now()) {
+    }
+
+    ~ScopedLatency() {
+        histogram_.Record(std::chrono::steady_clock::now() - start_);
+    }
+
+private:
+    LatencyHistogram& histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
@@ -0,0 +1,241 @@
+#include "string_pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+using namespace std::literals;
+
+namespace {
+
+int FloorLog2(uint32_t value) {
+	int result = 0;
+	for (int shift = 16; shift > 0; shift /= 2) {
+		if (value >> shift != 0) {
+			value >>= shift;
+			result += shift;
+		}
+	}
+	return result;
+}
+
+}  // namespace
+
+StringPool::StringPool(MemoryTracker& tracker)
+	: tracker_(tracker) {
+	for (Stripe& stripe : stripes_) {
+		stripe.slots = IndexVector(IndexVector::allocator_type(tracker_, MemoryCategory::Text));
+		stripe.free_entries = IndexVector(IndexVector::allocator_type(tracker_, MemoryCategory::Text));
+		stripe.blocks = BlockMap(BlockMap::allocator_type(tracker_, MemoryCategory::Text));
+		stripe.current = stripe.blocks.end();
+	}
+}
+
+StringPool::~StringPool() {
+	for (Stripe& stripe : stripes_) {
+		for (const auto& [start, block] : stripe.blocks) {
+			tracker_.Deallocate(MemoryCategory::Text, block.capacity);
+		}
+		for (int chunk = 0; chunk < CHUNK_COUNT; ++chunk) {
+			if (Entry* entries = stripe.chunks[chunk].load(std::memory_order_relaxed)) {
+				tracker_.Deallocate(MemoryCategory::Text, sizeof(Entry) << (FIRST_CHUNK_BITS + chunk));
+				delete[] entries;
+			}
+		}
+	}
+}
+
+StringPool::Id StringPool::Intern(std::string_view text) {
+	if (text.size() > UINT32_MAX) {
+		throw std::length_error("Cell text is too long"s);
+	}
+	const size_t hash = GetHash(text);
+	const size_t stripe_index = GetStripeIndex(hash);
+	Stripe& stripe = stripes_[stripe_index];
+	std::lock_guard guard(stripe.mutex);
+	if ((stripe.size + 1) * 4 > stripe.slots.size() * 3) {	//Keep the table at most 3/4 full
+		Rehash(stripe, std::max(MIN_SLOT_COUNT, stripe.slots.size() * 2));
+	}
+	const size_t slot = FindSlot(stripe, text, hash);
+	if (stripe.slots[slot] != 0) {
+		const uint32_t index = stripe.slots[slot] - 1;
+		++GetEntry(stripe, index).refs;
+		return MakeId(stripe_index, index);
+	}
+	const uint32_t index = AllocateEntry(stripe);
+	Entry& entry = GetEntry(stripe, index);
+	entry.data = Store(stripe, text);
+	entry.size = static_cast<uint32_t>(text.size());
+	entry.refs = 1;
+	stripe.slots[slot] = index + 1;
+	++stripe.size;
+	return MakeId(stripe_index, index);
+}
+
+void StringPool::Release(Id id) {
+	Stripe& stripe = stripes_[id & (STRIPE_COUNT - 1)];
+	const uint32_t index = id >> STRIPE_BITS;
+	std::lock_guard guard(stripe.mutex);
+	Entry& entry = GetEntry(stripe, index);
+	if (--entry.refs != 0) {
+		return;
+	}
+	const std::string_view text = View(entry);
+	EraseSlot(stripe, FindSlot(stripe, text, GetHash(text)));
+	--stripe.size;
+	Free(stripe, entry.data);
+	entry = Entry();
+	stripe.free_entries.push_back(index);
+}
+
+std::optional<StringPool::Id> StringPool::Find(std::string_view text) const {
+	const size_t hash = GetHash(text);
+	const size_t stripe_index = GetStripeIndex(hash);
+	const Stripe& stripe = stripes_[stripe_index];
+	std::lock_guard guard(stripe.mutex);
+	if (stripe.slots.empty()) {
+		return std::nullopt;
+	}
+	const uint32_t value = stripe.slots[FindSlot(stripe, text, hash)];
+	if (value == 0) {
+		return std::nullopt;
+	}
+	return MakeId(stripe_index, value - 1);
+}
+
+std::string_view StringPool::View(Id id) const {
+	return View(GetEntry(stripes_[id & (STRIPE_COUNT - 1)], id >> STRIPE_BITS));
+}
+
+size_t StringPool::GetSize() const {
+	size_t size = 0;
+	for (const Stripe& stripe : stripes_) {
+		std::lock_guard guard(stripe.mutex);
+		size += stripe.size;
+	}
+	return size;
+}
+
+size_t StringPool::GetHash(std::string_view text) {
+	return std::hash<std::string_view>{}(text);
+}
+
+size_t StringPool::GetStripeIndex(size_t hash) {
+	//The top bits of the hash, the stripe's table uses the low ones
+	return hash >> (sizeof(size_t) * 8 - STRIPE_BITS);
+}
+
+StringPool::Id StringPool::MakeId(size_t stripe, uint32_t index) {
+	return index << STRIPE_BITS | static_cast<Id>(stripe);
+}
+
+StringPool::Entry& StringPool::GetEntry(const Stripe& stripe, uint32_t index) {
+	const uint32_t position = index + (1u << FIRST_CHUNK_BITS);
+	const int chunk = FloorLog2(position) - FIRST_CHUNK_BITS;
+	return stripe.chunks[chunk].load(std::memory_order_acquire)[position - (1u << (FIRST_CHUNK_BITS + chunk))];
+}
+
+std::string_view StringPool::View(const Entry& entry) {
+	return { entry.data, entry.size };
+}
+
+size_t StringPool::FindSlot(const Stripe& stripe, std::string_view text, size_t hash) {
+	const size_t mask = stripe.slots.size() - 1;
+	for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+		const uint32_t value = stripe.slots[slot];
+		if (value == 0 || View(GetEntry(stripe, value - 1)) == text) {
+			return slot;
+		}
+	}
+}
+
+void StringPool::EraseSlot(Stripe& stripe, size_t slot) {
+	//Shift the following entries back unless that would move one before its home slot
+	const size_t mask = stripe.slots.size() - 1;
+	for (size_t next = (slot + 1) & mask; stripe.slots[next] != 0; next = (next + 1) & mask) {
+		const size_t home = GetHash(View(GetEntry(stripe, stripe.slots[next] - 1))) & mask;
+		if (((next - home) & mask) >= ((next - slot) & mask)) {
+			stripe.slots[slot] = stripe.slots[next];
+			slot = next;
+		}
+	}
+	stripe.slots[slot] = 0;
+}
+
+void StringPool::Rehash(Stripe& stripe, size_t slot_count) {
+	IndexVector slots(slot_count, 0, stripe.slots.get_allocator());
+	std::swap(stripe.slots, slots);
+	for (uint32_t value : slots) {
+		if (value != 0) {
+			const std::string_view text = View(GetEntry(stripe, value - 1));
+			stripe.slots[FindSlot(stripe, text, GetHash(text))] = value;
+		}
+	}
+}
+
+uint32_t StringPool::AllocateEntry(Stripe& stripe) {
+	if (!stripe.free_entries.empty()) {
+		const uint32_t index = stripe.free_entries.back();
+		stripe.free_entries.pop_back();
+		return index;
+	}
+	const uint32_t index = stripe.entries;
+	if (index >> (32 - STRIPE_BITS) != 0) {
+		throw std::length_error("Too many distinct texts"s);
+	}
+	//Chunks are never moved or freed while the pool lives, so View reads them without the lock
+	const int chunk = FloorLog2(index + (1u << FIRST_CHUNK_BITS)) - FIRST_CHUNK_BITS;
+	if (stripe.chunks[chunk].load(std::memory_order_relaxed) == nullptr) {
+		const size_t count = size_t(1) << (FIRST_CHUNK_BITS + chunk);
+		stripe.chunks[chunk].store(new Entry[count], std::memory_order_release);
+		tracker_.Allocate(MemoryCategory::Text, count * sizeof(Entry));
+	}
+	++stripe.entries;
+	return index;
+}
+
+const char* StringPool::Store(Stripe& stripe, std::string_view text) {
+	BlockMap::iterator block;
+	if (text.size() > MAX_SHARED_SIZE) {
+		block = AddBlock(stripe, text.size());
+	}
+	else {
+		//Strictly inside the block, so that even an empty text is found by its address
+		if (stripe.current == stripe.blocks.end()
+		    || stripe.current->second.capacity - stripe.current->second.used <= text.size()) {
+			stripe.current = AddBlock(stripe, stripe.next_block_size);
+			stripe.next_block_size = std::min(stripe.next_block_size * 2, MAX_BLOCK_SIZE);
+		}
+		block = stripe.current;
+	}
+	char* target = block->second.data.get() + block->second.used;
+	if (!text.empty()) {
+		std::memcpy(target, text.data(), text.size());
+	}
+	block->second.used += text.size();
+	++block->second.live;
+	return target;
+}
+
+StringPool::BlockMap::iterator StringPool::AddBlock(Stripe& stripe, size_t capacity) {
+	std::unique_ptr<char[]> data(new char[std::max<size_t>(capacity, 1)]);
+	const char* start = data.get();
+	auto it = stripe.blocks.emplace(start, Block{ std::move(data), capacity, 0, 0 }).first;
+	tracker_.Allocate(MemoryCategory::Text, capacity);
+	return it;
+}
+
+void StringPool::Free(Stripe& stripe, const char* data) {
+	auto block = std::prev(stripe.blocks.upper_bound(data));
+	if (--block->second.live != 0) {
+		return;
+	}
+	if (block == stripe.current) {
+		stripe.current = stripe.blocks.end();
+	}
+	tracker_.Deallocate(MemoryCategory::Text, block->second.capacity);
+	stripe.blocks.erase(block);
+}
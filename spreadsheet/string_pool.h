@@ -0,0 +1,104 @@
+#pragma once
+
+#include "memory_usage.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+// Словарь текстов листа. Вместо текста хранится 32-битный номер, а
+// одинаковые тексты хранятся один раз. Равные тексты одного словаря имеют
+// равные номера, поэтому их можно сравнивать по номерам. Байты текстов
+// лежат в арене: короткие тексты - подряд в общих блоках, длинные - каждый
+// в своём блоке; блок освобождается, когда в нём не остаётся живых текстов.
+// Текст живёт, пока на него есть ссылки: Intern добавляет ссылку, Release
+// снимает. Словарь разбит на полосы по хешу текста со своими мьютексами, а
+// View не блокирует: записи текстов никогда не перемещаются.
+// Все методы потокобезопасны; View можно вызывать для номеров, на которые
+// вызывающий держит ссылку. Память словаря учитывается как MemoryCategory::Text.
+class StringPool {
+public:
+    using Id = uint32_t;
+
+    explicit StringPool(MemoryTracker& tracker);
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+    ~StringPool();
+
+    // Возвращает номер text, добавляя на него ссылку.
+    Id Intern(std::string_view text);
+    // Снимает ссылку. Текст без ссылок удаляется, и его номер может
+    // достаться другому тексту.
+    void Release(Id id);
+    // Возвращает номер text без добавления ссылки, если text есть в словаре.
+    std::optional<Id> Find(std::string_view text) const;
+    std::string_view View(Id id) const;
+    // Число разных текстов в словаре.
+    size_t GetSize() const;
+
+private:
+    static constexpr int STRIPE_BITS = 4;
+    static constexpr int STRIPE_COUNT = 1 << STRIPE_BITS;
+    //Chunk i holds 2^(FIRST_CHUNK_BITS + i) entries, so the chunks of a stripe cover every index of an id
+    static constexpr int FIRST_CHUNK_BITS = 6;
+    static constexpr int CHUNK_COUNT = 32 - STRIPE_BITS - FIRST_CHUNK_BITS + 1;
+    static constexpr size_t MIN_SLOT_COUNT = 16;
+    static constexpr size_t MIN_BLOCK_SIZE = 256;
+    static constexpr size_t MAX_BLOCK_SIZE = 64 * 1024;
+    // Более длинные тексты получают отдельный блок.
+    static constexpr size_t MAX_SHARED_SIZE = MAX_BLOCK_SIZE / 16;
+
+    struct Entry {
+        const char* data = nullptr;
+        uint32_t size = 0;
+        uint32_t refs = 0;
+    };
+
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t capacity = 0;
+        size_t used = 0;
+        size_t live = 0;
+    };
+    // Блоки арены по адресу начала: по нему Release находит блок текста.
+    using BlockMap = std::map<const char*, Block, std::less<const char*>,
+                              TrackingAllocator<std::pair<const char* const, Block>>>;
+    using IndexVector = std::vector<uint32_t, TrackingAllocator<uint32_t>>;
+
+    struct Stripe {
+        mutable std::mutex mutex;
+        // Хеш-таблица с открытой адресацией: индекс записи + 1, 0 - пусто.
+        IndexVector slots;
+        size_t size = 0;
+        std::array<std::atomic<Entry*>, CHUNK_COUNT> chunks{};
+        uint32_t entries = 0;
+        IndexVector free_entries;
+        BlockMap blocks;
+        BlockMap::iterator current;
+        size_t next_block_size = MIN_BLOCK_SIZE;
+    };
+
+    static size_t GetHash(std::string_view text);
+    static size_t GetStripeIndex(size_t hash);
+    static Id MakeId(size_t stripe, uint32_t index);
+    static Entry& GetEntry(const Stripe& stripe, uint32_t index);
+    static std::string_view View(const Entry& entry);
+    // Возвращает слот с text или пустой слот, куда его нужно вставить.
+    static size_t FindSlot(const Stripe& stripe, std::string_view text, size_t hash);
+    static void EraseSlot(Stripe& stripe, size_t slot);
+    static void Rehash(Stripe& stripe, size_t slot_count);
+    uint32_t AllocateEntry(Stripe& stripe);
+    // Копирует text в арену полосы и возвращает адрес копии.
+    const char* Store(Stripe& stripe, std::string_view text);
+    BlockMap::iterator AddBlock(Stripe& stripe, size_t capacity);
+    void Free(Stripe& stripe, const char* data);
+
+    MemoryTracker& tracker_;
+    std::array<Stripe, STRIPE_COUNT> stripes_;
+};
@@ -1,12 +1,12 @@
 #include "common.h"
 
-#include <cctype>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
 #include <sstream>
-#include <cmath>
 
 const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 8;
-const int MAX_POS_LETTER_COUNT = 3;
 
 const Position Position::NONE = { -1, -1 };
 
@@ -26,76 +26,213 @@ bool Size::operator==(Size rhs) const {
 	return cols == rhs.cols && rows == rhs.rows;
 }
 
-int ConvertToCol(std::string_view str) {
-	int degree = str.size() - 1;
+bool CellRange::operator==(const CellRange& rhs) const {
+	return from == rhs.from && to == rhs.to;
+}
 
-	int col = 0;
+bool CellRange::operator<(const CellRange& rhs) const {
+	return std::tie(from, to) < std::tie(rhs.from, rhs.to);
+}
+
+bool CellRange::Contains(Position pos) const {
+	return from.row <= pos.row && pos.row <= to.row && from.col <= pos.col && pos.col <= to.col;
+}
+
+int CellRange::GetRows() const {
+	return to.row - from.row + 1;
+}
+
+int CellRange::GetCols() const {
+	return to.col - from.col + 1;
+}
+
+std::string CellRange::ToString() const {
+	return from.ToString() + ':' + to.ToString();
+}
+
+namespace {
+
+//The row or the column of pos that an edit of axis changes
+int& GetLine(Position& pos, StructureEdit::Axis axis) {
+	return axis == StructureEdit::Axis::Rows ? pos.row : pos.col;
+}
 
-	for (char c : str) {
-		col += (static_cast<int>(c) - 64) * std::pow(LETTERS, degree);
-		--degree;
+int GetLineCount(StructureEdit::Axis axis) {
+	return axis == StructureEdit::Axis::Rows ? Position::MAX_ROWS : Position::MAX_COLS;
+}
+
+}  // namespace
+
+std::optional<Position> StructureEdit::Map(Position pos) const {
+	int& line = GetLine(pos, axis);
+	if (line < first) {
+		return pos;
+	}
+	if (insert) {
+		if (line >= GetLineCount(axis) - count) {
+			return std::nullopt;
+		}
+		line += count;
+		return pos;
 	}
+	if (line < first + count) {
+		return std::nullopt;
+	}
+	line -= count;
+	return pos;
+}
 
-	return col;
+std::optional<CellRange> StructureEdit::Map(const CellRange& range) const {
+	CellRange result = range;
+	int& from = GetLine(result.from, axis);
+	int& to = GetLine(result.to, axis);
+	if (insert) {
+		//A range starting at the inserted lines moves, a range crossing them grows
+		const int lines = GetLineCount(axis);
+		if (from >= first) {
+			if (from >= lines - count) {
+				return std::nullopt;
+			}
+			from += count;
+		}
+		if (to >= first) {
+			to = std::min(to, lines - 1 - count) + count;
+		}
+		return result;
+	}
+	//Deleted lines at the ends of the range cut it
+	if (from >= first) {
+		from = std::max(from - count, first);
+	}
+	if (to >= first) {
+		to = to < first + count ? first - 1 : to - count;
+	}
+	if (from > to) {
+		return std::nullopt;
+	}
+	return result;
 }
 
-void ConvertColToString(int col, std::string& upper_char) {
-	if (col < LETTERS) {
-		char c = static_cast<char>(col + 65);
-		upper_char.insert(upper_char.begin(), c);
-		return;
+namespace {
+
+// Значения символов для разбора: буквы 'A'..'Z' дают 1..26, цифры - 0..9,
+// остальные символы - NOT_A_LETTER / NOT_A_DIGIT.
+const uint8_t NOT_A_LETTER = 0;
+const uint8_t NOT_A_DIGIT = 0xFF;
+
+constexpr std::array<uint8_t, 256> MakeLetterValues() {
+	std::array<uint8_t, 256> values{};
+	for (int c = 'A'; c <= 'Z'; ++c) {
+		values[c] = static_cast<uint8_t>(c - 'A' + 1);
 	}
-	int val_div = col / LETTERS;
-	int remainder = col - (val_div * LETTERS);
+	return values;
+}
 
-	upper_char.insert(upper_char.begin(), static_cast<char>(remainder + 65));
+constexpr std::array<uint8_t, 256> MakeDigitValues() {
+	std::array<uint8_t, 256> values{};
+	for (auto& value : values) {
+		value = NOT_A_DIGIT;
+	}
+	for (int c = '0'; c <= '9'; ++c) {
+		values[c] = static_cast<uint8_t>(c - '0');
+	}
+	return values;
+}
 
-	return ConvertColToString(--val_div, upper_char);
+// "00", "01", ..., "99": номер строки печатается по две цифры за шаг.
+constexpr std::array<char, 200> MakeDigitPairs() {
+	std::array<char, 200> pairs{};
+	for (int i = 0; i < 100; ++i) {
+		pairs[2 * i] = static_cast<char>('0' + i / 10);
+		pairs[2 * i + 1] = static_cast<char>('0' + i % 10);
+	}
+	return pairs;
 }
 
-std::string Position::ToString() const {
+constexpr std::array<uint8_t, 256> LETTER_VALUES = MakeLetterValues();
+constexpr std::array<uint8_t, 256> DIGIT_VALUES = MakeDigitValues();
+constexpr std::array<char, 200> DIGIT_PAIRS = MakeDigitPairs();
+
+size_t CountColLetters(int col) {
+	return 1 + (col >= LETTERS) + (col >= LETTERS + LETTERS * LETTERS);
+}
+
+size_t CountDigits(uint32_t value) {
+	return 1 + (value >= 10) + (value >= 100) + (value >= 1000) + (value >= 10000) + (value >= 100000)
+		+ (value >= 1000000) + (value >= 10000000) + (value >= 100000000) + (value >= 1000000000);
+}
+
+}  // namespace
+
+size_t Position::ToString(char* buffer) const {
 	if (!IsValid()) {
-		return {};
+		return 0;
+	}
+	const size_t letters = CountColLetters(col);
+	int rest = col;
+	for (size_t i = letters; i-- > 0;) {
+		buffer[i] = static_cast<char>('A' + rest % LETTERS);
+		rest = rest / LETTERS - 1;
 	}
-	std::string upper_char;
-	ConvertColToString(col, upper_char);
 
-	std::string numbers(std::to_string(row + 1));
+	uint32_t number = static_cast<uint32_t>(row) + 1;
+	const size_t length = letters + CountDigits(number);
+	char* end = buffer + length;
+	while (number >= 10) {
+		end -= 2;
+		std::memcpy(end, &DIGIT_PAIRS[2 * (number % 100)], 2);
+		number /= 100;
+	}
+	if (end != buffer + letters) {
+		*--end = static_cast<char>('0' + number);
+	}
+	return length;
+}
 
-	return upper_char + numbers;
+std::string Position::ToString() const {
+	char buffer[MAX_STRING_LENGTH];
+	return std::string(buffer, ToString(buffer));
 }
 
 Position Position::FromString(std::string_view str) {
-	if (str.empty() || std::isdigit(str.front()) || std::islower(str.front()) ||
-		(str.size() > MAX_POSITION_LENGTH)) {
+	if (str.empty() || str.size() > MAX_STRING_LENGTH) {
 		return Position::NONE;
 	}
 
-	std::string upper_char;
-	auto it = str.begin();
-
-	while (it != str.end() ? std::isupper(*it) : false) {
-		upper_char.push_back(*it);
-		++it;
+	size_t i = 0;
+	int col = 0;
+	for (; i < str.size() && LETTER_VALUES[static_cast<uint8_t>(str[i])] != NOT_A_LETTER; ++i) {
+		col = col * LETTERS + LETTER_VALUES[static_cast<uint8_t>(str[i])];
 	}
-
-	if (upper_char.size() > MAX_POS_LETTER_COUNT) {
+	if (i == 0 || i > MAX_COL_LETTERS) {
 		return Position::NONE;
 	}
 
-	std::string numbers;
-	while (it != str.end() ? std::isdigit(*it) : false) {
-		numbers.push_back(*it);
-		++it;
+	const size_t digits_begin = i;
+	int row = 0;
+	for (; i < str.size() && DIGIT_VALUES[static_cast<uint8_t>(str[i])] != NOT_A_DIGIT; ++i) {
+		row = row * 10 + DIGIT_VALUES[static_cast<uint8_t>(str[i])];
 	}
-
-	if (numbers.empty() || it != str.end() ||
-		(numbers.size() > (MAX_POSITION_LENGTH - MAX_POS_LETTER_COUNT))) {
+	if (i == digits_begin || i != str.size() ||
+		i - digits_begin > CountDecimalDigits(MAX_ROWS)) {
 		return Position::NONE;
 	}
 
-	int row = std::stoi(numbers);
-	int col = ConvertToCol(upper_char);
+	return (row == 0 || col > MAX_COLS || row > MAX_ROWS) ? Position::NONE : Position{ row - 1, col - 1 };
+}
+
+void AppendPositions(const Position* begin, const Position* end, char separator, std::string& output) {
+	char buffer[Position::MAX_STRING_LENGTH];
+	for (const Position* pos = begin; pos != end; ++pos) {
+		if (pos != begin) {
+			output.push_back(separator);
+		}
+		output.append(buffer, pos->ToString(buffer));
+	}
+}
 
-	return (col > MAX_COLS || row > MAX_ROWS) ? Position::NONE : Position{ --row, --col };
-}
\ No newline at end of file
+void ParsePositions(const std::string_view* begin, const std::string_view* end, Position* output) {
+	for (const std::string_view* str = begin; str != end; ++str) {
+		*output++ = Position::FromString(*str);
+	}
+}
@@ -0,0 +1,127 @@
+// Воспроизводит журнал операций, записанный RecordingSheet. Запуск:
+//   spreadsheet_replay журнал [--timed]
+// По умолчанию операции выполняются подряд без пауз; с --timed между ними
+// выдерживаются исходные интервалы. Результат выводится в stdout в формате
+// JSON: число операций, ошибок и перцентили задержки по типам операций.
+
+#include "common.h"
+#include "oplog.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct OpStats {
+    std::vector<uint64_t> latencies;
+    uint64_t errors = 0;
+};
+
+uint64_t Percentile(const std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+void Execute(SheetInterface& sheet, const Op& op) {
+    switch (op.type) {
+    case OpType::SetCell:
+        sheet.SetCell(op.pos, op.text);
+        break;
+    case OpType::ClearCell:
+        sheet.ClearCell(op.pos);
+        break;
+    case OpType::GetValue:
+        if (const CellInterface* cell = sheet.GetCell(op.pos)) {
+            cell->GetValue();
+        }
+        break;
+    case OpType::GetText:
+        if (const CellInterface* cell = sheet.GetCell(op.pos)) {
+            cell->GetText();
+        }
+        break;
+    case OpType::GetPrintableSize:
+        sheet.GetPrintableSize();
+        break;
+    case OpType::PrintValues: {
+        std::ostringstream output;
+        sheet.PrintValues(output);
+        break;
+    }
+    case OpType::PrintTexts: {
+        std::ostringstream output;
+        sheet.PrintTexts(output);
+        break;
+    }
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2 || (argc == 3 && std::strcmp(argv[2], "--timed") != 0) || argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " log [--timed]" << std::endl;
+        return 1;
+    }
+    const bool timed = argc == 3;
+
+    std::ifstream input(argv[1], std::ios::binary);
+    if (!input) {
+        std::cerr << "Cannot open " << argv[1] << std::endl;
+        return 1;
+    }
+
+    auto sheet = CreateSheet();
+    std::map<OpType, OpStats> stats;
+    const auto replay_start = std::chrono::steady_clock::now();
+    uint64_t offset_ns = 0;
+    try {
+        OpLogReader reader(input);
+        Op op;
+        while (reader.Next(op)) {
+            offset_ns += op.delta_ns;
+            if (timed) {
+                std::this_thread::sleep_until(replay_start + std::chrono::nanoseconds(offset_ns));
+            }
+            OpStats& op_stats = stats[op.type];
+            const auto start = std::chrono::steady_clock::now();
+            try {
+                Execute(*sheet, op);
+            } catch (const std::exception&) {   //Recorded calls may have failed originally as well
+                ++op_stats.errors;
+            }
+            op_stats.latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count());
+        }
+    } catch (const std::runtime_error& e) {
+        std::cerr << argv[1] << ": " << e.what() << std::endl;
+        return 1;
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - replay_start).count();
+
+    std::cout << "{\n  \"timed\": " << (timed ? "true" : "false")
+              << ",\n  \"seconds\": " << seconds << ",\n  \"operations\": [\n";
+    bool first = true;
+    for (auto& [type, op_stats] : stats) {
+        auto& latencies = op_stats.latencies;
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << (first ? "" : ",\n");
+        first = false;
+        std::cout << "    {\"op\": \"" << ToString(type) << "\", \"count\": " << latencies.size()
+                  << ", \"errors\": " << op_stats.errors
+                  << ", \"p50_ns\": " << Percentile(latencies, 0.50)
+                  << ", \"p90_ns\": " << Percentile(latencies, 0.90)
+                  << ", \"p99_ns\": " << Percentile(latencies, 0.99)
+                  << ", \"max_ns\": " << (latencies.empty() ? 0 : latencies.back()) << "}";
+    }
+    std::cout << "\n  ]\n}\n";
+}
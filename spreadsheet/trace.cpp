@@ -0,0 +1,120 @@
+#include "trace.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+const auto trace_start = std::chrono::steady_clock::now();
+
+//Buffers outlive their threads so that events of finished threads can still be exported,
+//until a new thread takes the buffer over
+std::mutex buffers_mutex;
+std::vector<std::unique_ptr<TraceBuffer>> buffers;
+std::vector<TraceBuffer*> free_buffers;
+
+//Returns the buffer of the thread to the free ones when the thread exits
+struct BufferLease {
+	TraceBuffer* buffer = nullptr;
+
+	~BufferLease() {
+		if (buffer != nullptr) {
+			std::lock_guard lock(buffers_mutex);
+			free_buffers.push_back(buffer);
+		}
+	}
+};
+
+uint64_t PackPosition(Position pos) {
+	return (static_cast<uint64_t>(static_cast<uint32_t>(pos.row)) << 32) | static_cast<uint32_t>(pos.col);
+}
+
+void WriteMicroseconds(std::ostream& output, uint64_t ns) {
+	output << ns / 1000 << '.' << std::setw(3) << std::setfill('0') << ns % 1000 << std::setfill(' ');
+}
+
+}  // namespace
+
+//TraceBuffer
+TraceBuffer::TraceBuffer(uint32_t thread_id): thread_id_(thread_id) {}
+
+void TraceBuffer::Record(const Event& event) {
+	const uint64_t head = head_.load(std::memory_order_relaxed);
+	Slot& slot = slots_[head % CAPACITY];
+	slot.sequence.store(2 * (head + 1) - 1, std::memory_order_relaxed);
+	//Release stores keep the odd sequence visible to anyone who reads a new field
+	slot.name.store(event.name, std::memory_order_release);
+	slot.start_ns.store(event.start_ns, std::memory_order_release);
+	slot.duration_ns.store(event.duration_ns, std::memory_order_release);
+	slot.pos.store(PackPosition(event.pos), std::memory_order_release);
+	slot.sequence.store(2 * (head + 1), std::memory_order_release);
+	head_.store(head + 1, std::memory_order_release);
+}
+
+Position TraceBuffer::UnpackPosition(uint64_t pos) {
+	return { static_cast<int>(static_cast<int32_t>(pos >> 32)), static_cast<int>(static_cast<int32_t>(pos)) };
+}
+
+uint32_t TraceBuffer::GetThreadId() const {
+	return thread_id_;
+}
+
+void TraceBuffer::Clear() {
+	tail_.store(head_.load(std::memory_order_acquire), std::memory_order_relaxed);
+}
+
+//Tracer
+uint64_t Tracer::Now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - trace_start).count();
+}
+
+TraceBuffer& Tracer::LocalBuffer() {
+	thread_local BufferLease lease;
+	if (lease.buffer == nullptr) {
+		std::lock_guard lock(buffers_mutex);
+		if (!free_buffers.empty()) {
+			lease.buffer = free_buffers.back();
+			free_buffers.pop_back();
+		}
+		else {
+			buffers.push_back(std::make_unique<TraceBuffer>(static_cast<uint32_t>(buffers.size() + 1)));
+			lease.buffer = buffers.back().get();
+		}
+	}
+	return *lease.buffer;
+}
+
+void Tracer::WriteChromeTrace(std::ostream& output) {
+	std::lock_guard lock(buffers_mutex);
+	output << "{\"traceEvents\":[";
+	bool first = true;
+	for (const auto& buffer : buffers) {
+		buffer->ForEach([&](const TraceBuffer::Event& event) {
+			if (event.name == nullptr) {
+				return;
+			}
+			output << (first ? "\n" : ",\n");
+			first = false;
+			output << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->GetThreadId() << ",\"ts\":";
+			WriteMicroseconds(output, event.start_ns);
+			output << ",\"dur\":";
+			WriteMicroseconds(output, event.duration_ns);
+			if (event.pos.IsValid()) {
+				output << ",\"args\":{\"cell\":\"" << event.pos.ToString() << "\"}";
+			}
+			output << '}';
+		});
+	}
+	output << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+void Tracer::Clear() {
+	std::lock_guard lock(buffers_mutex);
+	for (const auto& buffer : buffers) {
+		buffer->Clear();
+	}
+}
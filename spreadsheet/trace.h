@@ -0,0 +1,139 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+
+// Трассировка пересчёта. Точки трассировки - объекты TraceScope, которые
+// записывают событие с именем и длительностью своей области видимости.
+// Включается опцией CMake SPREADSHEET_TRACING; без неё TraceScope пустой
+// и компилятор полностью убирает точки трассировки.
+#ifdef SPREADSHEET_TRACING
+inline constexpr bool TRACING_ENABLED = true;
+#else
+inline constexpr bool TRACING_ENABLED = false;
+#endif
+
+// Кольцевой буфер событий одного потока. Пишет только поток-владелец, без
+// блокировок; при переполнении затираются самые старые события. Каждый слот
+// защищён номером последовательности, поэтому читатель пропускает события,
+// которые писатель затирает во время чтения, а не читает их наполовину.
+class TraceBuffer {
+public:
+    static const size_t CAPACITY = 1 << 16;
+
+    struct Event {
+        const char* name;
+        uint64_t start_ns;
+        uint64_t duration_ns;
+        Position pos;
+    };
+
+    explicit TraceBuffer(uint32_t thread_id);
+
+    void Record(const Event& event);
+
+    uint32_t GetThreadId() const;
+
+    // Копирует события, записанные после последнего Clear(), в порядке записи.
+    template <typename F>
+    void ForEach(F&& f) const;
+
+    void Clear();
+
+private:
+    static Position UnpackPosition(uint64_t pos);
+
+    struct Slot {
+        // 2 * (номер события + 1), пока событие записано; на единицу меньше,
+        // пока оно пишется.
+        std::atomic<uint64_t> sequence = 0;
+        std::atomic<const char*> name = nullptr;
+        std::atomic<uint64_t> start_ns = 0;
+        std::atomic<uint64_t> duration_ns = 0;
+        std::atomic<uint64_t> pos = 0;
+    };
+
+    const uint32_t thread_id_;
+    std::array<Slot, CAPACITY> slots_;
+    std::atomic<uint64_t> head_ = 0;
+    std::atomic<uint64_t> tail_ = 0;
+};
+
+// Реестр буферов всех потоков и экспорт событий. Буфер завершившегося
+// потока достаётся следующему новому потоку вместе с номером потока, поэтому
+// число буферов не превышает числа потоков, живших одновременно.
+class Tracer {
+public:
+    // Время в наносекундах от запуска программы.
+    static uint64_t Now();
+
+    static TraceBuffer& LocalBuffer();
+
+    // Записывает накопленные события в формате Chrome Trace Event JSON,
+    // который открывают chrome://tracing и Perfetto.
+    static void WriteChromeTrace(std::ostream& output);
+
+    // Отбрасывает накопленные события.
+    static void Clear();
+};
+
+template <bool Enabled>
+class BasicTraceScope;
+
+template <>
+class BasicTraceScope<true> {
+public:
+    // name должен быть строковым литералом: буфер хранит только указатель.
+    explicit BasicTraceScope(const char* name, Position pos = Position::NONE)
+        : name_(name)
+        , pos_(pos)
+        , start_ns_(Tracer::Now()) {
+    }
+
+    ~BasicTraceScope() {
+        Tracer::LocalBuffer().Record({ name_, start_ns_, Tracer::Now() - start_ns_, pos_ });
+    }
+
+    BasicTraceScope(const BasicTraceScope&) = delete;
+    BasicTraceScope& operator=(const BasicTraceScope&) = delete;
+
+private:
+    const char* name_;
+    Position pos_;
+    uint64_t start_ns_;
+};
+
+template <>
+class BasicTraceScope<false> {
+public:
+    explicit BasicTraceScope(const char*, Position = Position::NONE) {}
+
+    BasicTraceScope(const BasicTraceScope&) = delete;
+    BasicTraceScope& operator=(const BasicTraceScope&) = delete;
+};
+
+using TraceScope = BasicTraceScope<TRACING_ENABLED>;
+
+template <typename F>
+void TraceBuffer::ForEach(F&& f) const {
+    const uint64_t head = head_.load(std::memory_order_acquire);
+    uint64_t begin = tail_.load(std::memory_order_relaxed);
+    if (head - begin > CAPACITY) {
+        begin = head - CAPACITY;
+    }
+    for (uint64_t i = begin; i < head; ++i) {
+        const Slot& slot = slots_[i % CAPACITY];
+        const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+        const Event event{ slot.name.load(std::memory_order_acquire), slot.start_ns.load(std::memory_order_acquire),
+                           slot.duration_ns.load(std::memory_order_acquire), UnpackPosition(slot.pos.load(std::memory_order_acquire)) };
+        //The writer has moved on to a later event in this slot
+        if (sequence != 2 * (i + 1) || slot.sequence.load(std::memory_order_relaxed) != sequence) {
+            continue;
+        }
+        f(event);
+    }
+}
@@ -0,0 +1,90 @@
+#include "workbook.h"
+
+#include <cctype>
+#include <future>
+#include <numeric>
+#include <stdexcept>
+
+using namespace std::literals;
+
+Sheet& Workbook::AddSheet(std::string name) {
+	if (!IsValidName(name)) {
+		throw std::invalid_argument("Invalid sheet name: "s + name);
+	}
+	if (sheets_.count(name)) {
+		throw std::invalid_argument("Sheet already exists: "s + name);
+	}
+	auto sheet = std::make_unique<Sheet>(this, name);
+	Sheet& result = *sheet;
+	sheets_.emplace(std::move(name), std::move(sheet));
+	return result;
+}
+
+Sheet* Workbook::GetSheet(std::string_view name) const {
+	auto it = sheets_.find(name);
+	return it != sheets_.end() ? it->second.get() : nullptr;
+}
+
+std::vector<std::string> Workbook::GetSheetNames() const {
+	std::vector<std::string> names;
+	for (const auto& [name, sheet] : sheets_) {
+		names.push_back(name);
+	}
+	return names;
+}
+
+void Workbook::Recalculate() {
+	std::vector<Sheet*> sheets;
+	std::map<std::string_view, size_t> indexes;
+	for (const auto& [name, sheet] : sheets_) {
+		indexes[name] = sheets.size();
+		sheets.push_back(sheet.get());
+	}
+
+	//Sheets connected by references (in any direction) form one group
+	std::vector<size_t> parent(sheets.size());
+	std::iota(parent.begin(), parent.end(), 0);
+	auto find = [&parent](size_t i) {
+		while (parent[i] != i) {
+			parent[i] = parent[parent[i]];
+			i = parent[i];
+		}
+		return i;
+	};
+	for (size_t i = 0; i < sheets.size(); ++i) {
+		for (const auto& name : sheets[i]->GetReferencedSheets()) {
+			if (auto it = indexes.find(name); it != indexes.end()) {
+				parent[find(i)] = find(it->second);
+			}
+		}
+	}
+
+	std::map<size_t, std::vector<Sheet*>> groups;
+	for (size_t i = 0; i < sheets.size(); ++i) {
+		groups[find(i)].push_back(sheets[i]);
+	}
+
+	std::vector<std::future<void>> tasks;
+	for (auto& [root, group] : groups) {
+		tasks.push_back(std::async(std::launch::async, [&group = group] {
+			for (Sheet* sheet : group) {
+				sheet->Recalculate();
+			}
+		}));
+	}
+	for (auto& task : tasks) {
+		task.get();
+	}
+}
+
+bool Workbook::IsValidName(std::string_view name) {
+	if (name.empty() || std::isdigit(static_cast<unsigned char>(name.front()))) {
+		return false;
+	}
+	for (char c : name) {
+		if (!(std::isalnum(static_cast<unsigned char>(c)) && static_cast<unsigned char>(c) < 128) && c != '_') {
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Книга из нескольких листов. Формулы листа могут ссылаться на ячейки других
+// листов книги: Sheet2!A1. Зависимости между листами отслеживаются так же,
+// как внутри листа: изменение ячейки сбрасывает кеш зависимых формул на всех
+// листах, а циклические ссылки через несколько листов запрещены.
+class Workbook {
+public:
+    // Добавляет пустой лист. Имя должно состоять из латинских букв, цифр и
+    // знака подчёркивания и не начинаться с цифры. Если имя некорректно или
+    // уже занято, бросается std::invalid_argument.
+    Sheet& AddSheet(std::string name);
+
+    Sheet* GetSheet(std::string_view name) const;
+    std::vector<std::string> GetSheetNames() const;
+
+    // Пересчитывает формулы всех листов. Листы, которые не связаны ссылками
+    // (ни напрямую, ни через другие листы), пересчитываются параллельно.
+    void Recalculate();
+
+private:
+    static bool IsValidName(std::string_view name);
+
+    std::map<std::string, std::unique_ptr<Sheet>, std::less<>> sheets_;
+};